@@ -0,0 +1,144 @@
+#pragma once
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <rados/librados.hpp>
+#include <set>
+
+// 控制同时在途的aio请求数量, 请求完成以后按完成的先后顺序取回
+// 完成回调只负责通知, 真正处理结果是在调用wait_one的线程里
+class aio_window
+{
+public:
+        explicit aio_window(size_t max_in_flight) : max_in_flight(max_in_flight) {}
+
+        ~aio_window()
+        {
+                uint64_t tag;
+                int ret;
+                while (in_flight() > 0)
+                {
+                        wait_one(tag, ret);
+                }
+        }
+
+        size_t in_flight()
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                return submitted;
+        }
+
+        bool full()
+        {
+                return in_flight() >= max_in_flight;
+        }
+
+        // 发起一个aio请求, fn负责把completion交给librados
+        // tag由调用方自己定义(一般是偏移量), 完成的时候原样返回
+        int submit(uint64_t tag, const std::function<int(librados::AioCompletion *)> &fn)
+        {
+                slot *s = new slot{this, tag, nullptr};
+                s->completion = librados::Rados::aio_create_completion(s, &aio_window::on_complete);
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        submitted++;
+                        outstanding.insert(s);
+                }
+                int ret = fn(s->completion);
+                if (ret < 0)
+                {
+                        // 没有发出去, 回调不会再来了
+                        s->completion->release();
+                        std::lock_guard<std::mutex> lock(mutex);
+                        outstanding.erase(s);
+                        delete s;
+                        submitted--;
+                }
+                return ret;
+        }
+
+        // 取消一个还没取回的请求, 被取消的请求照样会从wait_one返回(一般是-ECANCELED)
+        // 已经完成的请求取消不了, 结果照常返回; 只能在调用wait_one的线程里用
+        int cancel(librados::IoCtx &io_ctx, uint64_t tag)
+        {
+                librados::AioCompletion *c = nullptr;
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        for (slot *s : outstanding)
+                        {
+                                if (s->tag == tag)
+                                {
+                                        c = s->completion;
+                                        break;
+                                }
+                        }
+                }
+                if (c == nullptr)
+                {
+                        return -ENOENT;
+                }
+                // slot只在take里释放, 和这里是同一个线程, 不用持锁
+                return io_ctx.aio_cancel(c);
+        }
+
+        // 等待任意一个请求完成, 返回它的tag和返回值
+        void wait_one(uint64_t &tag, int &ret)
+        {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this] { return !done.empty(); });
+                take(tag, ret);
+        }
+
+        // 带超时的等待, 超时返回false
+        template <class Rep, class Period>
+        bool wait_one_for(const std::chrono::duration<Rep, Period> &timeout, uint64_t &tag, int &ret)
+        {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (!cond.wait_for(lock, timeout, [this] { return !done.empty(); }))
+                {
+                        return false;
+                }
+                take(tag, ret);
+                return true;
+        }
+
+private:
+        struct slot
+        {
+                aio_window *window;
+                uint64_t tag;
+                librados::AioCompletion *completion;
+        };
+
+        static void on_complete(librados::completion_t, void *arg)
+        {
+                slot *s = static_cast<slot *>(arg);
+                std::lock_guard<std::mutex> lock(s->window->mutex);
+                s->window->done.push_back(s);
+                s->window->cond.notify_all();
+        }
+
+        // 调用时必须持有锁
+        void take(uint64_t &tag, int &ret)
+        {
+                slot *s = done.front();
+                done.pop_front();
+                submitted--;
+                outstanding.erase(s);
+                tag = s->tag;
+                ret = s->completion->get_return_value();
+                s->completion->release();
+                delete s;
+        }
+
+        size_t max_in_flight;
+        size_t submitted = 0;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::deque<slot *> done;
+        std::set<slot *> outstanding; // 已经发出还没取回的请求
+};
@@ -0,0 +1,396 @@
+#pragma once
+#include "aio_window.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <hiredis/hiredis.h>
+#include <iostream>
+#include <map>
+#include <poll.h>
+#include <rados/librados.hpp>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// 日志流追加上传的参数
+struct append_options
+{
+        uint64_t batch_size = 4 * 1024 * 1024;  // 攒够多少字节发一次append
+        uint64_t roll_size = 256 * 1024 * 1024; // 单个对象写到多大换下一个
+        int flush_interval_ms = 1000;           // 不够一批最多等这么久就发
+        int roll_interval_s = 3600;             // 一个对象最多写这么久就换下一个
+        size_t max_in_flight = 8;               // 同时在途的append数
+        bool follow = false;                    // 读到文件末尾不退出, 等新数据(tail -f)
+        uint64_t alignment = 0;                 // 池的写对齐要求, 纠删码池除了最后一次append都要对齐
+};
+
+// 把没有尽头的数据源(管道, socket, 还在增长的文件)用aio_append写进一串对象
+// 对象名是 <prefix>.<序号>, 写满或者写够时间就换下一个对象
+// redis里:
+//   <prefix>:head     HASH: seq 最后分配的序号, end_offset 记进segments的数据在流里的末尾,
+//                     segment:<序号> "对象名 流内起始偏移" 开始写了还没记进segments的对象(正在写的, 封口了还有append在途的)
+//   <prefix>:segments 写完的对象, 按序号顺序RPUSH "对象名 流内起始偏移 大小"
+// 重启的时候上次没记进segments的对象按序号顺序, 按它们的实际长度补记到segments里, 数据源是文件的话从流的末尾接着读
+// (流是从文件开头读起的, 流内偏移就是文件偏移), 不会重复也不会丢
+class append_ingester
+{
+public:
+        append_ingester(librados::IoCtx &io_ctx, redisContext *redis_conn, const std::string &prefix,
+                        const append_options &opts)
+            : io_ctx(io_ctx), redis_conn(redis_conn), prefix(prefix), opts(opts), window(opts.max_in_flight)
+        {
+                if (opts.alignment != 0)
+                {
+                        // 每批都是对齐大小的整数倍
+                        this->opts.batch_size = (opts.batch_size + opts.alignment - 1) / opts.alignment * opts.alignment;
+                }
+        }
+
+        // 从fd读到结束(非follow模式下读到EOF), 最后把所有数据写完并封口最后一个对象
+        void run(int fd)
+        {
+                // 接着上一次的流位置继续
+                redisReply *reply = (redisReply *)redisCommand(redis_conn, "HGETALL %s:head", prefix.c_str());
+                if (reply == nullptr || reply->type != REDIS_REPLY_ARRAY)
+                {
+                        std::cerr << "Couldn't load segment head from Redis!" << std::endl;
+                        exit(EXIT_FAILURE);
+                }
+                std::map<uint64_t, std::pair<std::string, uint64_t>> unpublished; // 序号 -> (对象名, 流内起始偏移)
+                for (size_t i = 0; i + 1 < reply->elements; i += 2)
+                {
+                        std::string field(reply->element[i]->str, reply->element[i]->len);
+                        std::string value(reply->element[i + 1]->str, reply->element[i + 1]->len);
+                        if (field == "end_offset")
+                        {
+                                stream_offset = std::stoull(value);
+                        }
+                        else if (field.compare(0, 8, "segment:") == 0)
+                        {
+                                size_t space = value.rfind(' ');
+                                unpublished[std::stoull(field.substr(8))] = {value.substr(0, space), std::stoull(value.substr(space + 1))};
+                        }
+                }
+                freeReplyObject(reply);
+                recover_segments(unpublished);
+                // 管道和终端不能seek, 只能从现在的位置接着读
+                if (lseek(fd, stream_offset, SEEK_SET) < 0 && errno != ESPIPE)
+                {
+                        std::cerr << "Couldn't seek the input to " << stream_offset << "! error " << errno << std::endl;
+                        exit(EXIT_FAILURE);
+                }
+                open_segment();
+                std::vector<char> buffer(1024 * 1024);
+                auto last_flush = std::chrono::steady_clock::now();
+                while (true)
+                {
+                        struct pollfd pfd = {fd, POLLIN, 0};
+                        int ready = poll(&pfd, 1, opts.flush_interval_ms);
+                        if (ready < 0 && errno != EINTR)
+                        {
+                                std::cerr << "Couldn't poll the input! error " << errno << std::endl;
+                                exit(EXIT_FAILURE);
+                        }
+                        if (ready > 0)
+                        {
+                                ssize_t n = read(fd, buffer.data(), buffer.size());
+                                if (n < 0 && errno != EINTR && errno != EAGAIN)
+                                {
+                                        std::cerr << "Couldn't read the input! error " << errno << std::endl;
+                                        exit(EXIT_FAILURE);
+                                }
+                                if (n == 0)
+                                {
+                                        if (!opts.follow)
+                                        {
+                                                break;
+                                        }
+                                        // 普通文件读到末尾poll还是会返回可读, 歇一会儿再看
+                                        usleep(200 * 1000);
+                                }
+                                if (n > 0)
+                                {
+                                        pending.append(buffer.data(), n);
+                                }
+                        }
+
+                        // 攒够一批就发
+                        while (pending.length() >= opts.batch_size)
+                        {
+                                submit(opts.batch_size);
+                        }
+                        // 先看要不要换对象, 换的时候还能在pending里找记录边界; 先发了不够一批的数据pending就空了
+                        if (segment_size >= opts.roll_size ||
+                            (segment_size > 0 && time(nullptr) - segment_opened >= opts.roll_interval_s))
+                        {
+                                roll();
+                        }
+                        auto now = std::chrono::steady_clock::now();
+                        if (now - last_flush >= std::chrono::milliseconds(opts.flush_interval_ms))
+                        {
+                                flush_partial();
+                                last_flush = now;
+                        }
+                        reap_ready();
+                }
+                // 数据源结束了, 尾巴写进当前对象
+                if (pending.length() > 0)
+                {
+                        submit(pending.length());
+                }
+                seal_segment();
+                while (window.in_flight() > 0)
+                {
+                        reap_one();
+                }
+        }
+
+private:
+        struct segment
+        {
+                std::string object_name;
+                uint64_t stream_offset; // 这个对象在整个流里的起始位置
+                uint64_t size = 0;
+                size_t outstanding = 0;
+                bool sealed = false;
+        };
+
+        // 不够一批的数据也按时发出去; 要求对齐的池只能发对齐的部分
+        void flush_partial()
+        {
+                uint64_t len = pending.length();
+                if (opts.alignment != 0)
+                {
+                        len -= len % opts.alignment;
+                }
+                if (len > 0)
+                {
+                        submit(len);
+                }
+        }
+
+        // 换下一个对象, 尽量在记录边界(换行)处切开, 不让一条日志跨两个对象
+        void roll()
+        {
+                if (opts.alignment == 0 && pending.length() > 0)
+                {
+                        std::string tail = pending.to_str();
+                        size_t cut = tail.rfind('\n');
+                        uint64_t len = (cut == std::string::npos) ? tail.size() : cut + 1;
+                        submit(len);
+                }
+                else if (pending.length() > 0)
+                {
+                        // 纠删码池上最后一次append可以不对齐, 直接把剩下的全部写进去
+                        submit(pending.length());
+                }
+                seal_segment();
+                open_segment();
+        }
+
+        // 上次退出的时候还没记进segments的对象: 已经落盘的append都在对象里, 按序号顺序, 按对象的实际长度封口
+        // 前一个对象最后几个append没落盘的话, 后面的对象在流里就接不上了, 这些对象删掉, 从前一个对象的末尾重新读
+        void recover_segments(const std::map<uint64_t, std::pair<std::string, uint64_t>> &unpublished)
+        {
+                bool gap = false;
+                for (auto &entry : unpublished)
+                {
+                        const std::string &object_name = entry.second.first;
+                        uint64_t size = 0;
+                        int ret = io_ctx.stat(object_name, &size, nullptr);
+                        if (ret < 0 && ret != -ENOENT)
+                        {
+                                std::cerr << "Couldn't stat object '" << object_name << "'! error " << ret << std::endl;
+                                exit(EXIT_FAILURE);
+                        }
+                        if (gap || entry.second.second != stream_offset)
+                        {
+                                gap = true;
+                                ret = io_ctx.remove(object_name);
+                                if (ret < 0 && ret != -ENOENT)
+                                {
+                                        std::cerr << "Couldn't remove object '" << object_name << "'! error " << ret << std::endl;
+                                        exit(EXIT_FAILURE);
+                                }
+                                forget_segment(entry.first);
+                                std::cout << "Removed object '" << object_name << "', the object before it is incomplete." << std::endl;
+                                continue;
+                        }
+                        current_seq = entry.first;
+                        segment &s = segments[entry.first];
+                        s.object_name = object_name;
+                        s.stream_offset = stream_offset;
+                        s.size = size;
+                        stream_offset += size;
+                        std::cout << "Recovered object '" << object_name << "' with " << size << " bytes." << std::endl;
+                        seal_segment();
+                }
+        }
+
+        // 对象不用记进segments了(空的或者重启的时候删了), 从head里去掉
+        void forget_segment(uint64_t seq)
+        {
+                redisReply *reply = (redisReply *)redisCommand(redis_conn, "HDEL %s:head segment:%llu", prefix.c_str(), (unsigned long long)seq);
+                if (reply == nullptr || reply->type == REDIS_REPLY_ERROR)
+                {
+                        std::cerr << "Couldn't save segment head to Redis!" << std::endl;
+                        exit(EXIT_FAILURE);
+                }
+                freeReplyObject(reply);
+        }
+
+        void open_segment()
+        {
+                redisReply *reply = (redisReply *)redisCommand(redis_conn, "HINCRBY %s:head seq 1", prefix.c_str());
+                if (reply == nullptr || reply->type != REDIS_REPLY_INTEGER)
+                {
+                        std::cerr << "Couldn't allocate segment number from Redis!" << std::endl;
+                        exit(EXIT_FAILURE);
+                }
+                uint64_t seq = reply->integer;
+                freeReplyObject(reply);
+
+                char name[32];
+                snprintf(name, sizeof(name), ".%08llu", (unsigned long long)seq);
+                current_seq = seq;
+                segment &s = segments[seq];
+                s.object_name = prefix + name;
+                s.stream_offset = stream_offset;
+                segment_size = 0;
+                segment_opened = time(nullptr);
+
+                // 写第一个字节之前先记下来, 封口以后记进segments之前一直留着, 重启的时候靠它找回这个对象
+                std::string entry = s.object_name + " " + std::to_string(s.stream_offset);
+                reply = (redisReply *)redisCommand(redis_conn, "HSET %s:head segment:%llu %s", prefix.c_str(), (unsigned long long)seq,
+                                                   entry.c_str());
+                if (reply == nullptr || reply->type == REDIS_REPLY_ERROR)
+                {
+                        std::cerr << "Couldn't save segment head to Redis!" << std::endl;
+                        exit(EXIT_FAILURE);
+                }
+                freeReplyObject(reply);
+                std::cout << "Appending to object '" << s.object_name << "'." << std::endl;
+        }
+
+        void seal_segment()
+        {
+                segments[current_seq].sealed = true;
+                publish_sealed();
+        }
+
+        // 从pending头上取len字节追加到当前对象
+        void submit(uint64_t len)
+        {
+                while (window.full())
+                {
+                        reap_one();
+                }
+                uint64_t op = next_op++;
+                librados::bufferlist &bl = in_flight[op].data;
+                pending.splice(0, len, &bl);
+                in_flight[op].seq = current_seq;
+                segment &s = segments[current_seq];
+                int ret = window.submit(op, [&](librados::AioCompletion *c) {
+                        return io_ctx.aio_append(s.object_name, c, bl, len);
+                });
+                if (ret < 0)
+                {
+                        std::cerr << "Couldn't start append object! error " << ret << std::endl;
+                        exit(EXIT_FAILURE);
+                }
+                s.outstanding++;
+                s.size += len;
+                segment_size += len;
+                stream_offset += len;
+        }
+
+        void reap_ready()
+        {
+                uint64_t op;
+                int ret;
+                while (window.wait_one_for(std::chrono::milliseconds(0), op, ret))
+                {
+                        finish_op(op, ret);
+                }
+        }
+
+        void reap_one()
+        {
+                uint64_t op;
+                int ret;
+                window.wait_one(op, ret);
+                finish_op(op, ret);
+        }
+
+        void finish_op(uint64_t op, int ret)
+        {
+                if (ret < 0)
+                {
+                        std::cerr << "Couldn't append object! error " << ret << std::endl;
+                        exit(EXIT_FAILURE);
+                }
+                segments[in_flight[op].seq].outstanding--;
+                in_flight.erase(op);
+                publish_sealed();
+        }
+
+        // 封口并且全部写完的对象按序号顺序记到redis, 读的一方按这个列表读
+        void publish_sealed()
+        {
+                auto it = segments.begin();
+                while (it != segments.end() && it->second.sealed && it->second.outstanding == 0)
+                {
+                        const segment &s = it->second;
+                        if (s.size == 0)
+                        {
+                                // 一个字节都没写的对象不存在, 不用记
+                                forget_segment(it->first);
+                                it = segments.erase(it);
+                                continue;
+                        }
+                        // 记列表, 推进end_offset, 从head里去掉, 重启的时候就不会再补记一次; 三步要一起做
+                        static const char *script =
+                            "redis.call('RPUSH', KEYS[2], ARGV[1]) "
+                            "redis.call('HSET', KEYS[1], 'end_offset', ARGV[2]) "
+                            "redis.call('HDEL', KEYS[1], ARGV[3]) "
+                            "return 1";
+                        std::string entry = s.object_name + " " + std::to_string(s.stream_offset) + " " + std::to_string(s.size);
+                        std::string head_key = prefix + ":head", segments_key = prefix + ":segments";
+                        redisReply *reply = (redisReply *)redisCommand(redis_conn, "EVAL %s 2 %s %s %s %llu %s", script, head_key.c_str(),
+                                                                       segments_key.c_str(), entry.c_str(),
+                                                                       (unsigned long long)(s.stream_offset + s.size),
+                                                                       ("segment:" + std::to_string(it->first)).c_str());
+                        if (reply == nullptr || reply->type == REDIS_REPLY_ERROR)
+                        {
+                                std::cerr << "Couldn't save segment to Redis!" << std::endl;
+                                exit(EXIT_FAILURE);
+                        }
+                        freeReplyObject(reply);
+                        std::cout << "Sealed object '" << s.object_name << "' with " << s.size << " bytes." << std::endl;
+                        it = segments.erase(it);
+                }
+        }
+
+        struct append_op
+        {
+                uint64_t seq;
+                librados::bufferlist data;
+        };
+
+        librados::IoCtx &io_ctx;
+        redisContext *redis_conn;
+        std::string prefix;
+        append_options opts;
+        librados::bufferlist pending;
+        std::map<uint64_t, append_op> in_flight;
+        std::map<uint64_t, segment> segments;
+        uint64_t current_seq = 0;
+        uint64_t next_op = 0;
+        uint64_t stream_offset = 0;
+        uint64_t segment_size = 0;
+        time_t segment_opened = 0;
+        aio_window window;
+};
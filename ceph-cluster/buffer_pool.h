@@ -0,0 +1,174 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <rados/librados.hpp>
+#include <sys/uio.h>
+#include <vector>
+
+// O_DIRECT要求缓冲区地址, 偏移量和长度都按块对齐, 4K对现在的盘都够用
+const size_t direct_io_alignment = 4096;
+
+inline uint64_t round_up_to(uint64_t n, uint64_t alignment)
+{
+        return (n + alignment - 1) / alignment * alignment;
+}
+
+// 固定大小, 按页对齐的缓冲区池, 最多count块
+// 第一次用到的时候才分配, 用完还回来下次直接复用, 不再每块数据malloc/free一次
+// 整个传输只用这几块内存, 占用不随文件大小变化; 可以在完成回调的线程里release
+class aligned_buffer_pool
+{
+public:
+        struct stats_t
+        {
+                uint64_t hits = 0;        // 复用了还回来的缓冲区
+                uint64_t allocations = 0; // 新分配的缓冲区
+                uint64_t exhausted = 0;   // 池子用光了取不到
+                size_t in_use = 0;
+                size_t high_water = 0; // 同时在用的最大块数
+        };
+
+        aligned_buffer_pool(size_t buffer_size, size_t count, size_t alignment = direct_io_alignment)
+            : buffer_size(round_up_to(buffer_size, alignment)), alignment(alignment), capacity(count)
+        {
+        }
+
+        ~aligned_buffer_pool()
+        {
+                for (char *p : buffers)
+                {
+                        free(p);
+                }
+        }
+
+        aligned_buffer_pool(const aligned_buffer_pool &) = delete;
+        aligned_buffer_pool &operator=(const aligned_buffer_pool &) = delete;
+
+        // 取一块空闲缓冲区, 都在用(或者分配不出来)的时候返回nullptr
+        char *acquire()
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                char *p = nullptr;
+                if (!free_list.empty())
+                {
+                        p = free_list.back();
+                        free_list.pop_back();
+                        stats.hits++;
+                }
+                else if (buffers.size() < capacity && (p = allocate()) != nullptr)
+                {
+                        stats.allocations++;
+                }
+                else
+                {
+                        stats.exhausted++;
+                        return nullptr;
+                }
+                stats.in_use++;
+                stats.high_water = std::max(stats.high_water, stats.in_use);
+                return p;
+        }
+
+        void release(char *p)
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                free_list.push_back(p);
+                stats.in_use--;
+        }
+
+        // 把一块缓冲区的前len字节包成bufferlist交给librados, 不拷贝
+        // 请求完成以后librados就不再引用它了, 这时才能release
+        static librados::bufferlist wrap(char *p, size_t len)
+        {
+                librados::bufferlist bl;
+                bl.push_back(ceph::buffer::create_static(len, p));
+                return bl;
+        }
+
+        size_t size() const
+        {
+                return buffer_size;
+        }
+
+        size_t available()
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                return free_list.size() + (capacity - buffers.size());
+        }
+
+        stats_t get_stats()
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                return stats;
+        }
+
+        void print_stats(const char *name)
+        {
+                stats_t s = get_stats();
+                std::cout << name << " buffer pool: " << s.hits << " hits, " << s.allocations << " allocations, "
+                          << s.exhausted << " exhausted, high water " << s.high_water << " x " << buffer_size
+                          << " bytes." << std::endl;
+        }
+
+        // 缓冲区在池里的编号, 和iovecs()的下标一致, 用作io_uring注册缓冲区的buf_index
+        int index_of(const char *p)
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (size_t i = 0; i < buffers.size(); i++)
+                {
+                        if (buffers[i] == p)
+                        {
+                                return static_cast<int>(i);
+                        }
+                }
+                return -1;
+        }
+
+        // 注册给io_uring要知道所有缓冲区的地址, 所以这里会把剩下的也一次分配好
+        std::vector<iovec> iovecs()
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                while (buffers.size() < capacity)
+                {
+                        // 分配不出来就少几块, 取的时候acquire返回nullptr
+                        char *p = allocate();
+                        if (p == nullptr)
+                        {
+                                break;
+                        }
+                        free_list.insert(free_list.begin(), p);
+                        stats.allocations++;
+                }
+                std::vector<iovec> iovs;
+                for (char *p : buffers)
+                {
+                        iovs.push_back({p, buffer_size});
+                }
+                return iovs;
+        }
+
+private:
+        // 调用时必须持有锁; 分配失败返回nullptr
+        char *allocate()
+        {
+                void *p = nullptr;
+                if (posix_memalign(&p, alignment, buffer_size) != 0)
+                {
+                        std::cerr << "Couldn't allocate aligned buffer!" << std::endl;
+                        return nullptr;
+                }
+                buffers.push_back(static_cast<char *>(p));
+                return static_cast<char *>(p);
+        }
+
+        size_t buffer_size;
+        size_t alignment;
+        size_t capacity;
+        std::mutex mutex;
+        std::vector<char *> buffers;
+        std::vector<char *> free_list;
+        stats_t stats;
+};
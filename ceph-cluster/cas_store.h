@@ -0,0 +1,434 @@
+#pragma once
+#include "crypto.h"
+#include "dedup_claim.h"
+#include "file_hash.h"
+#include "redis_schema.h"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <hiredis/hiredis.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <rados/librados.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+// 内容寻址存储: 文件按内容存成对象 cas.<树形哈希>, 逻辑上的文件名只是指向内容的引用
+// 同样内容的文件只存一份, 每份内容记着被几个文件名引用, 引用数降到0以后由gc删掉
+// redis里每个池一套键, 前缀是 <ns>:cas:<池>:
+//   fh:<桶>   HASH  摘要 -> ""(内容已经存好) 或者 "p:<认领者>:<到期>"(正在上传/正在被gc删除), 格式同dedup_claim
+//   ref:<桶>  HASH  摘要 -> 引用数
+//   name:<桶> HASH  文件名 -> 摘要(32字节二进制)
+//   gc        ZSET  引用数降到0的摘要, 分数是降到0的时间
+// 引用数的增减和文件名的改动在同一个lua脚本里做, 要么都成功要么都没做
+const char *const cas_object_prefix = "cas.";
+
+// lua里用的公共函数: 摘要的桶号和字段名, 算法和redis_schema.h一样
+#define CAS_LUA_HELPERS                                                                         \
+        "local ns = ARGV[1] "                                                                   \
+        "local function bucket(d) return tostring(string.byte(d, 1) * 256 + string.byte(d, 2)) end " \
+        "local function field(d) return string.sub(d, 3) end "                                  \
+        "local function unref(d) "                                                              \
+        "  local n = redis.call('HINCRBY', ns .. ':ref:' .. bucket(d), field(d), -1) "          \
+        "  if n <= 0 then "                                                                     \
+        "    redis.call('HDEL', ns .. ':ref:' .. bucket(d), field(d)) "                         \
+        "    redis.call('ZADD', ns .. ':gc', redis.call('TIME')[1], d) "                        \
+        "  end "                                                                                \
+        "end "
+
+inline std::string cas_namespace(librados::IoCtx &io_ctx)
+{
+        return std::string(redis_namespace) + ":cas:" + io_ctx.get_pool_name();
+}
+
+class cas_store
+{
+public:
+        // 把本地文件上传成指定对象的函数, 成功返回0
+        using upload_fn = std::function<int(const std::string &local_path, const std::string &object_name)>;
+
+        // 给了cipher的话内容按加密上传, 摘要用带密钥的HMAC(见chunk_cipher::keyed_hash), 不同密钥存的同样内容各是各的
+        cas_store(librados::IoCtx &io_ctx, redisContext *redis_conn, const chunk_cipher *cipher = nullptr)
+            : io_ctx(io_ctx), redis_conn(redis_conn), ns(cas_namespace(io_ctx)), cipher(cipher)
+        {
+        }
+
+        // 存一个文件: 内容还没有就上传, 然后把文件名指向这份内容; 文件名原来指向的内容引用数减一
+        int put(const std::string &name, const std::string &local_path, const upload_fn &upload)
+        {
+                std::string hash = calculate_file_tree_hash(local_path);
+                if (hash.empty())
+                {
+                        return -EIO;
+                }
+                if (cipher != nullptr)
+                {
+                        hash = cipher->keyed_hash(hash);
+                }
+                std::string digest = hex_to_binary(hash);
+                while (true)
+                {
+                        // 同样的内容正在被上传或者被gc删除的时候等着
+                        dedup_claim claim(redis_conn, hash, std::chrono::milliseconds(60000), ns);
+                        dedup_claim::state_t state = claim.claim_or_wait();
+                        if (state == dedup_claim::FAILED)
+                        {
+                                return -EIO;
+                        }
+                        if (state == dedup_claim::CLAIMED)
+                        {
+                                int ret = upload(local_path, cas_object_prefix + hash);
+                                if (ret < 0)
+                                {
+                                        claim.release();
+                                        return ret;
+                                }
+                                if ((ret = claim.complete()) < 0)
+                                {
+                                        return ret;
+                                }
+                        }
+                        // 确认内容还在的同时加引用; 刚好被gc拿走了就重来一遍
+                        static const char *script = CAS_LUA_HELPERS
+                            "local d = ARGV[3] "
+                            "if redis.call('HGET', ns .. ':fh:' .. bucket(d), field(d)) ~= '' then return 'retry' end "
+                            "local old = redis.call('HGET', KEYS[1], ARGV[2]) "
+                            "if old == d then return 'linked' end "
+                            "redis.call('HSET', KEYS[1], ARGV[2], d) "
+                            "redis.call('HINCRBY', ns .. ':ref:' .. bucket(d), field(d), 1) "
+                            "redis.call('ZREM', ns .. ':gc', d) "
+                            "if old then unref(old) end "
+                            "return 'linked'";
+                        std::string result = eval(script, name, digest);
+                        if (result == "linked")
+                        {
+                                return 0;
+                        }
+                        if (result != "retry")
+                        {
+                                return -EIO;
+                        }
+                }
+        }
+
+        // 文件名对应的内容对象, 没有这个文件返回-ENOENT
+        int resolve(const std::string &name, std::string &object_name)
+        {
+                redisReply *reply = (redisReply *)redisCommand(redis_conn, "HGET %s %b", name_key(name).c_str(), name.data(), name.size());
+                int ret = -ENOENT;
+                if (reply == nullptr)
+                {
+                        ret = -EIO;
+                }
+                else if (reply->type == REDIS_REPLY_STRING)
+                {
+                        object_name = cas_object_prefix + hash_to_hex(reinterpret_cast<const unsigned char *>(reply->str), reply->len);
+                        ret = 0;
+                }
+                freeReplyObject(reply);
+                return ret;
+        }
+
+        // 删掉一个文件名, 内容的引用数减一, 降到0以后等gc删
+        int unlink(const std::string &name)
+        {
+                static const char *script = CAS_LUA_HELPERS
+                    "local old = redis.call('HGET', KEYS[1], ARGV[2]) "
+                    "if not old then return 'missing' end "
+                    "redis.call('HDEL', KEYS[1], ARGV[2]) "
+                    "unref(old) "
+                    "return 'unlinked'";
+                std::string result = eval(script, name, "");
+                if (result == "missing")
+                {
+                        return -ENOENT;
+                }
+                return result == "unlinked" ? 0 : -EIO;
+        }
+
+private:
+        std::string name_key(const std::string &name) const
+        {
+                return ns + ":name:" + std::to_string(redis_bucket_hash(name) % redis_upload_buckets);
+        }
+
+        std::string eval(const char *script, const std::string &name, const std::string &digest)
+        {
+                redisReply *reply = (redisReply *)redisCommand(redis_conn, "EVAL %s 1 %s %s %b %b", script, name_key(name).c_str(),
+                                                               ns.c_str(), name.data(), name.size(), digest.data(), digest.size());
+                std::string result;
+                if (reply != nullptr && (reply->type == REDIS_REPLY_STATUS || reply->type == REDIS_REPLY_STRING))
+                {
+                        result.assign(reply->str, reply->len);
+                }
+                else if (reply != nullptr && reply->type == REDIS_REPLY_ERROR)
+                {
+                        std::cerr << "Redis script error: " << reply->str << std::endl;
+                }
+                freeReplyObject(reply);
+                return result;
+        }
+
+        librados::IoCtx &io_ctx;
+        redisContext *redis_conn;
+        std::string ns;
+        const chunk_cipher *cipher;
+};
+
+// 垃圾回收的参数
+struct cas_gc_options
+{
+        int grace_s = 3600;            // 引用数降到0以后至少留这么久, 防止刚删的文件马上又被存一遍
+        double deletes_per_second = 50; // 限速, 不和前台的读写抢OSD
+        size_t batch = 100;            // 每次从redis取多少个候选
+        std::chrono::milliseconds lease{600000}; // 删一个对象期间在fh里占着的租约
+};
+
+// 增量, 限速的垃圾回收: 从gc队列里取过了宽限期的摘要, 确认引用数还是0, 在fh里占住(上传的人会等), 删对象, 再放开
+// 可以单独跑一轮(run_once), 也可以开一个后台线程一直跑
+class cas_gc
+{
+public:
+        cas_gc(librados::IoCtx &io_ctx, const cas_gc_options &opts = cas_gc_options())
+            : io_ctx(io_ctx), ns(cas_namespace(io_ctx)), opts(opts)
+        {
+        }
+
+        ~cas_gc()
+        {
+                stop();
+        }
+
+        // 跑一轮, 处理完当前所有到期的候选, 返回删掉的对象数
+        uint64_t run_once(redisContext *redis_conn)
+        {
+                uint64_t removed = 0;
+                auto interval = std::chrono::duration<double>(1.0 / opts.deletes_per_second);
+                auto next = std::chrono::steady_clock::now();
+                while (!stopping)
+                {
+                        std::vector<std::string> candidates = due_candidates(redis_conn);
+                        if (candidates.empty())
+                        {
+                                break;
+                        }
+                        for (const std::string &digest : candidates)
+                        {
+                                if (stopping)
+                                {
+                                        break;
+                                }
+                                // 令牌桶限速, 每删一个对象至少间隔interval
+                                std::this_thread::sleep_until(next);
+                                next = std::max(next, std::chrono::steady_clock::now()) +
+                                       std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval);
+                                if (collect(redis_conn, digest))
+                                {
+                                        removed++;
+                                }
+                        }
+                }
+                if (removed > 0)
+                {
+                        std::cout << "Garbage collected " << removed << " unreferenced objects." << std::endl;
+                }
+                return removed;
+        }
+
+        // 后台线程每隔period跑一轮
+        void start(std::chrono::seconds period = std::chrono::seconds(60))
+        {
+                stopping = false;
+                worker = std::thread([this, period] {
+                        redisContext *redis_conn = redisConnect("127.0.0.1", 6379);
+                        if (redis_conn == nullptr || redis_conn->err)
+                        {
+                                std::cerr << "Redis connection error in garbage collector!" << std::endl;
+                                redisFree(redis_conn);
+                                return;
+                        }
+                        while (!stopping)
+                        {
+                                run_once(redis_conn);
+                                std::unique_lock<std::mutex> lock(mutex);
+                                cond.wait_for(lock, period, [this] { return stopping.load(); });
+                        }
+                        redisFree(redis_conn);
+                });
+        }
+
+        void stop()
+        {
+                if (!worker.joinable())
+                {
+                        return;
+                }
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        stopping = true;
+                }
+                cond.notify_all();
+                worker.join();
+        }
+
+private:
+        std::vector<std::string> due_candidates(redisContext *redis_conn)
+        {
+                std::vector<std::string> result;
+                std::string max_score = std::to_string(time(nullptr) - opts.grace_s);
+                std::string count = std::to_string(opts.batch);
+                redisReply *reply = (redisReply *)redisCommand(redis_conn, "ZRANGEBYSCORE %s -inf %s LIMIT 0 %s",
+                                                               (ns + ":gc").c_str(), max_score.c_str(), count.c_str());
+                if (reply != nullptr && reply->type == REDIS_REPLY_ARRAY)
+                {
+                        for (size_t i = 0; i < reply->elements; i++)
+                        {
+                                result.emplace_back(reply->element[i]->str, reply->element[i]->len);
+                        }
+                }
+                freeReplyObject(reply);
+                return result;
+        }
+
+        // 删一份内容, 真的删掉了返回true
+        bool collect(redisContext *redis_conn, const std::string &digest)
+        {
+                // 引用数还是0才删; 在fh里占住这份内容, 这期间要存同样内容的人会等, 不会把刚传好的又删掉
+                static const char *claim_script = CAS_LUA_HELPERS
+                    "local d = ARGV[2] "
+                    "redis.call('ZREM', ns .. ':gc', d) "
+                    "if tonumber(redis.call('HGET', ns .. ':ref:' .. bucket(d), field(d)) or '0') > 0 then return 'referenced' end "
+                    "local t = redis.call('TIME') "
+                    "local now = tonumber(t[1]) * 1000 + math.floor(tonumber(t[2]) / 1000) "
+                    "redis.call('HSET', ns .. ':fh:' .. bucket(d), field(d), 'p:gc:' .. (now + tonumber(ARGV[3]))) "
+                    "return 'collect'";
+                if (eval(redis_conn, claim_script, digest) != "collect")
+                {
+                        return false;
+                }
+                std::string object_name =
+                    cas_object_prefix + hash_to_hex(reinterpret_cast<const unsigned char *>(digest.data()), digest.size());
+                int ret = io_ctx.remove(object_name);
+                bool removed = ret == 0 || ret == -ENOENT;
+                if (!removed)
+                {
+                        std::cerr << "Couldn't remove unreferenced object '" << object_name << "'! error " << ret << std::endl;
+                }
+                // 删掉了就把fh清掉, 以后再存要重新上传; 没删掉就恢复原状, 放回gc队列下次再试
+                static const char *finish_script = CAS_LUA_HELPERS
+                    "local d = ARGV[2] "
+                    "local k = ns .. ':fh:' .. bucket(d) "
+                    "if not string.match(redis.call('HGET', k, field(d)) or '', '^p:gc:') then return 'taken' end "
+                    "if ARGV[4] == '1' then redis.call('HDEL', k, field(d)) "
+                    "else redis.call('HSET', k, field(d), '') redis.call('ZADD', ns .. ':gc', redis.call('TIME')[1], d) end "
+                    "return 'done'";
+                eval(redis_conn, finish_script, digest, removed ? "1" : "0");
+                return removed && ret == 0;
+        }
+
+        std::string eval(redisContext *redis_conn, const char *script, const std::string &digest, const char *flag = "0")
+        {
+                std::string lease_ms = std::to_string(opts.lease.count());
+                redisReply *reply = (redisReply *)redisCommand(redis_conn, "EVAL %s 0 %s %b %s %s", script, ns.c_str(),
+                                                               digest.data(), digest.size(), lease_ms.c_str(), flag);
+                std::string result;
+                if (reply != nullptr && (reply->type == REDIS_REPLY_STATUS || reply->type == REDIS_REPLY_STRING))
+                {
+                        result.assign(reply->str, reply->len);
+                }
+                else if (reply != nullptr && reply->type == REDIS_REPLY_ERROR)
+                {
+                        std::cerr << "Redis script error: " << reply->str << std::endl;
+                }
+                freeReplyObject(reply);
+                return result;
+        }
+
+        librados::IoCtx &io_ctx;
+        std::string ns;
+        cas_gc_options opts;
+        std::thread worker;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::atomic<bool> stopping{false};
+};
+
+// 守护进程里每个用过内容寻址存储的池一个后台gc: gc队列按池分开(见cas_namespace), 只扫默认池的话别的池的垃圾永远不会删
+// 启动的时候redis里已经有gc队列的池都开上, 之后哪个池第一次有put/unlink再开
+class cas_gc_pools
+{
+public:
+        explicit cas_gc_pools(librados::Rados &cluster, const cas_gc_options &opts = cas_gc_options()) : cluster(cluster), opts(opts)
+        {
+        }
+
+        // 这个池还没有gc就开一个
+        void ensure(const std::string &pool)
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (pools.count(pool) > 0)
+                {
+                        return;
+                }
+                std::unique_ptr<librados::IoCtx> io_ctx(new librados::IoCtx);
+                int ret = cluster.ioctx_create(pool.c_str(), *io_ctx);
+                if (ret < 0)
+                {
+                        std::cerr << "Couldn't set up ioctx for garbage collecting pool '" << pool << "'! error " << ret << std::endl;
+                        return;
+                }
+                gc_pool &p = pools[pool];
+                p.io_ctx = std::move(io_ctx);
+                p.gc.reset(new cas_gc(*p.io_ctx, opts));
+                p.gc->start();
+                std::cout << "Garbage collecting content objects in pool '" << pool << "'." << std::endl;
+        }
+
+        // 找出redis里有gc队列的池: 键是 <ns>:cas:<池>:gc
+        void discover(redisContext *redis_conn)
+        {
+                std::string prefix = std::string(redis_namespace) + ":cas:";
+                std::string pattern = prefix + "*:gc";
+                std::string cursor = "0";
+                do
+                {
+                        redisReply *reply = (redisReply *)redisCommand(redis_conn, "SCAN %s MATCH %s COUNT 1000 TYPE zset",
+                                                                       cursor.c_str(), pattern.c_str());
+                        if (reply == nullptr || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2)
+                        {
+                                std::cerr << "Couldn't scan Redis for garbage collection queues!" << std::endl;
+                                freeReplyObject(reply);
+                                return;
+                        }
+                        cursor = reply->element[0]->str;
+                        std::vector<std::string> keys;
+                        for (size_t i = 0; i < reply->element[1]->elements; i++)
+                        {
+                                keys.emplace_back(reply->element[1]->element[i]->str, reply->element[1]->element[i]->len);
+                        }
+                        freeReplyObject(reply);
+                        for (const std::string &key : keys)
+                        {
+                                ensure(key.substr(prefix.size(), key.size() - prefix.size() - 3));
+                        }
+                } while (cursor != "0");
+        }
+
+private:
+        // io_ctx要比gc活得久, 成员按这个顺序析构: 先停gc再关io_ctx
+        struct gc_pool
+        {
+                std::unique_ptr<librados::IoCtx> io_ctx;
+                std::unique_ptr<cas_gc> gc;
+        };
+
+        librados::Rados &cluster;
+        cas_gc_options opts;
+        std::mutex mutex;
+        std::map<std::string, gc_pool> pools;
+};
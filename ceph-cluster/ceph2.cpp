@@ -1,40 +1,84 @@
+#include "aio_window.h"
+#include "append_ingest.h"
+#include "buffer_pool.h"
+#include "cas_store.h"
+#include "compression.h"
+#include "crypto.h"
+#include "cuckoo_filter.h"
+#include "dedup_claim.h"
+#include "file_hash.h"
+#include "hedged_read.h"
+#include "local_io.h"
+#include "pool_export.h"
+#include "pool_mirror.h"
+#include "progress.h"
+#include "retry.h"
+#include "rados_coro.h"
+#include "redis_schema.h"
+#include "transfer_daemon.h"
+#include "upload_engine.h"
+#include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <fnmatch.h>
 #include <fstream>
 #include <hiredis/hiredis.h>
 #include <iostream>
+#include <memory>
 #include <openssl/sha.h>
 #include <rados/librados.hpp>
+#include <set>
 #include <sstream>
 #include <string.h>
 #include <string>
 #include <vector>
 using namespace std;
-// 用redis存下已经上传的文件大小
-void save_uploaded_size_to_redis(redisContext *redis_conn, const std::string &key, size_t uploaded_size)
+// 发redis命令, 连接出错(返回nullptr)的时候重连, 退避以后再发, 重试用完了返回nullptr
+// 这里用到的命令(HGET/HSET/HDEL/HEXISTS/GET/DEL)重发一次结果不变
+redisReply *redis_command_with_retry(redisContext *redis_conn, const char *format, ...)
 {
-        stringstream ss;
-        ss << "SET " << key << " " << uploaded_size;
-        std::string s = ss.str();
-        // sprintf(const_cast<char*>(s.c_str),"SET %s %zd",key.c_str(),uploaded_size);
-        redisReply *reply = (redisReply *)redisCommand(redis_conn, s.c_str());
+        retry_policy retry;
+        for (unsigned attempt = 1;; attempt++)
+        {
+                va_list ap;
+                va_start(ap, format);
+                redisReply *reply = (redisReply *)redisvCommand(redis_conn, format, ap);
+                va_end(ap);
+                if (reply != nullptr || !retry.should_retry(-ECONNRESET, attempt))
+                {
+                        return reply;
+                }
+                std::chrono::milliseconds delay = retry.backoff(attempt);
+                std::cerr << "Redis command failed: " << redis_conn->errstr << ", retrying in " << delay.count() << " ms."
+                          << std::endl;
+                std::this_thread::sleep_for(delay);
+                // 出过错的连接hiredis不能再用, 要重连
+                redisReconnect(redis_conn);
+        }
+}
+
+// 用redis存下已经上传的文件大小, 存在按键名分桶的小HASH里(见redis_schema.h); 重试用完了返回-EIO
+int save_uploaded_size_to_redis(redisContext *redis_conn, const std::string &key, size_t uploaded_size)
+{
+        std::string size = std::to_string(uploaded_size);
+        redisReply *reply = redis_command_with_retry(redis_conn, "HSET %s %b %s", redis_upload_key(key).c_str(), key.data(),
+                                                     key.size(), size.c_str());
         if (reply == nullptr)
         {
                 std::cerr << "Couldn't save uploaded size to Redis!" << std::endl;
-                exit(EXIT_FAILURE);
+                return -EIO;
         }
         freeReplyObject(reply);
+        return 0;
 }
 
 // 获取已经传输的文件大小
 size_t load_uploaded_size_from_redis(redisContext *redis_conn, const std::string &key)
 {
-        stringstream ss;
-        ss << "GET " << key;
-        std::string s = ss.str();
         size_t uploaded_size = 0;
-        redisReply *reply = (redisReply *)redisCommand(redis_conn, s.c_str());
+        redisReply *reply = redis_command_with_retry(redis_conn, "HGET %s %b", redis_upload_key(key).c_str(), key.data(), key.size());
         if (reply != nullptr && reply->type == REDIS_REPLY_STRING)
         {
                 // 转换成整形
@@ -44,188 +88,1465 @@ size_t load_uploaded_size_from_redis(redisContext *redis_conn, const std::string
         return uploaded_size;
 }
 
+// 上传完成: 进度从正在传的桶里删掉, 记到当天的完成记录里, 完成记录几天以后整个过期
+void finish_upload_in_redis(redisContext *redis_conn, const std::string &key, size_t uploaded_size)
+{
+        std::string done_key = redis_done_key(time(nullptr));
+        std::string size = std::to_string(uploaded_size);
+        freeReplyObject(redis_command_with_retry(redis_conn, "HDEL %s %b", redis_upload_key(key).c_str(), key.data(), key.size()));
+        freeReplyObject(redis_command_with_retry(redis_conn, "HSET %s %b %s", done_key.c_str(), key.data(), key.size(), size.c_str()));
+        freeReplyObject(redis_command_with_retry(redis_conn, "EXPIRE %s %u", done_key.c_str(), redis_done_ttl_days * 24 * 3600));
+}
+
+// 文件指纹是否已经在redis里而且传完了(去重), hash是十六进制的指纹, redis里存的是二进制
+// 正在传的(dedup_claim认领中)不算; 给了location的话带回数据所在的"<池>\t<对象名>", 没记位置的是空串
+// 给了filter的话先查本地的过滤器, 肯定没有的就不用再问redis
+bool is_file_hash_in_redis(redisContext *redis_conn, const std::string &hash, cuckoo_filter *filter = nullptr,
+                           std::string *location = nullptr)
+{
+        std::string digest = hex_to_binary(hash);
+        if (digest.size() < 3)
+        {
+                return false;
+        }
+        if (filter != nullptr && !filter->contains(digest))
+        {
+                return false;
+        }
+        std::string field = redis_file_hash_field(digest);
+        bool exists = false;
+        redisReply *reply = redis_command_with_retry(redis_conn, "HGET %s %b", redis_file_hash_key(digest).c_str(),
+                                                     field.data(), field.size());
+        if (reply != nullptr && reply->type == REDIS_REPLY_STRING)
+        {
+                std::string value(reply->str, reply->len);
+                exists = value.empty() || value.compare(0, 2, "d:") == 0;
+                if (exists && location != nullptr)
+                {
+                        *location = value.empty() ? "" : value.substr(2);
+                }
+        }
+        freeReplyObject(reply);
+        return exists;
+}
+
+// 去重命中: 按指纹记下的位置在服务端把数据复制成目标对象(copy_from, 数据和xattr都不经过这里)
+// 返回0是目标对象有了; 记录里没有位置(旧版本记的), 原来的对象已经没了或者被换成了别的内容, 返回负数, 调用方照常上传
+// hash是对象上存的那种指纹(加密上传是带密钥的), 用来确认原来的对象还是这份内容
+int copy_deduplicated_object(librados::Rados &cluster, librados::IoCtx &io_ctx, const std::string &object_name,
+                             const std::string &location, const std::string &hash)
+{
+        size_t tab = location.find('\t');
+        if (tab == std::string::npos)
+        {
+                return -ENOENT;
+        }
+        std::string pool = location.substr(0, tab), source = location.substr(tab + 1);
+        librados::IoCtx source_io_ctx;
+        int ret = cluster.ioctx_create(pool.c_str(), source_io_ctx);
+        if (ret < 0)
+        {
+                return ret;
+        }
+        librados::bufferlist hash_bl;
+        ret = source_io_ctx.getxattr(source, hash_xattr_tree, hash_bl);
+        if (ret < 0 || hash_bl.to_str() != hash)
+        {
+                source_io_ctx.close();
+                return ret < 0 ? ret : -ESTALE;
+        }
+        if (pool == io_ctx.get_pool_name() && source == object_name)
+        {
+                // 就是这个对象
+                source_io_ctx.close();
+                return 0;
+        }
+        librados::ObjectWriteOperation op;
+        op.copy_from(source, source_io_ctx, 0, 0);
+        ret = io_ctx.operate(object_name, &op);
+        source_io_ctx.close();
+        if (ret < 0)
+        {
+                std::cerr << "Couldn't copy object '" << source << "' from pool '" << pool << "'! error " << ret << std::endl;
+                return ret;
+        }
+        std::cout << "Same file is already stored as '" << source << "' in pool '" << pool << "', copied it." << std::endl;
+        return 0;
+}
+
+// 上传完成后记下文件指纹; 指纹不对返回-EINVAL, redis重试用完了返回-EIO
+int save_file_hash_to_redis(redisContext *redis_conn, const std::string &hash)
+{
+        std::string digest = hex_to_binary(hash);
+        if (digest.size() < 3)
+        {
+                std::cerr << "Invalid file hash '" << hash << "'!" << std::endl;
+                return -EINVAL;
+        }
+        std::string field = redis_file_hash_field(digest);
+        redisReply *reply = redis_command_with_retry(redis_conn, "HSET %s %b %s", redis_file_hash_key(digest).c_str(),
+                                                     field.data(), field.size(), "");
+        if (reply == nullptr)
+        {
+                std::cerr << "Couldn't save file hash to Redis!" << std::endl;
+                return -EIO;
+        }
+        freeReplyObject(reply);
+        return 0;
+}
+
+// 从redis里所有传完的文件指纹预热本地过滤器
+void warm_dedup_filter(redisContext *redis_conn, cuckoo_filter &filter)
+{
+        std::string pattern = std::string(redis_namespace) + ":fh:*";
+        std::string cursor = "0";
+        do
+        {
+                redisReply *reply = redis_command_with_retry(redis_conn, "SCAN %s MATCH %s COUNT 1000 TYPE hash", cursor.c_str(),
+                                                             pattern.c_str());
+                if (reply == nullptr || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2)
+                {
+                        std::cerr << "Couldn't scan Redis keys!" << std::endl;
+                        exit(EXIT_FAILURE);
+                }
+                cursor = reply->element[0]->str;
+                std::vector<std::string> keys;
+                for (size_t i = 0; i < reply->element[1]->elements; i++)
+                {
+                        keys.emplace_back(reply->element[1]->element[i]->str);
+                }
+                freeReplyObject(reply);
+
+                for (const std::string &key : keys)
+                {
+                        // 桶号就是摘要的前2字节, 拼回完整的摘要
+                        unsigned bucket = std::stoul(key.substr(pattern.size() - 1));
+                        std::string prefix = {static_cast<char>(bucket >> 8), static_cast<char>(bucket & 0xff)};
+                        std::string field_cursor = "0";
+                        do
+                        {
+                                reply = redis_command_with_retry(redis_conn, "HSCAN %s %s COUNT 1000", key.c_str(), field_cursor.c_str());
+                                if (reply == nullptr || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2)
+                                {
+                                        std::cerr << "Couldn't scan Redis hash '" << key << "'!" << std::endl;
+                                        exit(EXIT_FAILURE);
+                                }
+                                field_cursor = reply->element[0]->str;
+                                redisReply *fields = reply->element[1];
+                                for (size_t i = 0; i + 1 < fields->elements; i += 2)
+                                {
+                                        // 只算传完的, 正在传的值是"p:"开头
+                                        redisReply *value = fields->element[i + 1];
+                                        if (value->len == 0 || (value->len >= 2 && memcmp(value->str, "d:", 2) == 0))
+                                        {
+                                                filter.insert(prefix + std::string(fields->element[i]->str, fields->element[i]->len));
+                                        }
+                                }
+                                freeReplyObject(reply);
+                        } while (field_cursor != "0");
+                }
+        } while (cursor != "0");
+        std::cout << "Loaded " << filter.size() << " file hashes into the dedup filter (" << filter.memory_bytes()
+                  << " bytes)." << std::endl;
+}
+
+// 把旧格式的键搬到紧凑格式(redis_schema.h)里, 搬完删掉旧键, 可以重复跑
+// 旧格式: 上传进度是名字匹配upload_pattern的字符串键, 值是字节数;
+//         文件指纹是64位十六进制的键名, 值是"1"
+// 同一个redis里可能还有别人的键, 只动这两种
+void migrate_redis_schema(redisContext *redis_conn, const std::string &upload_pattern)
+{
+        uint64_t uploads = 0, hashes = 0;
+        std::string cursor = "0";
+        do
+        {
+                redisReply *reply = redis_command_with_retry(redis_conn, "SCAN %s COUNT 1000 TYPE string", cursor.c_str());
+                if (reply == nullptr || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2)
+                {
+                        std::cerr << "Couldn't scan Redis keys!" << std::endl;
+                        exit(EXIT_FAILURE);
+                }
+                cursor = reply->element[0]->str;
+                std::vector<std::string> keys;
+                for (size_t i = 0; i < reply->element[1]->elements; i++)
+                {
+                        keys.emplace_back(reply->element[1]->element[i]->str, reply->element[1]->element[i]->len);
+                }
+                freeReplyObject(reply);
+
+                for (const std::string &key : keys)
+                {
+                        bool is_hash = key.size() == 64 && !hex_to_binary(key).empty();
+                        bool is_upload = !is_hash && fnmatch(upload_pattern.c_str(), key.c_str(), 0) == 0;
+                        if (!is_hash && !is_upload)
+                        {
+                                continue;
+                        }
+                        reply = redis_command_with_retry(redis_conn, "GET %b", key.data(), key.size());
+                        std::string value;
+                        if (reply != nullptr && reply->type == REDIS_REPLY_STRING)
+                        {
+                                value.assign(reply->str, reply->len);
+                        }
+                        freeReplyObject(reply);
+                        if (is_hash && value == "1")
+                        {
+                                if (save_file_hash_to_redis(redis_conn, key) < 0)
+                                {
+                                        exit(EXIT_FAILURE);
+                                }
+                                hashes++;
+                        }
+                        else if (is_upload && !value.empty() && value.find_first_not_of("0123456789") == std::string::npos)
+                        {
+                                if (save_uploaded_size_to_redis(redis_conn, key, std::stoull(value)) < 0)
+                                {
+                                        exit(EXIT_FAILURE);
+                                }
+                                uploads++;
+                        }
+                        else
+                        {
+                                continue;
+                        }
+                        freeReplyObject(redis_command_with_retry(redis_conn, "DEL %b", key.data(), key.size()));
+                }
+        } while (cursor != "0");
+        std::cout << "Migrated " << uploads << " upload progress keys and " << hashes << " file hash keys." << std::endl;
+}
+
+// 压缩上传的续传点: 从对象开头一帧一帧地读帧头, 找到记录的进度之前最后一个完整的帧
+// 返回对象里的偏移量, raw_offset是这些帧对应的原文件长度; 帧头不对或者加没加密和这次不一样就从头传
+uint64_t compressed_resume_point(librados::IoCtx &io_ctx, const std::string &object_name, uint64_t saved,
+                                 uint64_t chunk_size, bool encrypted, uint64_t &raw_offset)
+{
+        uint64_t pos = 0;
+        raw_offset = 0;
+        while (pos < saved)
+        {
+                librados::bufferlist bl;
+                frame_header h;
+                if (io_ctx.read(object_name, bl, compress_frame_header_size, pos) != static_cast<int>(compress_frame_header_size) ||
+                    !decode_frame_header(bl.c_str(), h) || h.raw_len != chunk_size || h.encrypted != encrypted ||
+                    pos + h.frame_len > saved)
+                {
+                        break;
+                }
+                pos += h.frame_len;
+                raw_offset += h.raw_len;
+        }
+        return pos;
+}
+
+// 续传点: redis里的进度可能比对象短(块写完了还没来得及记进度就崩了), 也可能比对象长(对象被别人改过), 以对象的实际长度为准
+// 要求对齐的池只能在对象末尾追加, 不能覆盖也不能截断, 续传点必须正好是对象的长度:
+// 进度和对象之间那段是上次写完没记下来的同一个文件的数据, 直接从对象末尾接着传; 接不上就用write_full清空对象从头传
+// 返回对象里的偏移量, raw_offset是对应的原文件偏移量; 出错返回负的错误码
+int64_t upload_resume_point(librados::IoCtx &io_ctx, const std::string &object_name, uint64_t saved, uint64_t file_size,
+                            uint64_t alignment, bool framed, uint64_t chunk_size, bool encrypted, uint64_t &raw_offset)
+{
+        uint64_t object_size = 0;
+        int ret = io_ctx.stat(object_name, &object_size, nullptr);
+        if (ret < 0 && ret != -ENOENT)
+        {
+                return ret;
+        }
+        uint64_t pos = alignment == 0 ? std::min(saved, object_size) : (saved > 0 ? object_size : 0);
+        if (alignment != 0)
+        {
+                pos -= pos % alignment;
+        }
+        raw_offset = pos;
+        if (framed && pos > 0)
+        {
+                pos = compressed_resume_point(io_ctx, object_name, pos, chunk_size, encrypted, raw_offset);
+        }
+        else if (pos > file_size)
+        {
+                pos = raw_offset = 0;
+        }
+        if (alignment != 0 && pos != object_size)
+        {
+                librados::bufferlist empty;
+                ret = io_ctx.write_full(object_name, empty);
+                if (ret < 0)
+                {
+                        return ret;
+                }
+                pos = raw_offset = 0;
+        }
+        return pos;
+}
+
 // 将本地文件上传到Ceph池的函数
-void upload_local_file_to_object(librados::IoCtx &io_ctx, const std::string &local_file_path, const std::string &object_name,
-                                 redisContext *redis_conn, const std::string &uploaded_size_key)
+// alignment是池要求的写对齐(pool_write_alignment), 写入会攒成对齐的整块
+// direct_io为true时用O_DIRECT读文件, 不经过page cache, 不会把机器上其他程序的缓存挤掉
+// compress指定了编码就按块压缩以后再传(见compression.h), 给了cipher就按块加密(见crypto.h)
+// 压缩或者加密的时候对象是一串帧, redis里记的进度是对象里的字节数
+// 本地文件打不开或者读不了, 写对象失败(重试用完了)返回负的错误码, 成功返回0
+int upload_local_file_to_object(librados::IoCtx &io_ctx, const std::string &local_file_path, const std::string &object_name,
+                                 redisContext *redis_conn, const std::string &uploaded_size_key, uint64_t alignment,
+                                 bool direct_io = false, const compress_options &compress = compress_options(),
+                                 const chunk_cipher *cipher = nullptr)
 {
-        // 先用流打开文件
-        std::ifstream local_file(local_file_path, std::ios::binary);
-        if (!local_file.is_open())
+        // 打开文件
+        int fd = open(local_file_path.c_str(), O_RDONLY | (direct_io ? O_DIRECT : 0));
+        if (fd < 0)
         {
                 std::cerr << "Couldn't open the local file!" << std::endl;
+                return -errno;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0)
+        {
+                int ret = -errno;
+                std::cerr << "Couldn't stat the local file!" << std::endl;
+                close(fd);
+                return ret;
+        }
+        uint64_t file_size = st.st_size;
+        int ret;
+        // 每次从文件读一块, 压缩或者加密的时候一块就是一帧
+        const size_t buffer_size = 4 * 1024 * 1024;
+        bool framed = compress.codec != CODEC_NONE || cipher != nullptr;
+        // 获取已经上传的文件大小, 和对象的实际长度对一下
+        uint64_t resume_offset = 0; // 原文件里从哪里接着传
+        int64_t resume = upload_resume_point(io_ctx, object_name, load_uploaded_size_from_redis(redis_conn, uploaded_size_key),
+                                             file_size, alignment, framed, buffer_size, cipher != nullptr, resume_offset);
+        if (resume < 0)
+        {
+                std::cerr << "Couldn't find the resume point! error " << resume << std::endl;
+                close(fd);
+                return resume;
+        }
+        size_t uploaded_size = resume;
+        // 边上传边算哈希, 传完以后存到对象的xattr里, 下载的时候用来校验
+        // 续传的时候前面已经传过的部分也要算进哈希里, 所以总是从头读, 已经传过的部分只算哈希
+        range_hasher tree_hasher(range_hasher::TREE, file_size);
+        range_hasher sha256_hasher(range_hasher::SHA256, file_size);
+
+        // 每写完一段连续的数据就记录一次进度; 屏幕上的进度由progress_reporter按固定频率输出, 这里只更新计数
+        // 压缩/加密的时候对象里的偏移量和原文件的对不上, 按写完的帧换算成原文件的字节数
+        std::shared_ptr<progress_tracker> progress = progress_registry::instance().start(object_name, file_size, resume_offset);
+        std::deque<std::pair<uint64_t, uint64_t>> frame_ends; // 写给上传引擎的帧: (对象里的末尾, 原文件里的末尾)
+        std::deque<uint64_t> raw_ends;                        // 在压缩的块在原文件里的末尾
+        uint64_t object_end = uploaded_size;
+        uint64_t raw_committed = resume_offset;
+        stripe_writer writer(io_ctx, object_name, uploaded_size, alignment);
+        writer.on_commit = [&](uint64_t committed) {
+                uploaded_size = committed;
+                // 记不下来只是续传的时候从更早的地方开始(续传点还要和对象的实际长度对), 上传照常
+                save_uploaded_size_to_redis(redis_conn, uploaded_size_key, uploaded_size);
+                while (!frame_ends.empty() && frame_ends.front().first <= committed)
+                {
+                        raw_committed = frame_ends.front().second;
+                        frame_ends.pop_front();
+                }
+                progress->set(framed ? raw_committed : committed);
+        };
+
+        // 预读: 几个缓冲区同时在读, 读回来的按文件顺序交给哈希和上传引擎
+        // 缓冲区是固定的几块按页对齐的内存, O_DIRECT也能直接用, 内存占用和文件大小无关
+        // 压缩/加密的时候每个线程还要压着一块, 缓冲区相应多几块
+        std::unique_ptr<ordered_pipeline> compressor;
+        compress_stats compressed;
+        if (framed)
+        {
+                compressor.reset(new ordered_pipeline(compress.threads));
+        }
+        const int buffer_count = 4 + (framed ? compressor->threads() : 0);
+        aligned_buffer_pool pool(buffer_size, buffer_count);
+        local_io io(buffer_count);
+        io.set_direct(direct_io);
+        io.register_buffers(pool.iovecs());
+
+        std::map<uint64_t, char *> reading;                     // 偏移量 -> 缓冲区
+        std::map<uint64_t, std::pair<char *, size_t>> completed; // 偏移量 -> (缓冲区, 长度)
+        std::deque<char *> in_compressor;                       // 正在压缩的块的缓冲区, 按文件顺序
+        // 出错返回之前等在途的本地读和压缩线程都做完, 它们还在用池里的缓冲区; 在途的写由上传引擎析构的时候等
+        auto fail = [&](int err) {
+                uint64_t tag;
+                int64_t res;
+                while (io.in_flight() > 0)
+                {
+                        io.wait(tag, res);
+                }
+                std::string frame;
+                while (framed && compressor->next(frame))
+                {
+                }
+                if (fd >= 0)
+                {
+                        close(fd);
+                }
+                return err;
+        };
+        // 取出最早的一帧交给上传引擎, 它的原始数据缓冲区就可以还回去了
+        auto write_next_frame = [&]() {
+                std::string frame;
+                compressor->next(frame);
+                if (frame.empty())
+                {
+                        std::cerr << "Couldn't encrypt the file!" << std::endl;
+                        return -EIO;
+                }
+                compressed.record(frame);
+                object_end += frame.size();
+                frame_ends.emplace_back(object_end, raw_ends.front());
+                raw_ends.pop_front();
+                writer.write(frame.data(), frame.size());
+                pool.release(in_compressor.front());
+                in_compressor.pop_front();
+                return writer.error();
+        };
+        uint64_t next_read = 0;
+        uint64_t next_consume = 0;
+        while (next_consume < file_size)
+        {
+                char *buf;
+                while (next_read < file_size && (buf = pool.acquire()) != nullptr)
+                {
+                        size_t len = std::min<uint64_t>(buffer_size, file_size - next_read);
+                        // O_DIRECT的读长度也要对齐, 文件末尾不满一页的尾巴多请求一点, 内核只返回实际的字节数
+                        size_t request = direct_io ? round_up_to(len, direct_io_alignment) : len;
+                        reading[next_read] = buf;
+                        io.prep_read(fd, buf, request, next_read, next_read, pool.index_of(buf));
+                        next_read += len;
+                }
+                // 攒起来的读请求一次提交
+                io.submit();
+
+                uint64_t offset;
+                int64_t res;
+                if (!io.wait(offset, res))
+                {
+                        // 一个读都没发出去: 缓冲区分配不出来
+                        return fail(-ENOMEM);
+                }
+                uint64_t expected = std::min<uint64_t>(buffer_size, file_size - offset);
+                if (res < 0 || static_cast<uint64_t>(res) < expected)
+                {
+                        std::cerr << "Couldn't read the local file! error " << res << std::endl;
+                        return fail(res < 0 ? res : -EIO);
+                }
+                completed[offset] = {reading[offset], expected};
+                reading.erase(offset);
+
+                // 按顺序处理已经读回来的数据
+                auto it = completed.begin();
+                while (it != completed.end() && it->first == next_consume)
+                {
+                        const char *data = it->second.first;
+                        size_t read_bytes = it->second.second;
+                        tree_hasher.update(next_consume, data, read_bytes);
+                        sha256_hasher.update(next_consume, data, read_bytes);
+                        if (framed && next_consume >= resume_offset)
+                        {
+                                // 交给压缩/加密线程, 做完按顺序写; 续传点总是在块的边界上
+                                uint64_t raw_offset = next_consume;
+                                compressor->submit([data, read_bytes, &compress, alignment, cipher, raw_offset] {
+                                        return compress_frame(data, read_bytes, compress, alignment, cipher, raw_offset);
+                                });
+                                in_compressor.push_back(it->second.first);
+                                raw_ends.push_back(raw_offset + read_bytes);
+                        }
+                        else
+                        {
+                                // 交给上传引擎, 攒够对齐的整块才会真正写
+                                if (!framed && next_consume + read_bytes > resume_offset)
+                                {
+                                        size_t skip = next_consume < resume_offset ? resume_offset - next_consume : 0;
+                                        writer.write(data + skip, read_bytes - skip);
+                                }
+                                pool.release(it->second.first);
+                        }
+                        next_consume += read_bytes;
+                        it = completed.erase(it);
+                }
+                // 压缩线程都有活干就先把压好的写出去, 留出缓冲区给读
+                while (framed && in_compressor.size() >= compressor->threads())
+                {
+                        if ((ret = write_next_frame()) < 0)
+                        {
+                                return fail(ret);
+                        }
+                }
+                if (writer.error() < 0)
+                {
+                        return fail(writer.error());
+                }
+        }
+        close(fd);
+        fd = -1;
+        while (framed && !in_compressor.empty())
+        {
+                if ((ret = write_next_frame()) < 0)
+                {
+                        return fail(ret);
+                }
+        }
+        // 把最后不满一块的尾巴写出去
+        writer.flush();
+        if (writer.error() < 0)
+        {
+                std::cerr << "Couldn't upload the file! error " << writer.error() << std::endl;
+                return writer.error();
+        }
+        compressed.print("Upload");
+        pool.print_stats("Upload read");
+        writer.buffers().print_stats("Upload write");
+        writer.retry_stats().print_stats("Upload");
+
+        // 截掉以前那个更长的对象留下的尾巴, 不然对象比文件长, 下载校验哈希会失败; 空文件没写过数据, 要建一个空对象
+        // 要求对齐的池不能截断, 续传点总是对象的末尾, 对象本来就正好这么长
+        retry_policy retry;
+        librados::bufferlist empty;
+        if ((ret = retry_sync(retry, "Truncating the object", [&] {
+                    if (writer.committed() == 0)
+                    {
+                            return io_ctx.write_full(object_name, empty);
+                    }
+                    return alignment == 0 ? io_ctx.trunc(object_name, writer.committed()) : 0;
+            })) < 0)
+        {
+                std::cerr << "Couldn't truncate the object!" << std::endl;
+                return ret;
+        }
+
+        // 保存文件哈希; 加密的对象存的是带密钥的HMAC, 集群上看不出明文的哈希
+        std::string tree_hash, sha256_hash;
+        if (tree_hasher.finish(tree_hash) && sha256_hasher.finish(sha256_hash))
+        {
+                if (cipher != nullptr)
+                {
+                        tree_hash = cipher->keyed_hash(tree_hash);
+                        sha256_hash = cipher->keyed_hash(sha256_hash);
+                }
+                librados::bufferlist tree_bl, sha256_bl;
+                tree_bl.append(tree_hash);
+                sha256_bl.append(sha256_hash);
+                if ((ret = retry_sync(retry, "Saving the file hash", [&] { return io_ctx.setxattr(object_name, hash_xattr_tree, tree_bl); })) < 0 ||
+                    (ret = retry_sync(retry, "Saving the file hash", [&] { return io_ctx.setxattr(object_name, hash_xattr_sha256, sha256_bl); })) < 0)
+                {
+                        std::cerr << "Couldn't save the file hash to the object!" << std::endl;
+                        return ret;
+                }
+        }
+        // 分帧的对象记下编码和原始大小; 不分帧的去掉以前留下的标记
+        if (framed)
+        {
+                librados::bufferlist codec_bl, size_bl;
+                codec_bl.append(codec_name(compress.codec));
+                size_bl.append(std::to_string(file_size));
+                if ((ret = retry_sync(retry, "Saving the codec", [&] { return io_ctx.setxattr(object_name, compress_xattr_codec, codec_bl); })) < 0 ||
+                    (ret = retry_sync(retry, "Saving the codec", [&] { return io_ctx.setxattr(object_name, compress_xattr_size, size_bl); })) < 0)
+                {
+                        std::cerr << "Couldn't save the compression info to the object!" << std::endl;
+                        return ret;
+                }
+        }
+        else
+        {
+                io_ctx.rmxattr(object_name, compress_xattr_codec);
+        }
+        // 加密的对象记下算法和密钥指纹, 下载时用错了密钥能直接报出来
+        if (cipher != nullptr)
+        {
+                librados::bufferlist alg_bl, key_bl;
+                alg_bl.append(crypt_alg_name);
+                key_bl.append(cipher->fingerprint());
+                if ((ret = retry_sync(retry, "Saving the key fingerprint", [&] { return io_ctx.setxattr(object_name, crypt_xattr_alg, alg_bl); })) < 0 ||
+                    (ret = retry_sync(retry, "Saving the key fingerprint", [&] { return io_ctx.setxattr(object_name, crypt_xattr_key, key_bl); })) < 0)
+                {
+                        std::cerr << "Couldn't save the encryption info to the object!" << std::endl;
+                        return ret;
+                }
+        }
+        else
+        {
+                io_ctx.rmxattr(object_name, crypt_xattr_alg);
+                io_ctx.rmxattr(object_name, crypt_xattr_key);
+        }
+        finish_upload_in_redis(redis_conn, uploaded_size_key, file_size);
+        return 0;
+}
+
+// 上传本地文件到Ceph池，支持断点续传
+std::string local_file_path_to_upload = "md5.h";  // 更改为要上传的本地文件的路径
+std::string object_name_to_upload = "myobject";   // 更改为要在Ceph池中创建的对象名称
+std::string uploaded_size_key = "uploaded_size1"; // 更改为要在Redis中存储已上传数据量的键名
+
+/* void upload_local_file_to_object(librados::IoCtx &io_ctx, const std::string &file_path, const std::string &object_name)
+{
+        std::ifstream input_file(file_path, std::ios::binary);
+        if (!input_file.is_open())
+        {
+                std::cerr << "Couldn't open local file for reading! error " << std::endl;
                 exit(EXIT_FAILURE);
         }
+
         // 读取本地文件内容
-        local_file.seekg(0, std::ios::end);
+        input_file.seekg(0, std::ios::end);
         // 获取当前文件读取位置
-        std::streamsize file_size = local_file.tellg();
-        // 获取已经上传的文件大小
-        size_t uploaded_size = load_uploaded_size_from_redis(redis_conn, uploaded_size_key+"up");
-        local_file.seekg(uploaded_size);
-        const size_t buffer_size = 4096;
-        std::vector<char> buffer(buffer_size);
-        size_t read_bytes;
-        while (!local_file.eof())
-        {
-                // 将文件读到bufffer去
-                local_file.read(buffer.data(), buffer_size);
-                // 返回上一次具体读了多少个字节数;
-                read_bytes = static_cast<size_t>(local_file.gcount());
-
-                if (read_bytes > 0)
-                {
-                        librados::bufferlist bl;
-                        bl.append(buffer.data(), read_bytes);
-                        // 从uploaded_size开始写
-                        int ret = io_ctx.write(object_name, bl, read_bytes, uploaded_size);
+        std::streamsize file_size = input_file.tellg();
+        input_file.seekg(0, std::ios::beg);
+
+        std::vector<char> file_buffer(file_size);
+        input_file.read(file_buffer.data(), file_size);
+        input_file.close();
+
+        // 将文件内容写入Ceph对象
+        librados::bufferlist write_buf;
+        write_buf.append(file_buffer.data(), file_size);
+        int ret = io_ctx.write_full(object_name, write_buf);
+        if (ret < 0)
+        {
+                std::cerr << "Couldn't write object! error " << ret << std::endl;
+                exit(EXIT_FAILURE);
+        }
+
+        std::cout << "Uploaded local file '" << file_path << "' to object '" << object_name << "'." << std::endl;
+} */
+
+// 我们将下载的文件保存到本地文件系统上的 "downloaded_object.txt" 文件中
+// 保存的文件名local_file_path
+std::string local_file_path = "downloaded_object.txt";
+
+// 读取对象到本地文件的函数
+/* void download_object_to_local_file(librados::IoCtx &io_ctx, const std::string &object_name, const std::string &file_path)
+{
+        librados::bufferlist read_buf;
+        uint64_t object_size;
+        time_t object_mtime;
+        int ret;
+
+        // 获取对象大小
+        // 下载对象到本地文件
+        ret = io_ctx.stat(object_name, &object_size, &object_mtime);
+        if (ret < 0)
+        {
+                std::cerr << "Couldn't stat object! error " << ret << std::endl;
+                exit(EXIT_FAILURE);
+        }
+
+        // 读取对象内容
+        ret = io_ctx.read(object_name, read_buf, object_size, 0);
+        if (ret < 0)
+        {
+                std::cerr << "Couldn't read object! error " << ret << std::endl;
+                exit(EXIT_FAILURE);
+        }
+
+        // 将对象内容写入本地文件
+        std::ofstream output_file(file_path, std::ios::binary);
+        if (!output_file.is_open())
+        {
+                std::cerr << "Couldn't open local file for writing! error " << std::endl;
+                exit(EXIT_FAILURE);
+        }
+        output_file.write(read_buf.c_str(), read_buf.length());
+        output_file.close();
+
+        std::cout << "Downloaded object '" << object_name << "' to local file '" << file_path << "'." << std::endl;
+} */
+// 异步读对象: 先stat拿到大小再读, 最多读max_len字节
+task<int> read_object_coro(coro_executor &executor, librados::IoCtx &io_ctx, const std::string &object_name,
+                           librados::bufferlist *read_buf, uint64_t max_len)
+{
+        uint64_t object_size;
+        time_t object_mtime;
+        int ret = co_await async_stat(executor, io_ctx, object_name, &object_size, &object_mtime);
+        if (ret < 0)
+        {
+                co_return ret;
+        }
+        co_return co_await async_read(executor, io_ctx, object_name, read_buf, std::min(object_size, max_len), 0);
+}
+
+// 读取对象上保存的哈希, 优先用树形哈希(可以乱序校验), 没有保存哈希返回false
+bool load_object_hash(librados::IoCtx &io_ctx, const std::string &object_name, range_hasher::alg_t &alg, std::string &hash)
+{
+        const std::pair<const char *, range_hasher::alg_t> candidates[] = {
+            {hash_xattr_tree, range_hasher::TREE},
+            {hash_xattr_sha256, range_hasher::SHA256},
+            {hash_xattr_md5, range_hasher::MD5},
+        };
+        for (const auto &c : candidates)
+        {
+                librados::bufferlist bl;
+                if (io_ctx.getxattr(object_name, c.first, bl) > 0)
+                {
+                        alg = c.second;
+                        hash = bl.to_str();
+                        return true;
+                }
+        }
+        return false;
+}
+
+// 对象是分帧(压缩或者加密)上传的就返回true, raw_size是原文件的大小
+bool load_compress_info(librados::IoCtx &io_ctx, const std::string &object_name, uint64_t &raw_size)
+{
+        librados::bufferlist codec_bl, size_bl;
+        if (io_ctx.getxattr(object_name, compress_xattr_codec, codec_bl) <= 0 ||
+            io_ctx.getxattr(object_name, compress_xattr_size, size_bl) <= 0)
+        {
+                return false;
+        }
+        raw_size = std::stoull(size_bl.to_str());
+        return true;
+}
+
+// 加密的对象要有密钥, 而且指纹和上传时用的一样; 没加密的不管
+bool check_object_key(librados::IoCtx &io_ctx, const std::string &object_name, const chunk_cipher *cipher)
+{
+        librados::bufferlist bl;
+        if (io_ctx.getxattr(object_name, crypt_xattr_key, bl) <= 0)
+        {
+                return true;
+        }
+        if (cipher == nullptr)
+        {
+                std::cerr << "Object '" << object_name << "' is encrypted, set CEPH2_ENCRYPTION_KEY to download it!" << std::endl;
+                return false;
+        }
+        if (bl.to_str() != cipher->fingerprint())
+        {
+                std::cerr << "Object '" << object_name << "' was encrypted with key " << bl.to_str() << ", not "
+                          << cipher->fingerprint() << "!" << std::endl;
+                return false;
+        }
+        return true;
+}
+
+// 下载分帧的对象: 并发按顺序读对象, 拼起来切成帧, 几个线程并行解密解压, 按原文件的顺序写到fd, 同时喂给哈希
+// 帧的长度事先不知道, 对冲读和乱序写都不做; 读出错退避的时候整个下载停一下
+// 帧损坏或者认证不通过返回-EBADMSG, 读失败返回错误码, 成功返回0
+int download_compressed_object(librados::IoCtx &io_ctx, const std::string &object_name, int fd, uint64_t object_size,
+                               uint64_t raw_size, range_hasher &hasher, retry_policy &retry, const chunk_cipher *cipher)
+{
+        const uint64_t block_size = tree_hash_leaf_size;
+        const size_t max_in_flight = 8;
+        aio_window window(max_in_flight);
+        std::map<uint64_t, librados::bufferlist> reads; // 偏移量 -> 在途或者已经回来的读
+        std::set<uint64_t> arrived;
+        std::map<uint64_t, unsigned> failures;
+        ordered_pipeline decompressor;
+        std::string stream; // 按顺序收到但还没凑成整帧的数据
+        uint64_t next_offset = 0, next_consume = 0, raw_written = 0;
+        uint64_t raw_submitted = 0; // 已经交给解压线程的帧在原文件里的总长度
+
+        auto start_read = [&](uint64_t offset) {
+                librados::bufferlist &bl = reads[offset];
+                bl.clear();
+                uint64_t len = std::min(block_size, object_size - offset);
+                return window.submit(offset, [&](librados::AioCompletion *c) {
+                        return io_ctx.aio_read(object_name, c, &bl, len, offset);
+                });
+        };
+        // 出错返回之前等在途的读都回来, 它们还在往reads里写
+        auto fail = [&](int err) {
+                uint64_t tag;
+                int ret;
+                while (window.in_flight() > 0)
+                {
+                        window.wait_one(tag, ret);
+                }
+                return err;
+        };
+        // 取最早的一帧解压结果写到文件里
+        auto write_next = [&]() {
+                std::string raw;
+                decompressor.next(raw);
+                if (raw.empty() || raw_written + raw.size() > raw_size)
+                {
+                        std::cerr << "Corrupted compressed frame in object '" << object_name << "'!" << std::endl;
+                        return -EBADMSG;
+                }
+                hasher.update(raw_written, raw.data(), raw.size());
+                size_t done = 0;
+                while (done < raw.size())
+                {
+                        ssize_t n = pwrite(fd, raw.data() + done, raw.size() - done, raw_written + done);
+                        if (n < 0 && errno == EINTR)
+                        {
+                                continue;
+                        }
+                        if (n <= 0)
+                        {
+                                std::cerr << "Couldn't write local file! error " << errno << std::endl;
+                                return -errno;
+                        }
+                        done += n;
+                }
+                raw_written += raw.size();
+                return 0;
+        };
+
+        while (next_consume < object_size)
+        {
+                while (next_offset < object_size && !window.full() && reads.size() < 2 * max_in_flight)
+                {
+                        int ret = start_read(next_offset);
+                        if (ret < 0)
+                        {
+                                std::cerr << "Couldn't start read object! error " << ret << std::endl;
+                                return fail(ret);
+                        }
+                        next_offset += std::min(block_size, object_size - next_offset);
+                }
+                uint64_t offset;
+                int ret;
+                window.wait_one(offset, ret);
+                if (ret >= 0 && reads[offset].length() != std::min(block_size, object_size - offset))
+                {
+                        ret = -EIO;
+                }
+                if (ret < 0)
+                {
+                        if (!retry.should_retry(ret, ++failures[offset]))
+                        {
+                                std::cerr << "Couldn't read object! error " << ret << std::endl;
+                                return fail(ret);
+                        }
+                        std::this_thread::sleep_for(retry.backoff(failures[offset]));
+                        if ((ret = start_read(offset)) < 0)
+                        {
+                                return fail(ret);
+                        }
+                        continue;
+                }
+                arrived.insert(offset);
+                // 按顺序接到流后面, 切出完整的帧交给解压线程
+                while (!arrived.empty() && *arrived.begin() == next_consume)
+                {
+                        librados::bufferlist &bl = reads[next_consume];
+                        for (const auto &p : bl.buffers())
+                        {
+                                stream.append(p.c_str(), p.length());
+                        }
+                        next_consume += bl.length();
+                        reads.erase(*arrived.begin());
+                        arrived.erase(arrived.begin());
+                }
+                size_t pos = 0;
+                frame_header h;
+                while (stream.size() - pos >= compress_frame_header_size)
+                {
+                        if (!decode_frame_header(stream.data() + pos, h))
+                        {
+                                std::cerr << "Corrupted compressed frame in object '" << object_name << "'!" << std::endl;
+                                return fail(-EBADMSG);
+                        }
+                        if (stream.size() - pos < h.frame_len)
+                        {
+                                break;
+                        }
+                        std::string frame = stream.substr(pos, frame_payload_offset(h.encrypted) + h.stored_len);
+                        decompressor.submit([h, frame = std::move(frame), raw_offset = raw_submitted, cipher]() mutable {
+                                std::string raw(h.raw_len, '\0');
+                                if (!decode_frame(h, frame.data(), raw_offset, cipher, raw.data()))
+                                {
+                                        raw.clear();
+                                }
+                                return raw;
+                        });
+                        raw_submitted += h.raw_len;
+                        pos += h.frame_len;
+                }
+                stream.erase(0, pos);
+                while (decompressor.outstanding() >= decompressor.threads())
+                {
+                        if ((ret = write_next()) < 0)
+                        {
+                                return fail(ret);
+                        }
+                }
+        }
+        while (decompressor.outstanding() > 0)
+        {
+                int ret = write_next();
+                if (ret < 0)
+                {
+                        return ret;
+                }
+        }
+        if (!stream.empty() || raw_written != raw_size)
+        {
+                std::cerr << "Compressed object '" << object_name << "' is truncated!" << std::endl;
+                return -EBADMSG;
+        }
+        return 0;
+}
+
+// 下载完以后和对象上保存的哈希比较, 不一致就删掉本地文件; 加密的对象给cipher, 存的是哈希的HMAC
+int verify_download(range_hasher &hasher, const std::string &expected_hash, const std::string &object_name,
+                    const std::string &file_path, const chunk_cipher *cipher)
+{
+        std::string actual_hash;
+        bool finished = hasher.finish(actual_hash);
+        if (finished && cipher != nullptr)
+        {
+                actual_hash = cipher->keyed_hash(actual_hash);
+        }
+        if (!finished || actual_hash != expected_hash)
+        {
+                std::cerr << "Integrity check failed for object '" << object_name << "'! expected "
+                          << expected_hash << " got " << actual_hash << std::endl;
+                std::remove(file_path.c_str());
+                return -EBADMSG;
+        }
+        std::cout << "Verified object '" << object_name << "' hash " << actual_hash << std::endl;
+        return 0;
+}
+
+// 分块下载对象到本地文件的函数
+// 同时发出多个aio_read, 哪一块先回来就先写哪一块, 同时喂给哈希计算器校验, 不用下载完再读一遍文件
+// direct_io为true时用O_DIRECT写文件, 数据先拷到对齐的缓冲区里再写, 最后把文件截到实际大小
+// 某个读请求慢得反常(OSD在scrub或者恢复)时按hedge对冲, 不让一个慢OSD拖住整个下载
+// 压缩或者加密上传的对象自动解密解压, 写出来的是原文件; 加密的对象要给上传时用的cipher
+// 对象不存在, 本地文件打不开, 密钥不对或者校验不通过返回负的错误码, 成功返回0
+int download_object_to_local_file(librados::IoCtx &io_ctx, const std::string &object_name, const std::string &file_path,
+                                   bool direct_io = false, const hedge_options &hedge = hedge_options(),
+                                   const chunk_cipher *cipher = nullptr)
+{
+        uint64_t object_size;
+        time_t object_mtime;
+        int ret;
+        const uint64_t block_size = tree_hash_leaf_size;
+        const size_t max_in_flight = 8;
+        // 整个下载共用一份重试预算, 暂时性的错误只重试出错的那一块, 别的块照常在读
+        retry_policy retry;
+        // 获取对象大小
+        ret = retry_sync(retry, "Stat object", [&] { return io_ctx.stat(object_name, &object_size, &object_mtime); });
+        if (ret < 0)
+        {
+                std::cerr << "Couldn't stat object! error " << ret << std::endl;
+                return ret;
+        }
+
+        range_hasher::alg_t alg = range_hasher::TREE;
+        std::string expected_hash;
+        bool verify = load_object_hash(io_ctx, object_name, alg, expected_hash);
+        if (!verify)
+        {
+                std::cout << "Object '" << object_name << "' has no stored hash, skipping verification." << std::endl;
+        }
+        // 压缩过的对象哈希是按原文件算的
+        uint64_t raw_size = object_size;
+        bool compressed = load_compress_info(io_ctx, object_name, raw_size);
+        if (compressed && !check_object_key(io_ctx, object_name, cipher))
+        {
+                return -EACCES;
+        }
+        librados::bufferlist key_bl;
+        const chunk_cipher *hash_cipher = compressed && io_ctx.getxattr(object_name, crypt_xattr_key, key_bl) > 0 ? cipher : nullptr;
+        range_hasher hasher(alg, raw_size);
+
+        // 打开本地文件; 解压出来的数据长度不对齐, 不用O_DIRECT
+        int fd = open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | (direct_io && !compressed ? O_DIRECT : 0), 0644);
+        if (fd < 0)
+        {
+                std::cerr << "Couldn't open local file for writing! error " << errno << std::endl;
+                return -errno;
+        }
+        if (compressed)
+        {
+                ret = download_compressed_object(io_ctx, object_name, fd, object_size, raw_size, hasher, retry, cipher);
+                close(fd);
+                if (ret < 0)
+                {
+                        std::remove(file_path.c_str());
+                        return ret;
+                }
+                retry.print_stats("Download");
+                if (verify && (ret = verify_download(hasher, expected_hash, object_name, file_path, hash_cipher)) < 0)
+                {
+                        return ret;
+                }
+                std::cout << "Downloaded object '" << object_name << "' to local file '" << file_path << "'." << std::endl;
+                return 0;
+        }
+
+        // 本地写也是异步的: 一块数据读回来以后排队写, 一次提交, 写完才把缓冲区还回池里
+        // 读缓冲区来自固定大小的池, 整个下载只用这几块内存, 不再每块分配一次
+        local_io io(64);
+        aligned_buffer_pool pool(block_size, max_in_flight + hedge.max_hedges_in_flight + 4);
+        // 一块数据最多有两个读请求: 原始的和对冲的, 各自读进自己的缓冲区, 用先成功回来的那个
+        struct read_attempt
+        {
+                librados::bufferlist bl;
+                char *buf = nullptr;
+                bool outstanding = false;
+                std::chrono::steady_clock::time_point started;
+                std::unique_ptr<librados::ObjectReadOperation> op; // 对冲读带标志, 要用ObjectReadOperation
+                int rval = 0;
+        };
+        struct read_block
+        {
+                read_attempt attempts[2];    // 0是原始读, 1是对冲读
+                bool hedged = false;
+                unsigned failures = 0;
+                int winner = -1;             // 用的是哪个读请求的数据
+                size_t writes_remaining = 0; // 还没写完的本地写请求数
+        };
+        std::map<uint64_t, read_block> blocks;    // 块的偏移量 -> 读请求
+        std::map<uint64_t, uint64_t> write_owner; // 本地写请求编号 -> 所属块的偏移量
+        uint64_t next_write_id = 0;
+        latency_tracker latency(hedge);
+        size_t hedges_in_flight = 0;
+        uint64_t hedges_sent = 0, hedges_won = 0;
+        std::multimap<std::chrono::steady_clock::time_point, uint64_t> retries; // 重发时间 -> 读请求的tag
+
+        // 没人再用的缓冲区还回池里: 回来了的输家马上还, 赢家等它的写都完成; 整块都用完了就删掉
+        auto release_block = [&](uint64_t offset) {
+                read_block &b = blocks[offset];
+                for (int i = 0; i < 2; i++)
+                {
+                        read_attempt &a = b.attempts[i];
+                        if (a.buf != nullptr && !a.outstanding && (i != b.winner || b.writes_remaining == 0))
+                        {
+                                a.bl.clear();
+                                pool.release(a.buf);
+                                a.buf = nullptr;
+                        }
+                }
+                if (b.winner >= 0 && b.writes_remaining == 0 && !b.attempts[0].outstanding && !b.attempts[1].outstanding)
+                {
+                        blocks.erase(offset);
+                }
+        };
+        // 出了不能重试的错就不再发新的读, 等在途的读写都回来以后删掉本地文件返回错误码
+        int failure = 0;
+        auto finish_write = [&](uint64_t id, int64_t res) {
+                if (res < 0)
+                {
+                        std::cerr << "Couldn't write local file! error " << res << std::endl;
+                        failure = failure < 0 ? failure : res;
+                }
+                uint64_t owner = write_owner[id];
+                write_owner.erase(id);
+                if (--blocks[owner].writes_remaining == 0)
+                {
+                        release_block(owner);
+                }
+        };
+        auto wait_write = [&]() {
+                uint64_t id;
+                int64_t res;
+                if (io.wait(id, res))
+                {
+                        finish_write(id, res);
+                }
+        };
+
+        // 分块读取对象内容并写入本地文件, 在途的读请求按偏移量保存
+        // 块的偏移量是4MB的整数倍, 请求的tag用最低位区分原始读(0)和对冲读(1)
+        aio_window window(max_in_flight);
+        auto start_read = [&](uint64_t offset, int attempt, char *buf) {
+                read_attempt &a = blocks[offset].attempts[attempt];
+                uint64_t len = std::min(block_size, object_size - offset);
+                a.bl = aligned_buffer_pool::wrap(buf, len);
+                a.buf = buf;
+                a.outstanding = true;
+                a.started = std::chrono::steady_clock::now();
+                if (attempt == 0)
+                {
+                        return window.submit(offset, [&](librados::AioCompletion *c) {
+                                return io_ctx.aio_read(object_name, c, &a.bl, len, offset);
+                        });
+                }
+                a.op.reset(new librados::ObjectReadOperation);
+                a.op->read(offset, len, &a.bl, &a.rval);
+                return window.submit(offset | 1, [&](librados::AioCompletion *c) {
+                        return io_ctx.aio_operate(object_name, c, a.op.get(), hedge.flags, nullptr);
+                });
+        };
+        // 还没对冲过, 而且现在能对冲的块
+        auto can_hedge = [&](const read_block &b) {
+                return hedge.enabled && !b.hedged && b.winner < 0 && b.attempts[0].outstanding &&
+                       hedges_in_flight < hedge.max_hedges_in_flight && pool.available() > 0;
+        };
+        // 原始读超过期限还没回来的, 再发一个读给副本
+        auto hedge_overdue = [&]() {
+                auto now = std::chrono::steady_clock::now();
+                auto deadline = latency.deadline();
+                for (auto &entry : blocks)
+                {
+                        read_block &b = entry.second;
+                        if (!can_hedge(b) || now - b.attempts[0].started < deadline)
+                        {
+                                continue;
+                        }
+                        char *buf = pool.acquire();
+                        if (buf == nullptr)
+                        {
+                                continue;
+                        }
+                        b.hedged = true;
+                        if (start_read(entry.first, 1, buf) < 0)
+                        {
+                                // 对冲读发不出去不要紧, 接着等原始读
+                                b.attempts[1].outstanding = false;
+                                pool.release(b.attempts[1].buf);
+                                b.attempts[1].buf = nullptr;
+                                continue;
+                        }
+                        hedges_in_flight++;
+                        hedges_sent++;
+                }
+        };
+
+        // 读失败了, 能重试就留着缓冲区排到退避时间以后重发
+        auto schedule_retry = [&](uint64_t tag, int err) {
+                read_block &b = blocks[tag & ~uint64_t(1)];
+                if (!retry.should_retry(err, ++b.failures))
+                {
+                        std::cerr << "Couldn't read object! error " << err << std::endl;
+                        failure = failure < 0 ? failure : err;
+                        release_block(tag & ~uint64_t(1));
+                        return;
+                }
+                std::chrono::milliseconds delay = retry.backoff(b.failures);
+                std::cerr << "Read at offset " << (tag & ~uint64_t(1)) << " failed with error " << err << ", retrying in "
+                          << delay.count() << " ms." << std::endl;
+                b.attempts[tag & 1].outstanding = true;
+                retries.emplace(std::chrono::steady_clock::now() + delay, tag);
+        };
+        auto resubmit_due = [&]() {
+                auto now = std::chrono::steady_clock::now();
+                while (!retries.empty() && retries.begin()->first <= now && !window.full())
+                {
+                        uint64_t tag = retries.begin()->second;
+                        retries.erase(retries.begin());
+                        uint64_t offset = tag & ~uint64_t(1);
+                        int attempt = tag & 1;
+                        read_block &b = blocks[offset];
+                        read_attempt &a = b.attempts[attempt];
+                        if (b.winner >= 0)
+                        {
+                                // 等重试的时候对冲读已经拿到数据了
+                                a.outstanding = false;
+                                release_block(offset);
+                                continue;
+                        }
+                        int ret = start_read(offset, attempt, a.buf);
+                        if (ret < 0)
+                        {
+                                schedule_retry(tag, ret);
+                                continue;
+                        }
+                        if (attempt == 1)
+                        {
+                                hedges_in_flight++;
+                        }
+                }
+        };
+
+        uint64_t next_offset = 0;
+        while (failure == 0 && (next_offset < object_size || window.in_flight() > 0 || !retries.empty()))
+        {
+                // 退避时间到了的重试优先发
+                resubmit_due();
+                while (failure == 0 && next_offset < object_size && !window.full())
+                {
+                        char *buf = pool.acquire();
+                        if (buf == nullptr)
+                        {
+                                // 缓冲区都压在本地写上就等一个写完, 都在读请求手里就先去等读
+                                if (io.in_flight() == 0)
+                                {
+                                        if (window.in_flight() == 0 && retries.empty())
+                                        {
+                                                // 什么都不在途还取不到缓冲区, 是内存分配不出来了
+                                                failure = -ENOMEM;
+                                        }
+                                        break;
+                                }
+                                wait_write();
+                                continue;
+                        }
+                        ret = start_read(next_offset, 0, buf);
                         if (ret < 0)
                         {
-                                std::cerr << "Couldn't write object! error " << ret << std::endl;
-                                exit(EXIT_FAILURE);
+                                std::cerr << "Couldn't start read object! error " << ret << std::endl;
+                                failure = ret;
+                                blocks[next_offset].attempts[0].outstanding = false;
+                                release_block(next_offset);
+                                break;
                         }
-                        else
+                        next_offset += std::min(block_size, object_size - next_offset);
+                }
+                if (failure < 0)
+                {
+                        break;
+                }
+
+                // 等一个读请求回来, 最多等到最早的那个该对冲或者该重试的时刻
+                auto now = std::chrono::steady_clock::now();
+                auto wake = retries.empty() ? std::chrono::steady_clock::time_point::max() : retries.begin()->first;
+                for (const auto &entry : blocks)
+                {
+                        if (can_hedge(entry.second))
                         {
-                                printf("Uping:%.2f%%\r", uploaded_size * 100.0 / file_size);
-                                fflush(stdout);
-                                std::cout << "Wrote " << read_bytes << " bytes to the object." << std::endl;
-                                sleep(1);
+                                wake = std::min(wake, entry.second.attempts[0].started + latency.deadline());
                         }
+                }
+                uint64_t tag;
+                if (wake == std::chrono::steady_clock::time_point::max())
+                {
+                        window.wait_one(tag, ret);
+                }
+                else if (!window.wait_one_for(std::max(wake - now, std::chrono::steady_clock::duration::zero()), tag, ret))
+                {
+                        hedge_overdue();
+                        continue;
+                }
 
-                        uploaded_size += read_bytes;
-                        save_uploaded_size_to_redis(redis_conn, uploaded_size_key, uploaded_size);
+                uint64_t offset = tag & ~uint64_t(1);
+                int attempt = tag & 1;
+                read_block &b = blocks[offset];
+                read_attempt &a = b.attempts[attempt];
+                a.outstanding = false;
+                if (attempt == 1)
+                {
+                        hedges_in_flight--;
+                        if (ret >= 0)
+                        {
+                                ret = a.rval;
+                        }
+                }
+                if (b.winner >= 0)
+                {
+                        // 另一个已经先回来了, 这个是被取消的或者晚到的
+                        release_block(offset);
+                        continue;
+                }
+                uint64_t expected = std::min(block_size, object_size - offset);
+                if (ret < 0 || a.bl.length() != expected)
+                {
+                        if (b.attempts[1 - attempt].outstanding)
+                        {
+                                // 另一个还在途, 等它
+                                release_block(offset);
+                                continue;
+                        }
+                        // 长度不对说明对象被改了, 重试也没用
+                        schedule_retry(tag, ret < 0 ? ret : -EIO);
+                        continue;
+                }
+                b.winner = attempt;
+                latency.record(std::chrono::steady_clock::now() - a.started);
+                if (b.attempts[1 - attempt].outstanding)
+                {
+                        window.cancel(io_ctx, offset | (1 - attempt));
+                }
+                if (attempt == 1)
+                {
+                        hedges_won++;
                 }
-        }
-}
 
-// 上传本地文件到Ceph池，支持断点续传
-std::string local_file_path_to_upload = "md5.h";  // 更改为要上传的本地文件的路径
-std::string object_name_to_upload = "myobject";   // 更改为要在Ceph池中创建的对象名称
-std::string uploaded_size_key = "uploaded_size1"; // 更改为要在Redis中存储已上传数据量的键名
+                // 回复长度和预先给的缓冲区一样时librados直接读进池里的缓冲区, 否则换成它自己的
+                bool in_place = a.bl.get_num_buffers() == 1 && a.bl.buffers().front().c_str() == a.buf;
+                if (in_place || direct_io)
+                {
+                        // 整块从池里的缓冲区写; O_DIRECT要求对齐, 不在原地的先拷过来, 尾巴补齐到4K, 多写的部分最后截掉
+                        uint64_t pos = offset;
+                        for (const auto &p : a.bl.buffers())
+                        {
+                                hasher.update(pos, p.c_str(), p.length());
+                                if (!in_place)
+                                {
+                                        memcpy(a.buf + (pos - offset), p.c_str(), p.length());
+                                }
+                                pos += p.length();
+                        }
+                        size_t len = a.bl.length();
+                        if (direct_io)
+                        {
+                                memset(a.buf + len, 0, round_up_to(len, direct_io_alignment) - len);
+                                len = round_up_to(len, direct_io_alignment);
+                        }
+                        while (io.full())
+                        {
+                                wait_write();
+                        }
+                        b.writes_remaining = 1;
+                        write_owner[next_write_id] = offset;
+                        io.prep_write(fd, a.buf, len, offset, next_write_id++);
+                }
+                else
+                {
+                        // 将对象内容写入本地文件, 按段写, 不用c_str()拼成连续内存
+                        uint64_t pos = offset;
+                        b.writes_remaining = a.bl.get_num_buffers();
+                        for (const auto &p : a.bl.buffers())
+                        {
+                                hasher.update(pos, p.c_str(), p.length());
+                                while (io.full())
+                                {
+                                        wait_write();
+                                }
+                                write_owner[next_write_id] = offset;
+                                io.prep_write(fd, p.c_str(), p.length(), pos, next_write_id++);
+                                pos += p.length();
+                        }
+                }
+                io.submit();
 
-/* void upload_local_file_to_object(librados::IoCtx &io_ctx, const std::string &file_path, const std::string &object_name)
-{
-        std::ifstream input_file(file_path, std::ios::binary);
-        if (!input_file.is_open())
+                // 顺手收掉已经写完的
+                uint64_t id;
+                int64_t res;
+                while (io.poll(id, res))
+                {
+                        finish_write(id, res);
+                }
+        }
+        // 出错退出循环的时候还有读在途, 等它们回来再放开缓冲区; 等重试的不再发
+        uint64_t tag;
+        while (window.in_flight() > 0)
         {
-                std::cerr << "Couldn't open local file for reading! error " << std::endl;
-                exit(EXIT_FAILURE);
+                window.wait_one(tag, ret);
         }
-
-        // 读取本地文件内容
-        input_file.seekg(0, std::ios::end);
-        // 获取当前文件读取位置
-        std::streamsize file_size = input_file.tellg();
-        input_file.seekg(0, std::ios::beg);
-
-        std::vector<char> file_buffer(file_size);
-        input_file.read(file_buffer.data(), file_size);
-        input_file.close();
-
-        // 将文件内容写入Ceph对象
-        librados::bufferlist write_buf;
-        write_buf.append(file_buffer.data(), file_size);
-        int ret = io_ctx.write_full(object_name, write_buf);
-        if (ret < 0)
+        // 等本地写全部完成
+        uint64_t id;
+        int64_t res;
+        while (io.wait(id, res))
         {
-                std::cerr << "Couldn't write object! error " << ret << std::endl;
-                exit(EXIT_FAILURE);
+                finish_write(id, res);
         }
 
-        std::cout << "Uploaded local file '" << file_path << "' to object '" << object_name << "'." << std::endl;
-} */
-
-// 我们将下载的文件保存到本地文件系统上的 "downloaded_object.txt" 文件中
-// 保存的文件名local_file_path
-std::string local_file_path = "downloaded_object.txt";
-
-// 读取对象到本地文件的函数
-/* void download_object_to_local_file(librados::IoCtx &io_ctx, const std::string &object_name, const std::string &file_path)
-{
-        librados::bufferlist read_buf;
-        uint64_t object_size;
-        time_t object_mtime;
-        int ret;
-
-        // 获取对象大小
-        // 下载对象到本地文件
-        ret = io_ctx.stat(object_name, &object_size, &object_mtime);
-        if (ret < 0)
+        // O_DIRECT最后一块补齐写多了, 截回对象的实际大小
+        if (failure == 0 && direct_io && ftruncate(fd, object_size) < 0)
         {
-                std::cerr << "Couldn't stat object! error " << ret << std::endl;
-                exit(EXIT_FAILURE);
+                std::cerr << "Couldn't truncate local file! error " << errno << std::endl;
+                failure = -errno;
         }
 
-        // 读取对象内容
-        ret = io_ctx.read(object_name, read_buf, object_size, 0);
-        if (ret < 0)
+        // 关闭本地文件
+        close(fd);
+        if (failure < 0)
         {
-                std::cerr << "Couldn't read object! error " << ret << std::endl;
-                exit(EXIT_FAILURE);
+                std::remove(file_path.c_str());
+                return failure;
         }
-
-        // 将对象内容写入本地文件
-        std::ofstream output_file(file_path, std::ios::binary);
-        if (!output_file.is_open())
+        pool.print_stats("Download");
+        retry.print_stats("Download");
+        if (hedges_sent > 0)
         {
-                std::cerr << "Couldn't open local file for writing! error " << std::endl;
-                exit(EXIT_FAILURE);
+                std::cout << "Hedged " << hedges_sent << " slow reads, " << hedges_won << " of them returned first." << std::endl;
         }
-        output_file.write(read_buf.c_str(), read_buf.length());
-        output_file.close();
 
-        std::cout << "Downloaded object '" << object_name << "' to local file '" << file_path << "'." << std::endl;
-} */
-// 分块下载对象到本地文件的函数
-void download_object_to_local_file(librados::IoCtx &io_ctx, const std::string &object_name, const std::string &file_path)
-{
-        librados::bufferlist read_buf;
-        uint64_t object_size;
-        time_t object_mtime;
-        int ret;
-        uint64_t block_size = 4096;
-        // 获取对象大小
-        ret = io_ctx.stat(object_name, &object_size, &object_mtime);
-        if (ret < 0)
+        if (verify && (ret = verify_download(hasher, expected_hash, object_name, file_path, hash_cipher)) < 0)
         {
-                std::cerr << "Couldn't stat object! error " << ret << std::endl;
-                exit(EXIT_FAILURE);
+                return ret;
         }
 
-        // 打开本地文件
-        std::ofstream output_file(file_path, std::ios::binary);
-        if (!output_file.is_open())
+        std::cout << "Downloaded object '" << object_name << "' to local file '" << file_path << "'." << std::endl;
+        return 0;
+}
+// 测一下分帧加密/解密每秒能处理多少数据, 单线程和每核一个线程各测一遍, 看能不能跟上网卡
+void run_crypto_bench(uint64_t total_mb)
+{
+        std::string key(crypt_key_size, '\0');
+        RAND_bytes(reinterpret_cast<unsigned char *>(&key[0]), key.size());
+        chunk_cipher cipher(key);
+        compress_options no_compress;
+        const size_t chunk = tree_hash_leaf_size;
+        std::string data(chunk, '\0');
+        RAND_bytes(reinterpret_cast<unsigned char *>(&data[0]), data.size());
+        uint64_t chunks = std::max<uint64_t>(1, total_mb * 1024 * 1024 / chunk);
+        std::vector<unsigned> thread_counts = {1};
+        if (std::thread::hardware_concurrency() > 1)
         {
-                std::cerr << "Couldn't open local file for writing! error " << std::endl;
-                exit(EXIT_FAILURE);
+                thread_counts.push_back(std::thread::hardware_concurrency());
         }
-
-        // 分块读取对象内容并写入本地文件
-        uint64_t offset = 0;
-        while (offset < object_size)
+        for (unsigned threads : thread_counts)
         {
-                uint64_t read_size = std::min(block_size, object_size - offset);
-                ret = io_ctx.read(object_name, read_buf, read_size, offset);
-                if (ret < 0)
+                ordered_pipeline pipeline(threads);
+                std::string frame;
+                auto start = std::chrono::steady_clock::now();
+                for (uint64_t i = 0; i < chunks; i++)
                 {
-                        std::cerr << "Couldn't read object! error " << ret << std::endl;
-                        output_file.close();
-                        exit(EXIT_FAILURE);
+                        pipeline.submit([&data, &cipher, &no_compress, i, chunk] {
+                                return compress_frame(data.data(), chunk, no_compress, 0, &cipher, i * chunk);
+                        });
+                        while (pipeline.outstanding() > 2 * threads)
+                        {
+                                pipeline.next(frame);
+                        }
                 }
+                while (pipeline.next(frame))
+                {
+                }
+                double encrypt_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-                // 将对象内容写入本地文件
-                output_file.write(read_buf.c_str(), read_buf.length());
-
-                // 更新偏移量
-                offset += read_size;
+                // 解密用最后一帧反复解, 每次先拷一份, 因为是原地解密
+                start = std::chrono::steady_clock::now();
+                for (uint64_t i = 0; i < chunks; i++)
+                {
+                        pipeline.submit([&frame, &cipher, chunks, chunk] {
+                                std::string copy = frame;
+                                std::string raw(chunk, '\0');
+                                frame_header h;
+                                decode_frame_header(copy.data(), h);
+                                return decode_frame(h, copy.data(), (chunks - 1) * chunk, &cipher, raw.data()) ? raw : std::string();
+                        });
+                        while (pipeline.outstanding() > 2 * threads)
+                        {
+                                std::string raw;
+                                pipeline.next(raw);
+                        }
+                }
+                std::string raw;
+                while (pipeline.next(raw))
+                {
+                }
+                double decrypt_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                double gb = chunks * chunk / 1e9;
+                printf("%u threads: encrypt %.2f GB/s, decrypt %.2f GB/s\n", threads, gb / encrypt_s, gb / decrypt_s);
         }
-
-        // 关闭本地文件
-        output_file.close();
-
-        std::cout << "Downloaded object '" << object_name << "' to local file '" << file_path << "'." << std::endl;
 }
+
 int main(int argc, const char **argv)
 {
+        // 守护进程的socket
+        const char *daemon_socket = getenv("CEPH2_SOCKET") ? getenv("CEPH2_SOCKET") : default_daemon_socket;
+
+        // ceph2 client <upload|ingest|download|put|get|unlink> <池> <源> <目标>: 把任务交给常驻的守护进程, 不用自己连集群
+        // 不带参数就从标准输入读任务, 一行一个, 字段用tab隔开, 适合一次传成千上万个小文件
+        if (argc > 1 && strcmp(argv[1], "client") == 0)
+        {
+                std::vector<transfer_job> jobs;
+                if (argc > 5)
+                {
+                        jobs.push_back({argv[2], argv[3], argv[4], argv[5]});
+                }
+                else
+                {
+                        std::string line;
+                        while (std::getline(std::cin, line))
+                        {
+                                transfer_job job;
+                                if (!line.empty() && transfer_job::parse(line, job))
+                                {
+                                        jobs.push_back(job);
+                                }
+                                else if (!line.empty())
+                                {
+                                        std::cerr << "Ignoring malformed job line: " << line << std::endl;
+                                }
+                        }
+                }
+                return submit_transfer_jobs(daemon_socket, jobs) == 0 ? 0 : EXIT_FAILURE;
+        }
+
+        // ceph2 bench-crypto [MB]: 测加密的吞吐, 不用连集群和redis
+        if (argc > 1 && strcmp(argv[1], "bench-crypto") == 0)
+        {
+                run_crypto_bench(argc > 2 ? std::stoull(argv[2]) : 4096);
+                return 0;
+        }
 
         redisContext *redis_conn = redisConnect("127.0.0.1", 6379);
         if (redis_conn == nullptr || redis_conn->err)
@@ -241,6 +1562,14 @@ int main(int argc, const char **argv)
                 }
                 exit(EXIT_FAILURE);
         }
+
+        // ceph2 migrate-redis [上传进度键名的模式]: 把旧格式的redis元数据搬到紧凑格式, 不用连集群
+        if (argc > 1 && strcmp(argv[1], "migrate-redis") == 0)
+        {
+                migrate_redis_schema(redis_conn, argc > 2 ? argv[2] : "uploaded_size*");
+                redisFree(redis_conn);
+                return 0;
+        }
         /*  // 上传本地文件到Ceph池，支持断点续传
          std::string local_file_path_to_upload = "local_file.txt"; // 更改为要上传的本地文件的路径
          std::string object_name_to_upload = "uploaded_object";    // 更改为要在Ceph池中创建的对象名称
@@ -328,6 +1657,268 @@ int main(int argc, const char **argv)
                 }
         }
 
+        // 设置了CEPH2_DIRECT_IO就用O_DIRECT读写本地文件, 备份大文件时不冲掉page cache
+        bool direct_io = getenv("CEPH2_DIRECT_IO") != nullptr;
+
+        // 上传时按块压缩: CEPH2_COMPRESS=zstd|lz4, 级别用CEPH2_COMPRESS_LEVEL; 下载时看对象上的标记自动解压
+        compress_options compress;
+        if (getenv("CEPH2_COMPRESS") != nullptr && !parse_codec(getenv("CEPH2_COMPRESS"), compress.codec))
+        {
+                std::cerr << "Unknown codec '" << getenv("CEPH2_COMPRESS") << "'!" << std::endl;
+                exit(EXIT_FAILURE);
+        }
+        if (getenv("CEPH2_COMPRESS_LEVEL") != nullptr)
+        {
+                compress.level = atoi(getenv("CEPH2_COMPRESS_LEVEL"));
+        }
+
+        // 客户端加密: CEPH2_ENCRYPTION_KEY是密钥文件的路径, 设置了就加密上传, 下载加密的对象也要它
+        std::unique_ptr<chunk_cipher> cipher;
+        if (getenv("CEPH2_ENCRYPTION_KEY") != nullptr)
+        {
+                cipher.reset(new chunk_cipher(load_encryption_key(getenv("CEPH2_ENCRYPTION_KEY"))));
+        }
+
+        // 下载时对慢的读请求做对冲读, 设置了CEPH2_NO_HEDGE就关掉
+        hedge_options hedge;
+        hedge.enabled = getenv("CEPH2_NO_HEDGE") == nullptr;
+
+        // 传输进度每CEPH2_PROGRESS_INTERVAL_MS毫秒(默认1000)输出一次; CEPH2_NO_PROGRESS关掉控制台上的进度,
+        // CEPH2_PROGRESS_METRICS是Prometheus指标文件的路径
+        progress_reporter progress(std::chrono::milliseconds(getenv("CEPH2_PROGRESS_INTERVAL_MS") ? std::max(10, atoi(getenv("CEPH2_PROGRESS_INTERVAL_MS"))) : 1000));
+        if (getenv("CEPH2_NO_PROGRESS") == nullptr)
+        {
+                progress.add_sink(console_progress_sink());
+        }
+        if (getenv("CEPH2_PROGRESS_METRICS") != nullptr)
+        {
+                progress.add_sink(metrics_progress_sink(getenv("CEPH2_PROGRESS_METRICS")));
+        }
+        progress.start();
+
+        // 跑协程的执行器, 几个线程就够了
+        coro_executor executor(2);
+
+        // 纠删码池要求按条带对齐写, 上传的时候要攒成整条带
+        uint64_t alignment = 0;
+        if (pool_write_alignment(io_ctx, alignment) < 0)
+        {
+                exit(EXIT_FAILURE);
+        }
+        if (alignment != 0)
+        {
+                std::cout << "Pool requires write alignment of " << alignment << " bytes." << std::endl;
+        }
+
+        // 日志流模式: ceph2 append <对象名前缀> [一直在增长的文件], 不给文件就读标准输入
+        if (argc > 2 && strcmp(argv[1], "append") == 0)
+        {
+                append_options opts;
+                opts.alignment = alignment;
+                int fd = STDIN_FILENO;
+                if (argc > 3)
+                {
+                        fd = open(argv[3], O_RDONLY);
+                        if (fd < 0)
+                        {
+                                std::cerr << "Couldn't open the local file!" << std::endl;
+                                exit(EXIT_FAILURE);
+                        }
+                        opts.follow = true;
+                }
+                append_ingester ingester(io_ctx, redis_conn, argv[2], opts);
+                ingester.run(fd);
+                redisFree(redis_conn);
+                return 0;
+        }
+
+        // ceph2 export <目录> [分片数]: 把整个池导出到本地目录, 可以断点续传
+        if (argc > 2 && strcmp(argv[1], "export") == 0)
+        {
+                export_options opts;
+                if (argc > 3)
+                {
+                        opts.shards = std::max(1, atoi(argv[3]));
+                }
+                // 导出协程里写本地文件是同步的, 单独用一个线程多一点的执行器
+                coro_executor export_executor(std::max(2u, std::thread::hardware_concurrency()));
+                pool_exporter exporter(io_ctx, export_executor, argv[2], opts);
+                uint64_t failed = exporter.run();
+                redisFree(redis_conn);
+                return failed == 0 ? 0 : EXIT_FAILURE;
+        }
+
+        // ceph2 daemon: 常驻, 集群连接和IoCtx一直留着, 通过UNIX socket接收client发来的任务
+        if (argc > 1 && strcmp(argv[1], "daemon") == 0)
+        {
+                // 本地的去重过滤器, 新文件不用先去redis查一次有没有
+                // 容量按CEPH2_DEDUP_CAPACITY(默认1600万个指纹, 64MB内存), 装不下了就退化成每次都问redis
+                uint64_t dedup_capacity = getenv("CEPH2_DEDUP_CAPACITY") ? std::stoull(getenv("CEPH2_DEDUP_CAPACITY")) : 16 << 20;
+                cuckoo_filter dedup_filter(dedup_capacity);
+                warm_dedup_filter(redis_conn, dedup_filter);
+                // 每个有过内容寻址存储的池在后台慢慢回收没人引用的内容对象
+                cas_gc_pools gcs(cluster);
+                gcs.discover(redis_conn);
+                redisFree(redis_conn);
+                transfer_daemon daemon(cluster, daemon_socket, [&](const transfer_job &job, librados::IoCtx &job_io_ctx, redisContext *job_redis) {
+                        // 要写对象的任务先查池的写对齐, 查不到只是这个任务失败
+                        uint64_t job_alignment = 0;
+                        if (job.op == "ingest" || job.op == "upload" || job.op == "put")
+                        {
+                                int ret = pool_write_alignment(job_io_ctx, job_alignment);
+                                if (ret < 0)
+                                {
+                                        return ret;
+                                }
+                        }
+                        if (job.op == "ingest")
+                        {
+                                // 和upload一样, 但是同样内容的文件已经存过了就跳过
+                                // 过滤器说肯定没有的直接去认领, 只要一次redis往返; 可能有的才先确认
+                                if (access(job.src.c_str(), R_OK) < 0)
+                                {
+                                        return -errno;
+                                }
+                                std::string file_hash = calculate_file_tree_hash(job.src);
+                                if (file_hash.empty())
+                                {
+                                        return -EIO;
+                                }
+                                if (cipher)
+                                {
+                                        // 加密上传按带密钥的指纹去重, 和对象上存的一样
+                                        file_hash = cipher->keyed_hash(file_hash);
+                                }
+                                // 命中了就从存着这份内容的对象复制出job.dst, 复制不了(没记位置, 原对象没了)就照常上传
+                                std::string location;
+                                if (is_file_hash_in_redis(job_redis, file_hash, &dedup_filter, &location) &&
+                                    copy_deduplicated_object(cluster, job_io_ctx, job.dst, location, file_hash) == 0)
+                                {
+                                        return 0;
+                                }
+                                dedup_claim claim(job_redis, file_hash);
+                                dedup_claim::state_t state = claim.claim_or_wait();
+                                if (state == dedup_claim::FAILED)
+                                {
+                                        return -EIO;
+                                }
+                                if (state == dedup_claim::COMPLETE &&
+                                    copy_deduplicated_object(cluster, job_io_ctx, job.dst, claim.location(), file_hash) == 0)
+                                {
+                                        dedup_filter.insert(hex_to_binary(file_hash));
+                                        return 0;
+                                }
+                                std::string size_key = "uploaded_size:" + job.pool + ":" + job.dst;
+                                int ret = upload_local_file_to_object(job_io_ctx, job.src, job.dst, job_redis, size_key,
+                                                                      job_alignment, direct_io, compress, cipher.get());
+                                if (ret < 0)
+                                {
+                                        if (state == dedup_claim::CLAIMED)
+                                        {
+                                                claim.release();
+                                        }
+                                        return ret;
+                                }
+                                // 记下这份内容在哪, 以后同样的文件从这里复制
+                                if ((ret = claim.complete(job.pool + "\t" + job.dst)) < 0)
+                                {
+                                        return ret;
+                                }
+                                dedup_filter.insert(hex_to_binary(file_hash));
+                                return 0;
+                        }
+                        if (job.op == "upload")
+                        {
+                                // 续传进度按池和对象分开记
+                                std::string size_key = "uploaded_size:" + job.pool + ":" + job.dst;
+                                return upload_local_file_to_object(job_io_ctx, job.src, job.dst, job_redis, size_key,
+                                                                   job_alignment, direct_io, compress, cipher.get());
+                        }
+                        if (job.op == "download")
+                        {
+                                return download_object_to_local_file(job_io_ctx, job.src, job.dst, direct_io, hedge, cipher.get());
+                        }
+                        // 内容寻址存储: 文件名只是对内容对象的引用, 同样的内容只存一份
+                        if (job.op == "put")
+                        {
+                                if (access(job.src.c_str(), R_OK) < 0)
+                                {
+                                        return -errno;
+                                }
+                                gcs.ensure(job.pool);
+                                cas_store store(job_io_ctx, job_redis, cipher.get());
+                                return store.put(job.dst, job.src, [&](const std::string &path, const std::string &object_name) {
+                                        std::string size_key = "uploaded_size:" + job.pool + ":" + object_name;
+                                        return upload_local_file_to_object(job_io_ctx, path, object_name, job_redis, size_key,
+                                                                           job_alignment, direct_io, compress, cipher.get());
+                                });
+                        }
+                        if (job.op == "get")
+                        {
+                                cas_store store(job_io_ctx, job_redis);
+                                std::string object_name;
+                                int ret = store.resolve(job.src, object_name);
+                                if (ret < 0)
+                                {
+                                        return ret;
+                                }
+                                return download_object_to_local_file(job_io_ctx, object_name, job.dst, direct_io, hedge, cipher.get());
+                        }
+                        if (job.op == "unlink")
+                        {
+                                gcs.ensure(job.pool);
+                                cas_store store(job_io_ctx, job_redis);
+                                return store.unlink(job.src);
+                        }
+                        return -EINVAL;
+                });
+                daemon.run();
+        }
+
+        // ceph2 gc [宽限秒数]: 回收一轮内容寻址存储里没人引用的对象, 按限速删
+        if (argc > 1 && strcmp(argv[1], "gc") == 0)
+        {
+                cas_gc_options opts;
+                if (argc > 2)
+                {
+                        opts.grace_s = std::max(0, atoi(argv[2]));
+                }
+                cas_gc gc(io_ctx, opts);
+                gc.run_once(redis_conn);
+                redisFree(redis_conn);
+                return 0;
+        }
+
+        // ceph2 mirror <目标池> [目标集群的ceph.conf]: 把当前池增量复制到目标池
+        if (argc > 2 && strcmp(argv[1], "mirror") == 0)
+        {
+                // 给了配置文件就连另一个集群, 否则目标池在同一个集群里
+                librados::Rados dst_cluster;
+                librados::Rados *dst = &cluster;
+                if (argc > 3)
+                {
+                        if ((ret = dst_cluster.init2(user_name, cluster_name, flags)) < 0 ||
+                            (ret = dst_cluster.conf_read_file(argv[3])) < 0 || (ret = dst_cluster.connect()) < 0)
+                        {
+                                std::cerr << "Couldn't connect to the destination cluster! error " << ret << std::endl;
+                                return EXIT_FAILURE;
+                        }
+                        dst = &dst_cluster;
+                }
+                librados::IoCtx dst_io_ctx;
+                ret = dst->ioctx_create(argv[2], dst_io_ctx);
+                if (ret < 0)
+                {
+                        std::cerr << "Couldn't set up ioctx for the destination pool! error " << ret << std::endl;
+                        return EXIT_FAILURE;
+                }
+                pool_mirror mirror(io_ctx, *dst, dst_io_ctx, executor, redis_conn);
+                uint64_t failed = mirror.run();
+                dst_io_ctx.close();
+                redisFree(redis_conn);
+                return failed == 0 ? 0 : EXIT_FAILURE;
+        }
+
         /* Write an object synchronously. */
         {
                 librados::bufferlist bl;
@@ -345,7 +1936,37 @@ int main(int argc, const char **argv)
         }
         // 上传文件函数
         // upload_local_file_to_object(io_ctx, local_file_path_to_upload, object_name_to_upload);
-        upload_local_file_to_object(io_ctx, local_file_path_to_upload, object_name_to_upload, redis_conn, uploaded_size_key);
+        // 先用多线程树形哈希算文件指纹, redis里已经有了就不用再传
+        // 原子地认领这个指纹, 别人正在传同一个文件就等它传完, 不重复上传
+        std::string file_hash = calculate_file_tree_hash(local_file_path_to_upload);
+        if (cipher && !file_hash.empty())
+        {
+                file_hash = cipher->keyed_hash(file_hash);
+        }
+        dedup_claim claim(redis_conn, file_hash);
+        dedup_claim::state_t claim_state = claim.claim_or_wait();
+        if (claim_state == dedup_claim::FAILED)
+        {
+                exit(EXIT_FAILURE);
+        }
+        // 已经有人传过了就从那个对象复制, 复制不了(没记位置, 原对象没了)就照常上传
+        if (claim_state == dedup_claim::COMPLETE &&
+            copy_deduplicated_object(cluster, io_ctx, object_name_to_upload, claim.location(), file_hash) == 0)
+        {
+                std::cout << "File already exists in the storage, skipping the upload." << std::endl;
+        }
+        else
+        {
+                if (upload_local_file_to_object(io_ctx, local_file_path_to_upload, object_name_to_upload, redis_conn, uploaded_size_key, alignment, direct_io, compress, cipher.get()) < 0)
+                {
+                        if (claim_state == dedup_claim::CLAIMED)
+                        {
+                                claim.release();
+                        }
+                        exit(EXIT_FAILURE);
+                }
+                claim.complete(io_ctx.get_pool_name() + "\t" + object_name_to_upload);
+        }
         // upload_local_file_to_object(io_ctx, local_file_path_to_upload, object_name_to_upload);
         /*
          * Add an xattr to the object.
@@ -373,20 +1994,8 @@ int main(int argc, const char **argv)
                 librados::bufferlist read_buf;
                 int read_len = 4194304;
 
-                // Create I/O Completion.
-                librados::AioCompletion *read_completion = librados::Rados::aio_create_completion();
-
-                // Send read request.
-                ret = io_ctx.aio_read("myobject", read_completion, &read_buf, read_len, 0);
-                if (ret < 0)
-                {
-                        std::cerr << "Couldn't start read object! error " << ret << std::endl;
-                        exit(EXIT_FAILURE);
-                }
-
-                // Wait for the request to complete, and check that it succeeded.
-                read_completion->wait_for_complete();
-                ret = read_completion->get_return_value();
+                // 协程里顺序写stat和read, 等待的时候不占线程
+                ret = sync_wait(executor, read_object_coro(executor, io_ctx, "myobject", &read_buf, read_len));
                 if (ret < 0)
                 {
                         std::cerr << "Couldn't read object! error " << ret << std::endl;
@@ -419,7 +2028,10 @@ int main(int argc, const char **argv)
         }
 
         // 下载文件函数
-        download_object_to_local_file(io_ctx, object_name_to_upload, local_file_path);
+        if (download_object_to_local_file(io_ctx, object_name_to_upload, local_file_path, direct_io, hedge, cipher.get()) < 0)
+        {
+                exit(EXIT_FAILURE);
+        }
 
         /*
          * Remove the xattr.
@@ -0,0 +1,394 @@
+#pragma once
+#include "crypto.h"
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <lz4.h>
+#include <lz4hc.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zstd.h>
+
+// 上传前按块压缩, 文本和日志一般能压到五分之一以下, 跨机房的带宽是瓶颈的时候很划算
+// 压缩过的对象是一串帧, 每帧对应原文件的一块(4MB, 最后一块可能短一些):
+//   [帧头 20字节][加密的话: nonce 12字节, 认证标签 16字节][数据][补0到池的写对齐]
+// 帧头: 魔数(4) 编码(1) 标志(1) 保留(2) 原始长度(4) 数据长度(4) 整帧长度(4), 都是小端
+// 已经压缩过的数据(图片, 视频, 压缩包)熵很高, 压不动, 先抽样估一下熵, 太高的块直接原样存(编码为none)
+// 对象上用xattr记下编码和原始大小, 下载的时候看到就自动解压; 哈希还是按原始数据算的
+const char *const compress_xattr_codec = "compress.codec";
+const char *const compress_xattr_size = "compress.size";
+
+const uint32_t compress_frame_magic = 0x5a463243; // "C2FZ"
+const size_t compress_frame_header_size = 20;
+const uint8_t frame_flag_encrypted = 1;
+
+enum compress_codec : uint8_t
+{
+        CODEC_NONE = 0,
+        CODEC_ZSTD = 1,
+        CODEC_LZ4 = 2,
+};
+
+inline const char *codec_name(compress_codec codec)
+{
+        switch (codec)
+        {
+        case CODEC_ZSTD:
+                return "zstd";
+        case CODEC_LZ4:
+                return "lz4";
+        default:
+                return "none";
+        }
+}
+
+inline bool parse_codec(const std::string &name, compress_codec &codec)
+{
+        for (compress_codec c : {CODEC_NONE, CODEC_ZSTD, CODEC_LZ4})
+        {
+                if (name == codec_name(c))
+                {
+                        codec = c;
+                        return true;
+                }
+        }
+        return false;
+}
+
+struct compress_options
+{
+        compress_codec codec = CODEC_NONE;
+        int level = 3;            // zstd是1到19; lz4小于等于1用快速模式, 大于1用HC模式
+        unsigned threads = 0;     // 压缩线程数, 0表示每个核一个
+        double max_entropy = 7.5; // 抽样的熵(比特/字节)超过这个就不压
+        size_t sample_bytes = 64 * 1024;
+};
+
+// 在块里均匀取16段抽样, 按字节分布算香农熵, 8表示完全随机
+inline double sample_entropy(const char *data, size_t len, size_t sample_bytes)
+{
+        if (len == 0)
+        {
+                return 0;
+        }
+        const size_t pieces = 16;
+        size_t piece = std::max<size_t>(1, std::min(len, sample_bytes) / pieces);
+        uint64_t counts[256] = {0};
+        uint64_t total = 0;
+        for (size_t i = 0; i < pieces; i++)
+        {
+                size_t start = (len - piece) / (pieces - 1) * i;
+                for (size_t j = start; j < start + piece && j < len; j++)
+                {
+                        counts[static_cast<unsigned char>(data[j])]++;
+                        total++;
+                }
+        }
+        double entropy = 0;
+        for (uint64_t n : counts)
+        {
+                if (n > 0)
+                {
+                        double p = static_cast<double>(n) / total;
+                        entropy -= p * std::log2(p);
+                }
+        }
+        return entropy;
+}
+
+struct frame_header
+{
+        compress_codec codec;
+        bool encrypted;
+        uint32_t raw_len;
+        uint32_t stored_len;
+        uint32_t frame_len;
+};
+
+inline void put_le32(char *p, uint32_t v)
+{
+        for (int i = 0; i < 4; i++)
+        {
+                p[i] = static_cast<char>(v >> (8 * i));
+        }
+}
+
+inline uint32_t get_le32(const char *p)
+{
+        uint32_t v = 0;
+        for (int i = 0; i < 4; i++)
+        {
+                v |= static_cast<uint32_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+        }
+        return v;
+}
+
+// 帧里数据开始的位置
+inline size_t frame_payload_offset(bool encrypted)
+{
+        return compress_frame_header_size + (encrypted ? crypt_nonce_size + crypt_tag_size : 0);
+}
+
+// 不是合法的帧头返回false
+inline bool decode_frame_header(const char *p, frame_header &h)
+{
+        if (get_le32(p) != compress_frame_magic)
+        {
+                return false;
+        }
+        h.codec = static_cast<compress_codec>(p[4]);
+        h.encrypted = p[5] & frame_flag_encrypted;
+        h.raw_len = get_le32(p + 8);
+        h.stored_len = get_le32(p + 12);
+        h.frame_len = get_le32(p + 16);
+        return h.codec <= CODEC_LZ4 && h.frame_len >= frame_payload_offset(h.encrypted) + h.stored_len &&
+               (h.codec != CODEC_NONE || h.stored_len == h.raw_len);
+}
+
+// 认证数据: 帧头加上这一帧在原文件里的偏移量
+inline std::string frame_aad(const char *header, uint64_t raw_offset)
+{
+        std::string aad(header, compress_frame_header_size);
+        for (int i = 0; i < 8; i++)
+        {
+                aad += static_cast<char>(raw_offset >> (8 * i));
+        }
+        return aad;
+}
+
+// 压缩一块, 返回整帧; 熵太高或者压完没变小就原样存
+// alignment是池的写对齐, 每帧补0到它的整数倍, 帧的边界就是续传可以接着写的位置
+// 给了cipher就把数据部分加密, raw_offset是这一块在原文件里的偏移量; 加密失败返回空串
+inline std::string compress_frame(const char *data, size_t len, const compress_options &opts, uint64_t alignment,
+                                  const chunk_cipher *cipher = nullptr, uint64_t raw_offset = 0)
+{
+        const size_t header = frame_payload_offset(cipher != nullptr);
+        std::string frame(header, '\0');
+        compress_codec codec = opts.codec;
+        if (codec != CODEC_NONE && sample_entropy(data, len, opts.sample_bytes) > opts.max_entropy)
+        {
+                codec = CODEC_NONE;
+        }
+        size_t stored = 0;
+        if (codec == CODEC_ZSTD)
+        {
+                frame.resize(header + ZSTD_compressBound(len));
+                stored = ZSTD_compress(&frame[header], frame.size() - header, data, len, opts.level);
+                if (ZSTD_isError(stored))
+                {
+                        stored = 0;
+                }
+        }
+        else if (codec == CODEC_LZ4)
+        {
+                frame.resize(header + LZ4_compressBound(len));
+                char *dst = &frame[header];
+                int capacity = static_cast<int>(frame.size() - header);
+                int n = opts.level > 1 ? LZ4_compress_HC(data, dst, len, capacity, opts.level)
+                                       : LZ4_compress_default(data, dst, len, capacity);
+                stored = n > 0 ? n : 0;
+        }
+        if (stored == 0 || stored >= len)
+        {
+                codec = CODEC_NONE;
+                frame.resize(header);
+                frame.append(data, len);
+                stored = len;
+        }
+        frame.resize(header + stored);
+        if (alignment != 0)
+        {
+                frame.resize((frame.size() + alignment - 1) / alignment * alignment, '\0');
+        }
+        put_le32(&frame[0], compress_frame_magic);
+        frame[4] = static_cast<char>(codec);
+        frame[5] = static_cast<char>(cipher != nullptr ? frame_flag_encrypted : 0);
+        put_le32(&frame[8], len);
+        put_le32(&frame[12], stored);
+        put_le32(&frame[16], frame.size());
+        if (cipher != nullptr)
+        {
+                char *nonce = &frame[compress_frame_header_size];
+                std::string aad = frame_aad(frame.data(), raw_offset);
+                if (!cipher->encrypt(&frame[header], stored, aad.data(), aad.size(), nonce, nonce + crypt_nonce_size))
+                {
+                        return "";
+                }
+        }
+        return frame;
+}
+
+// 解开一帧: 先解密(要是加密了)再解压到out(长度raw_len), frame指向帧头, 数据部分会被原地解密
+// 数据损坏, 认证不通过或者加密了却没给cipher返回false
+inline bool decode_frame(const frame_header &h, char *frame, uint64_t raw_offset, const chunk_cipher *cipher, char *out)
+{
+        char *payload = frame + frame_payload_offset(h.encrypted);
+        if (h.encrypted)
+        {
+                const char *nonce = frame + compress_frame_header_size;
+                std::string aad = frame_aad(frame, raw_offset);
+                if (cipher == nullptr ||
+                    !cipher->decrypt(payload, h.stored_len, aad.data(), aad.size(), nonce, nonce + crypt_nonce_size))
+                {
+                        return false;
+                }
+        }
+        switch (h.codec)
+        {
+        case CODEC_NONE:
+                memcpy(out, payload, h.raw_len);
+                return true;
+        case CODEC_ZSTD:
+        {
+                size_t n = ZSTD_decompress(out, h.raw_len, payload, h.stored_len);
+                return !ZSTD_isError(n) && n == h.raw_len;
+        }
+        case CODEC_LZ4:
+                return LZ4_decompress_safe(payload, out, h.stored_len, h.raw_len) == static_cast<int>(h.raw_len);
+        }
+        return false;
+}
+
+// 几个线程并行地压缩/解压, 结果按提交的顺序取出来, 这样写出去的帧还是文件的顺序
+class ordered_pipeline
+{
+public:
+        explicit ordered_pipeline(unsigned threads = 0)
+        {
+                if (threads == 0)
+                {
+                        threads = std::max(1u, std::thread::hardware_concurrency());
+                }
+                for (unsigned i = 0; i < threads; i++)
+                {
+                        workers.emplace_back([this] { work(); });
+                }
+        }
+
+        ~ordered_pipeline()
+        {
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        stopping = true;
+                }
+                cond.notify_all();
+                for (std::thread &t : workers)
+                {
+                        t.join();
+                }
+        }
+
+        unsigned threads() const
+        {
+                return workers.size();
+        }
+
+        // job在工作线程里执行, 它用到的数据要一直有效, 直到next取到它的结果
+        void submit(std::function<std::string()> job)
+        {
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        jobs.push_back({std::move(job), std::string(), false});
+                        queued++;
+                }
+                cond.notify_all();
+        }
+
+        // 等最早提交的那个做完, 取出它的结果; 没有提交过的任务返回false
+        bool next(std::string &result)
+        {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (jobs.empty())
+                {
+                        return false;
+                }
+                done_cond.wait(lock, [this] { return jobs.front().done; });
+                result = std::move(jobs.front().result);
+                jobs.pop_front();
+                return true;
+        }
+
+        size_t outstanding()
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                return jobs.size();
+        }
+
+private:
+        struct job_t
+        {
+                std::function<std::string()> fn;
+                std::string result;
+                bool done;
+        };
+
+        void work()
+        {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (true)
+                {
+                        cond.wait(lock, [this] { return stopping || queued > 0; });
+                        if (stopping)
+                        {
+                                return;
+                        }
+                        // 取最早的一个还没开始的任务; deque中间插删会让引用失效, 这里只在两头操作, 元素本身不动
+                        job_t &job = jobs[jobs.size() - queued];
+                        queued--;
+                        std::function<std::string()> fn = std::move(job.fn);
+                        lock.unlock();
+                        std::string result = fn();
+                        lock.lock();
+                        job.result = std::move(result);
+                        job.done = true;
+                        done_cond.notify_all();
+                }
+        }
+
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::condition_variable done_cond;
+        std::deque<job_t> jobs; // 按提交顺序, 后面queued个还没开始
+        size_t queued = 0;
+        bool stopping = false;
+};
+
+// 压缩的统计, 上传完打印一次
+struct compress_stats
+{
+        uint64_t raw_bytes = 0;
+        uint64_t stored_bytes = 0;
+        uint64_t frames = 0;
+        uint64_t bypassed = 0; // 原样存的帧
+
+        void record(const std::string &frame)
+        {
+                frame_header h;
+                if (decode_frame_header(frame.data(), h))
+                {
+                        raw_bytes += h.raw_len;
+                        stored_bytes += h.frame_len;
+                        frames++;
+                        bypassed += h.codec == CODEC_NONE;
+                }
+        }
+
+        void print(const char *name) const
+        {
+                if (frames == 0)
+                {
+                        return;
+                }
+                std::cout << name << " compression: " << raw_bytes << " -> " << stored_bytes << " bytes ("
+                          << (raw_bytes > 0 ? stored_bytes * 100.0 / raw_bytes : 0) << "%), " << bypassed << " of " << frames
+                          << " chunks stored uncompressed." << std::endl;
+        }
+};
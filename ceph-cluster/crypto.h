@@ -0,0 +1,146 @@
+#pragma once
+#include "file_hash.h"
+#include "redis_schema.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <string>
+
+// 客户端加密: 数据离开本机之前按块用AES-256-GCM加密, 集群和网络上只有密文
+// 每块有自己的随机nonce和认证标签, 跟着帧一起存在对象里(见compression.h的帧格式), 各块可以并行加解密
+// 帧头和这一帧在原文件里的偏移量作为附加认证数据, 帧被篡改, 调换顺序或者挪到别的位置都会解密失败
+// OpenSSL的EVP会根据CPU自动用AES-NI/VAES和PCLMUL, 每个核每秒能加密几个GB
+// 加密对象上存的哈希和去重用的指纹都是明文哈希的HMAC(keyed_hash), 没有密钥的人拿已知的文件算哈希也对不上
+const char *const crypt_xattr_alg = "crypt.alg";
+const char *const crypt_xattr_key = "crypt.key";
+const char *const crypt_alg_name = "aes-256-gcm";
+
+const size_t crypt_key_size = 32;
+const size_t crypt_nonce_size = 12;
+const size_t crypt_tag_size = 16;
+
+class chunk_cipher
+{
+public:
+        explicit chunk_cipher(const std::string &key) : key(key)
+        {
+                unsigned char digest[SHA256_DIGEST_LENGTH];
+                SHA256(reinterpret_cast<const unsigned char *>(key.data()), key.size(), digest);
+                key_id = hash_to_hex(digest, 8);
+                // HMAC用的密钥从加密密钥派生, 两个用途的密钥分开
+                static const char label[] = "ceph2 hash key";
+                unsigned int len = 0;
+                HMAC(EVP_sha256(), key.data(), key.size(), reinterpret_cast<const unsigned char *>(label), sizeof(label) - 1, digest, &len);
+                mac_key.assign(reinterpret_cast<char *>(digest), len);
+        }
+
+        // 密钥的指纹(SHA-256的前8字节), 存在对象上, 下载时用错了密钥能直接报出来
+        const std::string &fingerprint() const
+        {
+                return key_id;
+        }
+
+        // 明文哈希(十六进制)的HMAC-SHA256, 也是十六进制; 同一个密钥下同样的文件结果一样, 去重照常
+        std::string keyed_hash(const std::string &hash) const
+        {
+                unsigned char mac[SHA256_DIGEST_LENGTH];
+                unsigned int len = 0;
+                HMAC(EVP_sha256(), mac_key.data(), mac_key.size(), reinterpret_cast<const unsigned char *>(hash.data()), hash.size(),
+                     mac, &len);
+                return hash_to_hex(mac, len);
+        }
+
+        // 原地加密data, nonce和tag写到给的位置; 失败返回false
+        bool encrypt(char *data, size_t len, const char *aad, size_t aad_len, char *nonce, char *tag) const
+        {
+                if (RAND_bytes(reinterpret_cast<unsigned char *>(nonce), crypt_nonce_size) != 1)
+                {
+                        return false;
+                }
+                EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+                int n = 0;
+                bool ok = ctx != nullptr &&
+                          EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, key_bytes(), reinterpret_cast<unsigned char *>(nonce)) == 1 &&
+                          EVP_EncryptUpdate(ctx, nullptr, &n, reinterpret_cast<const unsigned char *>(aad), aad_len) == 1 &&
+                          update(ctx, data, len, true) &&
+                          EVP_EncryptFinal_ex(ctx, reinterpret_cast<unsigned char *>(data) + len, &n) == 1 &&
+                          EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, crypt_tag_size, tag) == 1;
+                EVP_CIPHER_CTX_free(ctx);
+                return ok;
+        }
+
+        // 原地解密, 认证不通过(密钥不对, 数据或帧头被改过)返回false
+        bool decrypt(char *data, size_t len, const char *aad, size_t aad_len, const char *nonce, const char *tag) const
+        {
+                EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+                int n = 0;
+                bool ok = ctx != nullptr &&
+                          EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, key_bytes(), reinterpret_cast<const unsigned char *>(nonce)) == 1 &&
+                          EVP_DecryptUpdate(ctx, nullptr, &n, reinterpret_cast<const unsigned char *>(aad), aad_len) == 1 &&
+                          update(ctx, data, len, false) &&
+                          EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, crypt_tag_size, const_cast<char *>(tag)) == 1 &&
+                          EVP_DecryptFinal_ex(ctx, reinterpret_cast<unsigned char *>(data) + len, &n) == 1;
+                EVP_CIPHER_CTX_free(ctx);
+                return ok;
+        }
+
+private:
+        const unsigned char *key_bytes() const
+        {
+                return reinterpret_cast<const unsigned char *>(key.data());
+        }
+
+        // EVP_*Update的长度是int, 大块分几次喂
+        static bool update(EVP_CIPHER_CTX *ctx, char *data, size_t len, bool encrypt)
+        {
+                const size_t step = 1 << 30;
+                for (size_t done = 0; done < len; done += step)
+                {
+                        int in = static_cast<int>(std::min(step, len - done)), out = 0;
+                        unsigned char *p = reinterpret_cast<unsigned char *>(data) + done;
+                        if ((encrypt ? EVP_EncryptUpdate(ctx, p, &out, p, in) : EVP_DecryptUpdate(ctx, p, &out, p, in)) != 1)
+                        {
+                                return false;
+                        }
+                }
+                return true;
+        }
+
+        std::string key;
+        std::string key_id;
+        std::string mac_key;
+};
+
+// 从文件读密钥: 32字节的二进制, 或者64个十六进制字符(可以带换行)
+inline std::string load_encryption_key(const std::string &path)
+{
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+        {
+                std::cerr << "Couldn't open the encryption key file '" << path << "'!" << std::endl;
+                exit(EXIT_FAILURE);
+        }
+        std::string key((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (key.size() != crypt_key_size)
+        {
+                while (!key.empty() && isspace(static_cast<unsigned char>(key.back())))
+                {
+                        key.pop_back();
+                }
+                key = hex_to_binary(key);
+        }
+        if (key.size() != crypt_key_size)
+        {
+                std::cerr << "The encryption key must be 32 bytes or 64 hex digits!" << std::endl;
+                exit(EXIT_FAILURE);
+        }
+        return key;
+}
@@ -0,0 +1,149 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+// 布谷鸟过滤器: 判断一个键"肯定不在"还是"可能在", 和布隆过滤器差不多
+// 只增不删: 去重用的指纹在redis里传完以后就不会再删, 过滤器也就不需要删
+// 每个桶4个槽, 每个槽存16位指纹, 一个键只会在两个候选桶里: i1 和 i1 ^ hash(指纹)
+// 误判率大约是 8 / 2^16 = 0.012%, 每个键占2字节多一点(装到95%左右会插不进去)
+// 键要求本身就是均匀分布的(比如SHA-256摘要), 直接取它的字节当下标和指纹, 不再哈希一遍
+// 多线程可以同时用
+class cuckoo_filter
+{
+public:
+        // capacity是预计的键数, 桶数取2的幂
+        explicit cuckoo_filter(uint64_t capacity)
+        {
+                uint64_t buckets = 1;
+                while (buckets * slots_per_bucket < capacity + capacity / 16)
+                {
+                        buckets <<= 1;
+                }
+                mask = buckets - 1;
+                table.assign(buckets * slots_per_bucket, 0);
+        }
+
+        // 插不进去(太满了)返回false, 这时过滤器对所有键都回答"可能在", 不会漏判
+        // 已经"可能在"的键不再占一个槽, 同一个指纹反复插入不会把过滤器撑满
+        bool insert(const std::string &key)
+        {
+                uint16_t fp;
+                uint64_t i1, i2;
+                locate(key, fp, i1, i2);
+                std::lock_guard<std::mutex> lock(mutex);
+                if (overflowed)
+                {
+                        return false;
+                }
+                if (has(i1, fp) || has(i2, fp))
+                {
+                        return true;
+                }
+                if (put(i1, fp) || put(i2, fp))
+                {
+                        count++;
+                        return true;
+                }
+                // 两个桶都满了, 随机踢出一个指纹挪到它的另一个桶, 最多挪max_kicks次
+                uint64_t i = (rng() & 1) ? i1 : i2;
+                for (int kick = 0; kick < max_kicks; kick++)
+                {
+                        uint16_t &slot = table[i * slots_per_bucket + rng() % slots_per_bucket];
+                        std::swap(fp, slot);
+                        i = alt_index(i, fp);
+                        if (put(i, fp))
+                        {
+                                count++;
+                                return true;
+                        }
+                }
+                // 最后手上那个指纹没地方放了, 丢掉它就会漏判, 只能整个过滤器作废
+                overflowed = true;
+                return false;
+        }
+
+        // false表示肯定不在; true表示可能在, 要再去权威的地方确认
+        bool contains(const std::string &key)
+        {
+                uint16_t fp;
+                uint64_t i1, i2;
+                locate(key, fp, i1, i2);
+                std::lock_guard<std::mutex> lock(mutex);
+                return overflowed || has(i1, fp) || has(i2, fp);
+        }
+
+        uint64_t size()
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                return count;
+        }
+
+        size_t memory_bytes() const
+        {
+                return table.size() * sizeof(uint16_t);
+        }
+
+private:
+        static const int slots_per_bucket = 4;
+        static const int max_kicks = 500;
+
+        void locate(const std::string &key, uint16_t &fp, uint64_t &i1, uint64_t &i2) const
+        {
+                unsigned char bytes[10] = {0};
+                memcpy(bytes, key.data(), std::min<size_t>(key.size(), sizeof(bytes)));
+                uint64_t h;
+                memcpy(&h, bytes, sizeof(h));
+                memcpy(&fp, bytes + 8, sizeof(fp));
+                // 0表示空槽, 指纹不能是0
+                if (fp == 0)
+                {
+                        fp = 1;
+                }
+                i1 = h & mask;
+                i2 = alt_index(i1, fp);
+        }
+
+        // 另一个候选桶只和指纹有关, 踢出去的时候不需要原来的键
+        uint64_t alt_index(uint64_t i, uint16_t fp) const
+        {
+                return (i ^ (fp * 0x5bd1e995ull)) & mask;
+        }
+
+        bool put(uint64_t i, uint16_t fp)
+        {
+                for (int s = 0; s < slots_per_bucket; s++)
+                {
+                        uint16_t &slot = table[i * slots_per_bucket + s];
+                        if (slot == 0)
+                        {
+                                slot = fp;
+                                return true;
+                        }
+                }
+                return false;
+        }
+
+        bool has(uint64_t i, uint16_t fp) const
+        {
+                for (int s = 0; s < slots_per_bucket; s++)
+                {
+                        if (table[i * slots_per_bucket + s] == fp)
+                        {
+                                return true;
+                        }
+                }
+                return false;
+        }
+
+        std::mutex mutex;
+        std::vector<uint16_t> table;
+        uint64_t mask;
+        uint64_t count = 0;
+        bool overflowed = false;
+        std::minstd_rand rng;
+};
@@ -0,0 +1,236 @@
+#pragma once
+#include "redis_schema.h"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <hiredis/hiredis.h>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+// 去重认领: 同一个文件同时从很多地方来的时候只让一个上传, 其他的等它传完直接跳过
+// 指纹在 <ns>:fh:<桶> 里的值表示状态:
+//   ""                      传完了(内容寻址存储的内容对象按指纹命名, 不用记在哪; 旧版本记的也是这个)
+//   "d:<池>\t<对象名>"        传完了, 数据在这个对象里, 别的同样内容的文件从它复制
+//   "p:<认领者>:<租约到期毫秒>"  有人正在传
+// 认领, 续租, 放弃都用lua脚本在redis里原子地做, 不会两个都以为自己拿到了;
+// 时间用redis服务器的TIME, 不受各个客户端时钟不准的影响
+// 认领的进程死了租约到期以后, 别人可以接手
+class dedup_claim
+{
+public:
+        enum state_t
+        {
+                CLAIMED,  // 自己拿到了, 要上传
+                COMPLETE, // 已经有人传完了
+                PENDING,  // 别人正在传
+                FAILED,   // redis出错了, 不知道状态
+        };
+
+        dedup_claim(redisContext *redis_conn, const std::string &hash,
+                    std::chrono::milliseconds lease = std::chrono::milliseconds(60000),
+                    const std::string &ns = redis_namespace)
+            : redis_conn(redis_conn), digest(hex_to_binary(hash)), lease(lease)
+        {
+                if (digest.size() < 3)
+                {
+                        // 认领的时候返回FAILED
+                        std::cerr << "Invalid file hash '" << hash << "'!" << std::endl;
+                        return;
+                }
+                key = redis_file_hash_key(digest, ns);
+                field = redis_file_hash_field(digest);
+                char host[256] = "";
+                gethostname(host, sizeof(host) - 1);
+                owner = std::string(host) + ":" + std::to_string(getpid()) + ":" + std::to_string(std::random_device{}());
+        }
+
+        ~dedup_claim()
+        {
+                stop_heartbeat();
+        }
+
+        // 认领一次, 不等
+        state_t try_claim()
+        {
+                if (key.empty())
+                {
+                        return FAILED;
+                }
+                static const char *script =
+                    "local v = redis.call('HGET', KEYS[1], ARGV[1]) "
+                    "local t = redis.call('TIME') "
+                    "local now = tonumber(t[1]) * 1000 + math.floor(tonumber(t[2]) / 1000) "
+                    "if v == '' or string.sub(v, 1, 2) == 'd:' then return 'c:' .. v end "
+                    "if v then "
+                    "  local owner, expiry = string.match(v, '^p:(.*):(%d+)$') "
+                    "  if owner and owner ~= ARGV[2] and tonumber(expiry) > now then return 'pending' end "
+                    "end "
+                    "redis.call('HSET', KEYS[1], ARGV[1], 'p:' .. ARGV[2] .. ':' .. (now + tonumber(ARGV[3]))) "
+                    "return 'claimed'";
+                std::string result = eval(redis_conn, script);
+                if (result.compare(0, 2, "c:") == 0)
+                {
+                        completed_at = result.size() > 4 ? result.substr(4) : "";
+                        return COMPLETE;
+                }
+                if (result == "pending")
+                {
+                        return PENDING;
+                }
+                if (result != "claimed")
+                {
+                        std::cerr << "Couldn't claim file hash in Redis!" << std::endl;
+                        return FAILED;
+                }
+                start_heartbeat();
+                return CLAIMED;
+        }
+
+        // 认领, 别人正在传就一直等到它传完(返回COMPLETE)或者租约过期由自己接手(返回CLAIMED)
+        state_t claim_or_wait()
+        {
+                std::chrono::milliseconds poll(100);
+                bool announced = false;
+                while (true)
+                {
+                        state_t state = try_claim();
+                        if (state != PENDING)
+                        {
+                                return state;
+                        }
+                        if (!announced)
+                        {
+                                std::cout << "Another client is uploading the same file, waiting for it." << std::endl;
+                                announced = true;
+                        }
+                        std::this_thread::sleep_for(poll);
+                        poll = std::min(poll * 2, std::chrono::milliseconds(2000));
+                }
+        }
+
+        // 认领的结果是COMPLETE的时候, 传完的数据在哪个对象里("<池>\t<对象名>"); 没有记位置的是空串
+        const std::string &location() const
+        {
+                return completed_at;
+        }
+
+        // 上传成功, 标成传完, 等着的人会看到并跳过; location是数据所在的"<池>\t<对象名>", 别人从它复制
+        // redis出错返回-EIO, 租约到期以后别人会再传一次
+        int complete(const std::string &location = "")
+        {
+                stop_heartbeat();
+                std::string value = location.empty() ? "" : "d:" + location;
+                redisReply *reply = (redisReply *)redisCommand(redis_conn, "HSET %s %b %b", key.c_str(), field.data(),
+                                                               field.size(), value.data(), value.size());
+                if (reply == nullptr)
+                {
+                        std::cerr << "Couldn't save file hash to Redis!" << std::endl;
+                        return -EIO;
+                }
+                freeReplyObject(reply);
+                return 0;
+        }
+
+        // 上传失败, 放弃认领让别人马上接手, 不用等租约过期
+        void release()
+        {
+                stop_heartbeat();
+                static const char *script =
+                    "local v = redis.call('HGET', KEYS[1], ARGV[1]) "
+                    "if v and string.match(v, '^p:(.*):%d+$') == ARGV[2] then redis.call('HDEL', KEYS[1], ARGV[1]) end "
+                    "return 'released'";
+                eval(redis_conn, script);
+        }
+
+        // 心跳续租失败过(租约被别人接手了), 这时可能有两个人在传同一个文件, 内容一样, 只是浪费
+        bool lost() const
+        {
+                return lease_lost;
+        }
+
+private:
+        // 执行脚本, 返回脚本返回的字符串, 出错返回空串
+        std::string eval(redisContext *conn, const char *script)
+        {
+                std::string lease_ms = std::to_string(lease.count());
+                redisReply *reply = (redisReply *)redisCommand(conn, "EVAL %s 1 %s %b %s %s", script, key.c_str(), field.data(),
+                                                               field.size(), owner.c_str(), lease_ms.c_str());
+                std::string result;
+                if (reply != nullptr && (reply->type == REDIS_REPLY_STATUS || reply->type == REDIS_REPLY_STRING))
+                {
+                        result.assign(reply->str, reply->len);
+                }
+                else if (reply != nullptr && reply->type == REDIS_REPLY_ERROR)
+                {
+                        std::cerr << "Redis script error: " << reply->str << std::endl;
+                }
+                freeReplyObject(reply);
+                return result;
+        }
+
+        // 上传期间每过三分之一个租约续一次, 用自己的redis连接, 和上传用的连接互不干扰
+        void start_heartbeat()
+        {
+                stop_heartbeat();
+                stopping = false;
+                heartbeat = std::thread([this] {
+                        redisContext *conn = redisConnect("127.0.0.1", 6379);
+                        if (conn == nullptr || conn->err)
+                        {
+                                std::cerr << "Redis connection error in dedup heartbeat!" << std::endl;
+                                redisFree(conn);
+                                return;
+                        }
+                        static const char *script =
+                            "local v = redis.call('HGET', KEYS[1], ARGV[1]) "
+                            "if not v or string.match(v, '^p:(.*):%d+$') ~= ARGV[2] then return 'lost' end "
+                            "local t = redis.call('TIME') "
+                            "local now = tonumber(t[1]) * 1000 + math.floor(tonumber(t[2]) / 1000) "
+                            "redis.call('HSET', KEYS[1], ARGV[1], 'p:' .. ARGV[2] .. ':' .. (now + tonumber(ARGV[3]))) "
+                            "return 'renewed'";
+                        std::unique_lock<std::mutex> lock(mutex);
+                        while (!cond.wait_for(lock, lease / 3, [this] { return stopping; }))
+                        {
+                                if (eval(conn, script) == "lost" && !lease_lost)
+                                {
+                                        std::cerr << "Lost the dedup lease, another client may be uploading the same file." << std::endl;
+                                        lease_lost = true;
+                                }
+                        }
+                        redisFree(conn);
+                });
+        }
+
+        void stop_heartbeat()
+        {
+                if (!heartbeat.joinable())
+                {
+                        return;
+                }
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        stopping = true;
+                }
+                cond.notify_all();
+                heartbeat.join();
+        }
+
+        redisContext *redis_conn;
+        std::string digest;
+        std::string key;
+        std::string field;
+        std::string owner;
+        std::string completed_at;
+        std::chrono::milliseconds lease;
+        std::thread heartbeat;
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool stopping = false;
+        std::atomic<bool> lease_lost{false};
+};
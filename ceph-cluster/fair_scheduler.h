@@ -0,0 +1,347 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+// 网关前面的公平调度: 每个会话的RADOS请求(上传的一块写, 下载的一个分段读)先排队, 再按下面的规则放行
+//   1. 每个租户两个令牌桶, 每秒字节数和每秒请求数, 所有分片共用, 超了这个租户的请求就等着
+//   2. 优先级: 交互的先走, 批量的后走; 在途请求留一部分只给交互的用, 批量的把管道塞满了交互的也不用排在后面
+//   3. 同一个优先级里按会话做加权公平排队(自计时的WFQ): 每个请求的结束标签 = max(虚拟时间, 上一个的结束标签) + 字节数/权重,
+//      标签最小的先走, 一个会话发得再快也只能拿到自己那一份
+// 调度器按分片建, 只在分片的线程里用, 不加锁; 只有令牌桶跨分片, 用租户自己的锁
+enum priority_class
+{
+        PRIO_INTERACTIVE = 0,
+        PRIO_BULK = 1,
+};
+
+inline bool parse_priority_class(const std::string &name, priority_class &prio)
+{
+        if (name == "interactive")
+        {
+                prio = PRIO_INTERACTIVE;
+                return true;
+        }
+        if (name == "bulk")
+        {
+                prio = PRIO_BULK;
+                return true;
+        }
+        return false;
+}
+
+struct tenant_limits
+{
+        double bytes_per_second = 0; // 0表示不限
+        double ops_per_second = 0;
+        double weight = 1;           // 这个租户的会话在公平排队里的权重
+        priority_class prio = PRIO_INTERACTIVE; // 这个租户的请求的优先级, 只能在配置里定
+};
+
+// 令牌桶, 允许欠账: 只要还有令牌就放行, 扣成负数以后要等补回来, 这样一个请求比桶大也能走
+class token_bucket
+{
+public:
+        explicit token_bucket(double rate) : rate(rate), tokens(rate) {}
+
+        bool ready(std::chrono::steady_clock::time_point now)
+        {
+                refill(now);
+                return rate <= 0 || tokens > 0;
+        }
+
+        void take(double n)
+        {
+                tokens -= n;
+        }
+
+private:
+        // 最多攒一秒的令牌
+        void refill(std::chrono::steady_clock::time_point now)
+        {
+                std::chrono::duration<double> elapsed = now - last;
+                last = now;
+                tokens = std::min(rate, tokens + rate * elapsed.count());
+        }
+
+        const double rate;
+        double tokens;
+        std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+};
+
+struct tenant_state
+{
+        explicit tenant_state(const tenant_limits &limits)
+            : limits(limits), bytes(limits.bytes_per_second), ops(limits.ops_per_second) {}
+
+        // 两个桶都有令牌才放行; 几个分片同时看到有令牌都放行了也没关系, 多扣的下次补
+        bool ready(std::chrono::steady_clock::time_point now)
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                return bytes.ready(now) && ops.ready(now);
+        }
+
+        void take(uint64_t n)
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                bytes.take(n);
+                ops.take(1);
+        }
+
+        const tenant_limits limits;
+        std::mutex mutex;
+        token_bucket bytes;
+        token_bucket ops;
+};
+
+// 所有租户的令牌桶, 各分片共用
+// 租户是客户端IP, 来过的IP会越来越多: 这里只记弱引用, 令牌桶跟着引用它的流走,
+// 没有流在用的租户下次再来重新建一个满的桶
+class tenant_registry
+{
+public:
+        tenant_registry(const tenant_limits &defaults, std::map<std::string, tenant_limits> overrides)
+            : defaults(defaults), overrides(std::move(overrides)) {}
+
+        std::shared_ptr<tenant_state> get(const std::string &name)
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto &entry = tenants[name];
+                std::shared_ptr<tenant_state> tenant = entry.lock();
+                if (!tenant)
+                {
+                        auto it = overrides.find(name);
+                        tenant = std::make_shared<tenant_state>(it != overrides.end() ? it->second : defaults);
+                        entry = tenant;
+                }
+                // 表长到上次清理后的两倍就清掉没人用的, 均摊下来每次get是常数
+                if (tenants.size() >= prune_at)
+                {
+                        prune();
+                }
+                return tenant;
+        }
+
+private:
+        // 调用时必须持有锁
+        void prune()
+        {
+                for (auto it = tenants.begin(); it != tenants.end();)
+                {
+                        it = it->second.expired() ? tenants.erase(it) : std::next(it);
+                }
+                prune_at = std::max<size_t>(64, tenants.size() * 2);
+        }
+
+        const tenant_limits defaults;
+        const std::map<std::string, tenant_limits> overrides;
+        std::mutex mutex;
+        std::map<std::string, std::weak_ptr<tenant_state>> tenants;
+        size_t prune_at = 64;
+};
+
+// 读租户配置, 每行: <租户> <MB每秒> <请求每秒> [权重 [interactive|bulk]], 0是不限, 租户写成*是默认值, #开头是注释
+// 租户是客户端的IP地址
+inline tenant_registry *load_tenant_registry(const char *path)
+{
+        tenant_limits defaults;
+        std::map<std::string, tenant_limits> overrides;
+        if (path != nullptr)
+        {
+                std::ifstream in(path);
+                if (!in)
+                {
+                        std::cerr << "Couldn't open the tenant file '" << path << "'!" << std::endl;
+                        exit(EXIT_FAILURE);
+                }
+                std::string line;
+                while (std::getline(in, line))
+                {
+                        std::istringstream fields(line);
+                        std::string name;
+                        tenant_limits limits;
+                        if (!(fields >> name) || name[0] == '#')
+                        {
+                                continue;
+                        }
+                        if (!(fields >> limits.bytes_per_second >> limits.ops_per_second))
+                        {
+                                std::cerr << "Invalid line in the tenant file: " << line << std::endl;
+                                exit(EXIT_FAILURE);
+                        }
+                        std::string prio;
+                        if ((fields >> limits.weight) && (fields >> prio) && !parse_priority_class(prio, limits.prio))
+                        {
+                                std::cerr << "Invalid priority in the tenant file: " << line << std::endl;
+                                exit(EXIT_FAILURE);
+                        }
+                        limits.bytes_per_second *= 1 << 20;
+                        limits.weight = std::max(limits.weight, 0.01);
+                        (name == "*" ? defaults : overrides[name]) = limits;
+                }
+        }
+        return new tenant_registry(defaults, std::move(overrides));
+}
+
+class fair_scheduler
+{
+public:
+        // max_in_flight是这个分片同时放出去的请求数, 其中interactive_reserved个只给交互的用
+        fair_scheduler(tenant_registry &tenants, size_t max_in_flight, size_t interactive_reserved)
+            : tenants(tenants), max_in_flight(max_in_flight), interactive_reserved(std::min(interactive_reserved, max_in_flight - 1)) {}
+
+        // 一个会话一个流, 优先级和权重都按租户的配置
+        uint64_t open_flow(const std::string &tenant)
+        {
+                flow &f = flows[next_flow];
+                f.tenant = tenants.get(tenant);
+                f.prio = f.tenant->limits.prio;
+                f.weight = f.tenant->limits.weight;
+                return next_flow++;
+        }
+
+        // 排着的请求都丢掉, 已经放行的由调用方各自release
+        void close_flow(uint64_t id)
+        {
+                // 回调里可能拿着会话的引用, 先从表里摘掉再析构, 析构会话的时候可能又会调进来
+                auto it = flows.find(id);
+                if (it != flows.end())
+                {
+                        std::deque<request> dropped = std::move(it->second.queue);
+                        flows.erase(it);
+                }
+        }
+
+        // 排一个请求, 放行的时候调用dispatch; tag由调用方定义, 用来cancel
+        void submit(uint64_t flow_id, uint64_t tag, uint64_t bytes, std::function<void()> dispatch)
+        {
+                auto it = flows.find(flow_id);
+                if (it == flows.end())
+                {
+                        return;
+                }
+                // 结束标签在排队的时候就定下来, 后面虚拟时间往前走也不变
+                flow &f = it->second;
+                f.last_finish = std::max(virtual_time[f.prio], f.last_finish) + bytes / f.weight;
+                f.queue.push_back(request{tag, bytes, f.last_finish, std::move(dispatch)});
+                run();
+        }
+
+        // 去掉一个流里tag对应的还在排队的请求
+        void cancel(uint64_t flow_id, uint64_t tag)
+        {
+                auto it = flows.find(flow_id);
+                if (it == flows.end())
+                {
+                        return;
+                }
+                auto &queue = it->second.queue;
+                queue.erase(std::remove_if(queue.begin(), queue.end(), [tag](const request &r) { return r.tag == tag; }), queue.end());
+        }
+
+        // 放行的请求做完了
+        void release()
+        {
+                in_flight--;
+                run();
+        }
+
+        // 能放行的都放行; 令牌不够的要等补回来, 调用方定时调一下
+        void run()
+        {
+                if (running)
+                {
+                        return;
+                }
+                running = true;
+                auto now = std::chrono::steady_clock::now();
+                while (true)
+                {
+                        flow *best = nullptr;
+                        double best_finish = 0;
+                        for (auto &entry : flows)
+                        {
+                                flow &f = entry.second;
+                                if (f.queue.empty() || in_flight >= limit(f.prio) || (best != nullptr && f.prio > best->prio))
+                                {
+                                        continue;
+                                }
+                                double finish = f.queue.front().finish;
+                                if (best != nullptr && f.prio == best->prio && finish >= best_finish)
+                                {
+                                        continue;
+                                }
+                                // 租户没令牌了就跳过, 让别的租户先走
+                                if (!f.tenant->ready(now))
+                                {
+                                        continue;
+                                }
+                                best = &f;
+                                best_finish = finish;
+                        }
+                        if (best == nullptr)
+                        {
+                                break;
+                        }
+                        request r = std::move(best->queue.front());
+                        best->queue.pop_front();
+                        best->tenant->take(r.bytes);
+                        virtual_time[best->prio] = best_finish;
+                        in_flight++;
+                        r.dispatch();
+                }
+                running = false;
+        }
+
+        size_t queued() const
+        {
+                size_t n = 0;
+                for (auto &entry : flows)
+                {
+                        n += entry.second.queue.size();
+                }
+                return n;
+        }
+
+private:
+        struct request
+        {
+                uint64_t tag;
+                uint64_t bytes;
+                double finish; // 结束标签
+                std::function<void()> dispatch;
+        };
+
+        struct flow
+        {
+                std::shared_ptr<tenant_state> tenant;
+                priority_class prio = PRIO_INTERACTIVE;
+                double weight = 1;
+                double last_finish = 0; // 最后一个排队的请求的结束标签
+                std::deque<request> queue;
+        };
+
+        size_t limit(priority_class prio) const
+        {
+                return prio == PRIO_INTERACTIVE ? max_in_flight : max_in_flight - interactive_reserved;
+        }
+
+        tenant_registry &tenants;
+        const size_t max_in_flight;
+        const size_t interactive_reserved;
+        std::map<uint64_t, flow> flows;
+        uint64_t next_flow = 0;
+        size_t in_flight = 0;
+        double virtual_time[2] = {0, 0};
+        bool running = false;
+};
@@ -0,0 +1,321 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <openssl/md5.h>
+#include <openssl/sha.h>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// 树形哈希的叶子大小, 每4MB算一个SHA-256, 根哈希是所有叶子哈希拼起来再算一次SHA-256
+const uint64_t tree_hash_leaf_size = 4 * 1024 * 1024;
+
+// 对象上保存哈希的xattr名字
+const char *const hash_xattr_tree = "hash.tree";
+const char *const hash_xattr_sha256 = "hash.sha256";
+const char *const hash_xattr_md5 = "hash.md5";
+
+inline std::string hash_to_hex(const unsigned char *hash, size_t len)
+{
+        std::stringstream ss;
+        for (size_t i = 0; i < len; i++)
+        {
+                ss << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(hash[i]);
+        }
+        return ss.str();
+}
+
+// 计算整个文件的SHA-256
+inline std::string calculate_file_hash(const std::string &file_path)
+{
+        std::ifstream file(file_path, std::ios::binary);
+        if (!file.is_open())
+        {
+                std::cerr << "Couldn't open the file!" << std::endl;
+                exit(EXIT_FAILURE);
+        }
+
+        const size_t buffer_size = 1024 * 1024;
+        std::vector<char> buffer(buffer_size);
+        SHA256_CTX sha256;
+        SHA256_Init(&sha256);
+
+        while (!file.eof())
+        {
+                file.read(buffer.data(), buffer_size);
+                size_t read_bytes = static_cast<size_t>(file.gcount());
+                if (read_bytes > 0)
+                {
+                        SHA256_Update(&sha256, buffer.data(), read_bytes);
+                }
+        }
+
+        unsigned char hash[SHA256_DIGEST_LENGTH];
+        SHA256_Final(hash, &sha256);
+        return hash_to_hex(hash, SHA256_DIGEST_LENGTH);
+}
+
+// 按偏移量喂数据的哈希计算器, 数据块可以乱序到达(并发下载的时候就是这样)
+// TREE: 每个叶子独立计算, 乱序的数据只在叶子内部暂存
+// SHA256/MD5: 只能顺序计算, 乱序的数据先暂存, 等前面的数据到了再喂进去
+class range_hasher
+{
+public:
+        enum alg_t
+        {
+                TREE,
+                SHA256,
+                MD5
+        };
+
+        range_hasher(alg_t alg, uint64_t total_size)
+            : alg(alg), total_size(total_size),
+              leaf_hashes((total_size + tree_hash_leaf_size - 1) / tree_hash_leaf_size)
+        {
+                SHA256_Init(&sha256);
+                MD5_Init(&md5);
+        }
+
+        // 喂入[offset, offset+len)这一段数据
+        void update(uint64_t offset, const char *data, size_t len)
+        {
+                if (alg == TREE)
+                {
+                        // 一段数据可能跨越多个叶子
+                        while (len > 0)
+                        {
+                                uint64_t index = offset / tree_hash_leaf_size;
+                                uint64_t leaf_end = std::min((index + 1) * tree_hash_leaf_size, total_size);
+                                size_t n = std::min<uint64_t>(len, leaf_end - offset);
+                                feed_leaf(index, offset, data, n);
+                                offset += n;
+                                data += n;
+                                len -= n;
+                        }
+                }
+                else
+                {
+                        feed_linear(offset, data, len);
+                }
+        }
+
+        // 所有数据都喂完以后得到十六进制的哈希, 数据不完整返回false
+        bool finish(std::string &hex)
+        {
+                if (alg == TREE)
+                {
+                        if (!leaves.empty())
+                        {
+                                return false;
+                        }
+                        for (const std::string &leaf : leaf_hashes)
+                        {
+                                if (leaf.size() != SHA256_DIGEST_LENGTH)
+                                {
+                                        return false;
+                                }
+                        }
+                        hex = tree_root(leaf_hashes);
+                        return true;
+                }
+                if (linear_fed != total_size || !pending.empty())
+                {
+                        return false;
+                }
+                if (alg == SHA256)
+                {
+                        unsigned char hash[SHA256_DIGEST_LENGTH];
+                        SHA256_Final(hash, &sha256);
+                        hex = hash_to_hex(hash, SHA256_DIGEST_LENGTH);
+                }
+                else
+                {
+                        unsigned char hash[MD5_DIGEST_LENGTH];
+                        MD5_Final(hash, &md5);
+                        hex = hash_to_hex(hash, MD5_DIGEST_LENGTH);
+                }
+                return true;
+        }
+
+        // 由叶子哈希(二进制)算出根哈希
+        static std::string tree_root(const std::vector<std::string> &leaf_hashes)
+        {
+                SHA256_CTX ctx;
+                SHA256_Init(&ctx);
+                for (const std::string &leaf : leaf_hashes)
+                {
+                        SHA256_Update(&ctx, leaf.data(), leaf.size());
+                }
+                unsigned char hash[SHA256_DIGEST_LENGTH];
+                SHA256_Final(hash, &ctx);
+                return hash_to_hex(hash, SHA256_DIGEST_LENGTH);
+        }
+
+private:
+        struct leaf_state
+        {
+                SHA256_CTX ctx;
+                uint64_t fed = 0; // 叶子内已经按顺序喂进去的字节数
+                std::map<uint64_t, std::string> pending;
+        };
+
+        void feed_leaf(uint64_t index, uint64_t offset, const char *data, size_t len)
+        {
+                auto it = leaves.find(index);
+                if (it == leaves.end())
+                {
+                        it = leaves.emplace(index, leaf_state()).first;
+                        SHA256_Init(&it->second.ctx);
+                }
+                leaf_state &leaf = it->second;
+                uint64_t leaf_start = index * tree_hash_leaf_size;
+                uint64_t leaf_len = std::min(tree_hash_leaf_size, total_size - leaf_start);
+                uint64_t pos = offset - leaf_start;
+                if (pos != leaf.fed)
+                {
+                        leaf.pending.emplace(pos, std::string(data, len));
+                        return;
+                }
+                SHA256_Update(&leaf.ctx, data, len);
+                leaf.fed += len;
+                // 把暂存的后续数据接上
+                auto p = leaf.pending.begin();
+                while (p != leaf.pending.end() && p->first == leaf.fed)
+                {
+                        SHA256_Update(&leaf.ctx, p->second.data(), p->second.size());
+                        leaf.fed += p->second.size();
+                        p = leaf.pending.erase(p);
+                }
+                if (leaf.fed == leaf_len)
+                {
+                        unsigned char hash[SHA256_DIGEST_LENGTH];
+                        SHA256_Final(hash, &leaf.ctx);
+                        leaf_hashes[index].assign(reinterpret_cast<char *>(hash), SHA256_DIGEST_LENGTH);
+                        leaves.erase(it);
+                }
+        }
+
+        void feed_linear_in_order(const char *data, size_t len)
+        {
+                if (alg == SHA256)
+                {
+                        SHA256_Update(&sha256, data, len);
+                }
+                else
+                {
+                        MD5_Update(&md5, data, len);
+                }
+                linear_fed += len;
+        }
+
+        void feed_linear(uint64_t offset, const char *data, size_t len)
+        {
+                if (offset != linear_fed)
+                {
+                        pending.emplace(offset, std::string(data, len));
+                        return;
+                }
+                feed_linear_in_order(data, len);
+                auto p = pending.begin();
+                while (p != pending.end() && p->first == linear_fed)
+                {
+                        feed_linear_in_order(p->second.data(), p->second.size());
+                        p = pending.erase(p);
+                }
+        }
+
+        alg_t alg;
+        uint64_t total_size;
+        // TREE
+        std::vector<std::string> leaf_hashes;
+        std::map<uint64_t, leaf_state> leaves;
+        // SHA256/MD5
+        SHA256_CTX sha256;
+        MD5_CTX md5;
+        uint64_t linear_fed = 0;
+        std::map<uint64_t, std::string> pending;
+};
+
+// 计算文件的树形哈希, 用作去重的指纹
+// 叶子之间互不依赖, 多个线程各自领取叶子编号, pread读出来单独算SHA-256, 最后按顺序合成根哈希
+// OpenSSL的SHA256会根据CPU自动选用SHA-NI/AVX2的实现, 所以每个核都能跑满
+// 结果和range_hasher的TREE模式一致, 跟线程数无关; 文件打不开或者读不了返回空串
+inline std::string calculate_file_tree_hash(const std::string &file_path, unsigned threads = 0)
+{
+        int fd = open(file_path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+                std::cerr << "Couldn't open the file!" << std::endl;
+                return std::string();
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0)
+        {
+                std::cerr << "Couldn't stat the file!" << std::endl;
+                close(fd);
+                return std::string();
+        }
+        uint64_t file_size = static_cast<uint64_t>(st.st_size);
+        uint64_t leaf_count = (file_size + tree_hash_leaf_size - 1) / tree_hash_leaf_size;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        if (threads == 0)
+        {
+                threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        threads = static_cast<unsigned>(std::min<uint64_t>(threads, std::max<uint64_t>(leaf_count, 1)));
+
+        std::vector<std::string> leaf_hashes(leaf_count);
+        std::atomic<uint64_t> next_leaf(0);
+        std::atomic<bool> failed(false);
+        auto worker = [&]() {
+                std::vector<char> buffer(tree_hash_leaf_size);
+                uint64_t index;
+                while (!failed && (index = next_leaf++) < leaf_count)
+                {
+                        uint64_t offset = index * tree_hash_leaf_size;
+                        size_t leaf_len = std::min(tree_hash_leaf_size, file_size - offset);
+                        size_t done = 0;
+                        while (done < leaf_len)
+                        {
+                                ssize_t n = pread(fd, buffer.data() + done, leaf_len - done, offset + done);
+                                if (n <= 0)
+                                {
+                                        failed = true;
+                                        return;
+                                }
+                                done += n;
+                        }
+                        unsigned char hash[SHA256_DIGEST_LENGTH];
+                        SHA256(reinterpret_cast<unsigned char *>(buffer.data()), leaf_len, hash);
+                        leaf_hashes[index].assign(reinterpret_cast<char *>(hash), SHA256_DIGEST_LENGTH);
+                }
+        };
+
+        std::vector<std::thread> pool;
+        for (unsigned i = 1; i < threads; i++)
+        {
+                pool.emplace_back(worker);
+        }
+        worker();
+        for (std::thread &t : pool)
+        {
+                t.join();
+        }
+        close(fd);
+
+        if (failed)
+        {
+                std::cerr << "Couldn't read the file!" << std::endl;
+                return std::string();
+        }
+        return range_hasher::tree_root(leaf_hashes);
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <deque>
+#include <rados/librados.hpp>
+#include <vector>
+
+// 对冲读的参数
+// 一个读请求比最近的第percentile百分位延迟还慢, 就再发一个一样的读, 谁先回来用谁, 另一个取消
+// 单个OSD在深度scrub或者恢复的时候很慢, 不对冲的话整个下载都要等它
+struct hedge_options
+{
+        bool enabled = true;
+        double percentile = 0.95;  // 超过这个百分位的延迟就对冲
+        size_t min_samples = 16;   // 样本不够的时候用initial_deadline
+        size_t max_samples = 256;  // 只看最近这么多次读
+        std::chrono::milliseconds initial_deadline{500};
+        std::chrono::milliseconds min_deadline{20}; // 延迟都很小的时候也不要对冲得太勤
+        size_t max_hedges_in_flight = 2;            // 同时在途的对冲读, 避免慢的时候把负载翻倍
+        // 对冲读发到副本上而不是主OSD, 主OSD慢的时候才有用
+        int flags = LIBRADOS_OPERATION_BALANCE_READS | LIBRADOS_OPERATION_LOCALIZE_READS;
+};
+
+// 最近一段时间读请求的延迟, 算出该对冲的期限
+class latency_tracker
+{
+public:
+        explicit latency_tracker(const hedge_options &opts) : opts(opts) {}
+
+        void record(std::chrono::steady_clock::duration latency)
+        {
+                samples.push_back(latency);
+                if (samples.size() > opts.max_samples)
+                {
+                        samples.pop_front();
+                }
+        }
+
+        // 读请求发出以后超过这么久还没回来就对冲
+        std::chrono::steady_clock::duration deadline() const
+        {
+                if (samples.size() < opts.min_samples)
+                {
+                        return opts.initial_deadline;
+                }
+                std::vector<std::chrono::steady_clock::duration> sorted(samples.begin(), samples.end());
+                size_t index = std::min(sorted.size() - 1, static_cast<size_t>(opts.percentile * sorted.size()));
+                std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+                return std::max<std::chrono::steady_clock::duration>(sorted[index], opts.min_deadline);
+        }
+
+private:
+        hedge_options opts;
+        std::deque<std::chrono::steady_clock::duration> samples;
+};
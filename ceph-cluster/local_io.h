@@ -0,0 +1,375 @@
+#pragma once
+// 本地文件的异步读写, 上传读文件和下载写文件都走这里
+// 优先用io_uring: 多个请求攒起来一次系统调用提交, 可以注册固定缓冲区省掉每次的页表映射;
+// 内核不支持(或者被禁用)就退回pread/pwrite, 调用方不用关心是哪一种
+// 直接用系统调用, 不依赖liburing
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <linux/io_uring.h>
+#include <map>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+class local_io
+{
+public:
+        explicit local_io(unsigned depth = 32) : depth(depth)
+        {
+                if (getenv("CEPH2_NO_URING") == nullptr)
+                {
+                        setup_uring();
+                }
+        }
+
+        ~local_io()
+        {
+                if (ring_fd >= 0)
+                {
+                        munmap(sq_ptr, sq_map_size);
+                        if (cq_ptr != sq_ptr)
+                        {
+                                munmap(cq_ptr, cq_map_size);
+                        }
+                        munmap(sqes, sqes_map_size);
+                        close(ring_fd);
+                }
+        }
+
+        // 文件是用O_DIRECT打开的: 读到末尾会返回比请求少的字节数, 剩下的不能再补读(偏移量不对齐了)
+        void set_direct(bool direct)
+        {
+                this->direct = direct;
+        }
+
+        bool uring() const
+        {
+                return ring_fd >= 0;
+        }
+
+        size_t in_flight() const
+        {
+                return ops.size();
+        }
+
+        // 在途请求到了队列深度, 要先wait再prep
+        bool full() const
+        {
+                return ops.size() >= depth;
+        }
+
+        // 注册固定缓冲区, 之后prep的时候传buf_index就走READ_FIXED/WRITE_FIXED
+        // 不支持的时候返回false, 继续按普通缓冲区用
+        bool register_buffers(const std::vector<iovec> &iovs)
+        {
+                if (ring_fd < 0)
+                {
+                        return false;
+                }
+                int ret = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iovs.data(), iovs.size());
+                if (ret < 0)
+                {
+                        return false;
+                }
+                buffers_registered = true;
+                return true;
+        }
+
+        // 排队一个读请求, submit()之后才真正发出去; tag由调用方定, 完成时原样返回
+        void prep_read(int fd, void *buf, size_t len, uint64_t off, uint64_t tag, int buf_index = -1)
+        {
+                queue(op{fd, static_cast<char *>(buf), len, off, 0, false, buf_index}, tag);
+        }
+
+        void prep_write(int fd, const void *buf, size_t len, uint64_t off, uint64_t tag, int buf_index = -1)
+        {
+                queue(op{fd, static_cast<char *>(const_cast<void *>(buf)), len, off, 0, true, buf_index}, tag);
+        }
+
+        // 把排好队的请求一次性提交
+        void submit()
+        {
+                if (ring_fd < 0 || to_submit == 0)
+                {
+                        return;
+                }
+                __atomic_store_n(sq_tail, local_sq_tail, __ATOMIC_RELEASE);
+                while (to_submit > 0)
+                {
+                        int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, nullptr, 0);
+                        if (ret < 0)
+                        {
+                                if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                                {
+                                        continue;
+                                }
+                                // 内核一个都没收: 把还没提交的请求从环里撤回来, 改成同步读写, 在wait的时候执行
+                                std::cerr << "io_uring submit failed, falling back to synchronous I/O! error " << errno << std::endl;
+                                for (unsigned i = to_submit; i > 0; i--)
+                                {
+                                        sync_queue.push_back(sqes[sq_array[(local_sq_tail - i) & sq_mask]].user_data);
+                                }
+                                local_sq_tail -= to_submit;
+                                __atomic_store_n(sq_tail, local_sq_tail, __ATOMIC_RELEASE);
+                                to_submit = 0;
+                                return;
+                        }
+                        to_submit -= ret;
+                }
+        }
+
+        // 等一个请求完成; res是完成的总字节数或者-errno
+        // 短读短写在内部补齐, 只有读到文件末尾才会返回比请求少的字节数
+        // 没有在途请求返回false
+        bool wait(uint64_t &tag, int64_t &res)
+        {
+                while (!ops.empty())
+                {
+                        if (reap(tag, res, true))
+                        {
+                                return true;
+                        }
+                }
+                return false;
+        }
+
+        // 不阻塞, 没有完成的请求返回false
+        bool poll(uint64_t &tag, int64_t &res)
+        {
+                return reap(tag, res, false);
+        }
+
+private:
+        struct op
+        {
+                int fd;
+                char *buf;
+                size_t len;
+                uint64_t off;
+                size_t done;
+                bool is_write;
+                int buf_index;
+        };
+
+        void setup_uring()
+        {
+                struct io_uring_params p;
+                memset(&p, 0, sizeof(p));
+                int fd = syscall(__NR_io_uring_setup, depth, &p);
+                if (fd < 0)
+                {
+                        return;
+                }
+                sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+                cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+                bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+                if (single_mmap)
+                {
+                        sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+                }
+                sq_ptr = mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+                if (sq_ptr == MAP_FAILED)
+                {
+                        close(fd);
+                        return;
+                }
+                cq_ptr = single_mmap ? sq_ptr
+                                     : mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                            IORING_OFF_CQ_RING);
+                sqes_map_size = p.sq_entries * sizeof(struct io_uring_sqe);
+                sqes = static_cast<struct io_uring_sqe *>(
+                    mmap(nullptr, sqes_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+                if (cq_ptr == MAP_FAILED || sqes == MAP_FAILED)
+                {
+                        munmap(sq_ptr, sq_map_size);
+                        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+                        {
+                                munmap(cq_ptr, cq_map_size);
+                        }
+                        close(fd);
+                        return;
+                }
+                char *sq = static_cast<char *>(sq_ptr);
+                char *cq = static_cast<char *>(cq_ptr);
+                sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+                sq_mask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+                sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+                sq_entries = p.sq_entries;
+                cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+                cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+                cq_mask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+                cqes = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+                local_sq_tail = *sq_tail;
+                ring_fd = fd;
+
+                // 老内核没有IORING_OP_READ/WRITE, 这种情况也退回pread/pwrite
+                std::vector<char> probe_buf(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+                struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe *>(probe_buf.data());
+                int ret = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256);
+                if (ret < 0 || probe->last_op < IORING_OP_WRITE ||
+                    !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) ||
+                    !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED))
+                {
+                        munmap(sq_ptr, sq_map_size);
+                        if (cq_ptr != sq_ptr)
+                        {
+                                munmap(cq_ptr, cq_map_size);
+                        }
+                        munmap(sqes, sqes_map_size);
+                        close(ring_fd);
+                        ring_fd = -1;
+                }
+        }
+
+        void queue(const op &o, uint64_t tag)
+        {
+                ops[tag] = o;
+                if (ring_fd < 0)
+                {
+                        sync_queue.push_back(tag);
+                        return;
+                }
+                push_sqe(tag);
+        }
+
+        void push_sqe(uint64_t tag)
+        {
+                if (to_submit == sq_entries)
+                {
+                        submit();
+                }
+                const op &o = ops[tag];
+                unsigned index = local_sq_tail & sq_mask;
+                struct io_uring_sqe *sqe = &sqes[index];
+                memset(sqe, 0, sizeof(*sqe));
+                bool fixed = buffers_registered && o.buf_index >= 0;
+                if (o.is_write)
+                {
+                        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+                }
+                else
+                {
+                        sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+                }
+                sqe->fd = o.fd;
+                sqe->addr = reinterpret_cast<uint64_t>(o.buf + o.done);
+                sqe->len = o.len - o.done;
+                sqe->off = o.off + o.done;
+                sqe->buf_index = fixed ? o.buf_index : 0;
+                sqe->user_data = tag;
+                sq_array[index] = index;
+                local_sq_tail++;
+                to_submit++;
+        }
+
+        // 处理一个请求的一次完成, 返回true表示这个请求全部结束
+        bool account(uint64_t tag, int64_t res, int64_t &out)
+        {
+                op &o = ops[tag];
+                if (res < 0)
+                {
+                        out = res;
+                        ops.erase(tag);
+                        return true;
+                }
+                o.done += res;
+                if (o.done == o.len || (!o.is_write && (res == 0 || direct)))
+                {
+                        out = o.done;
+                        ops.erase(tag);
+                        return true;
+                }
+                if (res == 0)
+                {
+                        out = -EIO;
+                        ops.erase(tag);
+                        return true;
+                }
+                // 短读短写, 剩下的部分重新提交
+                if (ring_fd >= 0)
+                {
+                        push_sqe(tag);
+                        submit();
+                }
+                else
+                {
+                        sync_queue.push_front(tag);
+                }
+                return false;
+        }
+
+        bool reap(uint64_t &tag, int64_t &res, bool block)
+        {
+                if (ring_fd < 0 || !sync_queue.empty())
+                {
+                        // 退回同步读写: 在wait的时候才真正执行
+                        if (sync_queue.empty())
+                        {
+                                return false;
+                        }
+                        tag = sync_queue.front();
+                        sync_queue.pop_front();
+                        op &o = ops[tag];
+                        ssize_t n = o.is_write ? pwrite(o.fd, o.buf + o.done, o.len - o.done, o.off + o.done)
+                                               : pread(o.fd, o.buf + o.done, o.len - o.done, o.off + o.done);
+                        return account(tag, n < 0 ? -errno : n, res);
+                }
+
+                unsigned head = *cq_head;
+                if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+                {
+                        if (!block || ops.empty())
+                        {
+                                return false;
+                        }
+                        submit();
+                        int ret = syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                        {
+                                // 环坏了, 收不到完成了: 在途的请求逐个按失败返回, 调用方放弃这次传输, 不影响别的传输
+                                int err = errno;
+                                std::cerr << "io_uring wait failed! error " << err << std::endl;
+                                tag = ops.begin()->first;
+                                res = -err;
+                                ops.erase(ops.begin());
+                                return true;
+                        }
+                        return false;
+                }
+                struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+                tag = cqe->user_data;
+                int64_t n = cqe->res;
+                __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+                return account(tag, n, res);
+        }
+
+        unsigned depth;
+        int ring_fd = -1;
+        void *sq_ptr = nullptr;
+        void *cq_ptr = nullptr;
+        size_t sq_map_size = 0;
+        size_t cq_map_size = 0;
+        size_t sqes_map_size = 0;
+        struct io_uring_sqe *sqes = nullptr;
+        unsigned *sq_tail = nullptr;
+        unsigned *sq_array = nullptr;
+        unsigned sq_mask = 0;
+        unsigned sq_entries = 0;
+        unsigned local_sq_tail = 0;
+        unsigned to_submit = 0;
+        unsigned *cq_head = nullptr;
+        unsigned *cq_tail = nullptr;
+        unsigned cq_mask = 0;
+        struct io_uring_cqe *cqes = nullptr;
+        bool buffers_registered = false;
+        bool direct = false;
+        std::map<uint64_t, op> ops;
+        std::deque<uint64_t> sync_queue;
+};
@@ -0,0 +1,415 @@
+#pragma once
+#include "file_hash.h"
+#include "rados_coro.h"
+#include "retry.h"
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <limits.h>
+#include <memory>
+#include <mutex>
+#include <rados/librados.hpp>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// 整池导出的参数
+struct export_options
+{
+        unsigned shards = 8;                   // 把池按哈希范围切成几份, 每份一个线程列对象
+        size_t objects_in_flight = 64;         // 同时在导出的对象数
+        size_t list_batch = 1024;              // 每次列多少个对象
+        uint64_t chunk_size = 4 * 1024 * 1024; // 大对象分块读
+};
+
+// 把整个池的对象导出到本地目录, 一个对象一个文件, 文件名是转义过的对象名(见local_name)
+// 按对象名的哈希分到两层子目录 <目录>/<xx>/<yy>/ 里, 几千万个对象每个目录也只有几百个文件
+// 转义以后太长的名字(超过NAME_MAX)换成 %%<sha256>, 旁边放一个 %%<sha256>.name 存完整的对象名
+// 列对象按object_list_slice切成几段并行列, 每个对象一个协程: stat以后分块读(可以重试的错误退避重试), 写进 .<名字>.part, 写完改名
+// 断点续传:
+//   - 每段列到哪里记在 <目录>/.export/shard-<i>-of-<n>, 只有这一批对象都导出成功才往前推
+//   - 本地已经有大小和修改时间都一样的文件就跳过, 不再读
+// 想从头导出就删掉 .export 目录
+class pool_exporter
+{
+public:
+        pool_exporter(librados::IoCtx &io_ctx, coro_executor &executor, const std::string &dest_dir,
+                      const export_options &opts = export_options())
+            : io_ctx(io_ctx), executor(executor), dest_dir(dest_dir), opts(opts)
+        {
+        }
+
+        // 导出整个池, 返回失败的对象数
+        uint64_t run()
+        {
+                if (make_dirs(dest_dir + "/.export") < 0)
+                {
+                        std::cerr << "Couldn't create the export directory '" << dest_dir << "'!" << std::endl;
+                        exit(EXIT_FAILURE);
+                }
+                std::vector<std::thread> workers;
+                for (unsigned shard = 0; shard < opts.shards; shard++)
+                {
+                        workers.emplace_back([this, shard] { list_shard(shard); });
+                }
+                for (std::thread &t : workers)
+                {
+                        t.join();
+                }
+                // 等最后几个对象导出完
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this] { return in_flight == 0; });
+                std::cout << "Exported " << exported << " objects (" << bytes << " bytes), skipped " << skipped
+                          << " unchanged, " << failed << " failed." << std::endl;
+                return failed;
+        }
+
+private:
+        // 一批列出来的对象, 都导出成功了才能把这一段的进度推到next
+        struct batch_state
+        {
+                librados::ObjectCursor next;
+                std::atomic<size_t> remaining{0};
+                std::atomic<bool> failed{false};
+        };
+
+        void list_shard(unsigned shard)
+        {
+                librados::ObjectCursor begin, end;
+                io_ctx.object_list_slice(io_ctx.object_list_begin(), io_ctx.object_list_end(), shard, opts.shards, &begin,
+                                         &end);
+                librados::ObjectCursor cursor = begin;
+                std::string saved = load_checkpoint(shard);
+                if (!saved.empty() && !cursor.from_str(saved))
+                {
+                        std::cerr << "Ignoring unreadable checkpoint for shard " << shard << "." << std::endl;
+                        cursor = begin;
+                }
+
+                retry_policy retry;
+                librados::bufferlist filter;
+                std::deque<std::shared_ptr<batch_state>> batches;
+                bool clean = true; // 有对象失败以后这一段的进度就不再往前推, 下次从这里重新列
+                while (cursor < end)
+                {
+                        std::vector<librados::ObjectItem> items;
+                        librados::ObjectCursor next;
+                        int ret = retry_sync(retry, "Listing objects", [&] {
+                                items.clear();
+                                return io_ctx.object_list(cursor, end, opts.list_batch, filter, &items, &next);
+                        });
+                        if (ret < 0)
+                        {
+                                std::cerr << "Couldn't list objects in shard " << shard << "! error " << ret << std::endl;
+                                std::lock_guard<std::mutex> lock(mutex);
+                                failed++;
+                                return;
+                        }
+
+                        auto batch = std::make_shared<batch_state>();
+                        batch->next = next;
+                        // 多算一个, 防止对象还没全发出去这一批就被当成完成了
+                        batch->remaining = items.size() + 1;
+                        for (const librados::ObjectItem &item : items)
+                        {
+                                acquire_slot();
+                                spawn(executor, export_object(item.oid, batch));
+                        }
+                        batch->remaining--;
+                        batches.push_back(batch);
+
+                        // 前面完成的批次按顺序记进度
+                        while (!batches.empty() && batches.front()->remaining == 0)
+                        {
+                                clean = clean && !batches.front()->failed;
+                                if (clean)
+                                {
+                                        save_checkpoint(shard, batches.front()->next);
+                                }
+                                batches.pop_front();
+                        }
+                        if (items.empty() && next == cursor)
+                        {
+                                break;
+                        }
+                        cursor = next;
+                }
+
+                // 这一段列完了, 等它的对象都导出完再记最后的进度
+                for (const auto &batch : batches)
+                {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        cond.wait(lock, [&] { return batch->remaining == 0; });
+                        lock.unlock();
+                        clean = clean && !batch->failed;
+                        if (clean)
+                        {
+                                save_checkpoint(shard, batch->next);
+                        }
+                }
+                std::cout << "Finished listing shard " << shard << " of " << opts.shards << "." << std::endl;
+        }
+
+        task<void> export_object(std::string oid, std::shared_ptr<batch_state> batch)
+        {
+                int ret = co_await copy_object(oid);
+                if (ret < 0)
+                {
+                        std::cerr << "Couldn't export object '" << oid << "'! error " << ret << std::endl;
+                        batch->failed = true;
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                if (ret < 0)
+                {
+                        failed++;
+                }
+                batch->remaining--;
+                in_flight--;
+                cond.notify_all();
+        }
+
+        // stat以后分块读, 写进临时文件, 写完把修改时间设成对象的, 再改成正式的名字
+        task<int> copy_object(const std::string &oid)
+        {
+                retry_policy retry;
+                uint64_t size;
+                time_t mtime;
+                int ret = 0;
+                for (unsigned attempt = 1;; attempt++)
+                {
+                        ret = co_await async_stat(executor, io_ctx, oid, &size, &mtime);
+                        if (ret >= 0 || !backoff(retry, ret, attempt, "Stat"))
+                        {
+                                break;
+                        }
+                }
+                if (ret < 0)
+                {
+                        co_return ret;
+                }
+                std::string dir = dest_dir + "/" + fanout_dir(oid), name = local_name(oid);
+                if (make_dirs(dir) < 0)
+                {
+                        co_return -errno;
+                }
+                if (name.size() > NAME_MAX - 6 && (ret = save_full_name(dir, name, oid)) < 0)
+                {
+                        co_return ret;
+                }
+                std::string path = dir + "/" + name;
+                struct stat st;
+                if (stat(path.c_str(), &st) == 0 && static_cast<uint64_t>(st.st_size) == size && st.st_mtime == mtime)
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        skipped++;
+                        co_return 0;
+                }
+                // 转义过的名字不会以'.'开头, 临时文件和正式的文件, .export目录都不会重名
+                std::string part_path = dir + "/." + name + ".part";
+                int fd = open(part_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0)
+                {
+                        co_return -errno;
+                }
+                for (uint64_t offset = 0; offset < size; offset += opts.chunk_size)
+                {
+                        uint64_t len = std::min(opts.chunk_size, size - offset);
+                        librados::bufferlist bl;
+                        for (unsigned attempt = 1;; attempt++)
+                        {
+                                bl.clear();
+                                ret = co_await async_read(executor, io_ctx, oid, &bl, len, offset);
+                                if (ret >= 0 || !backoff(retry, ret, attempt, "Read"))
+                                {
+                                        break;
+                                }
+                        }
+                        if (ret >= 0 && bl.length() != len)
+                        {
+                                // 对象在导出的时候被改了
+                                ret = -EIO;
+                        }
+                        uint64_t pos = offset;
+                        for (const auto &p : bl.buffers())
+                        {
+                                if (ret < 0)
+                                {
+                                        break;
+                                }
+                                if (pwrite(fd, p.c_str(), p.length(), pos) != static_cast<ssize_t>(p.length()))
+                                {
+                                        ret = -errno;
+                                }
+                                pos += p.length();
+                        }
+                        if (ret < 0)
+                        {
+                                close(fd);
+                                unlink(part_path.c_str());
+                                co_return ret;
+                        }
+                }
+                struct timespec times[2] = {{mtime, 0}, {mtime, 0}};
+                if (futimens(fd, times) < 0 || close(fd) < 0 || rename(part_path.c_str(), path.c_str()) < 0)
+                {
+                        ret = -errno;
+                        unlink(part_path.c_str());
+                        co_return ret;
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                exported++;
+                bytes += size;
+                co_return 0;
+        }
+
+        // 同时在导出的对象数够了就等一个完成
+        void acquire_slot()
+        {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this] { return in_flight < opts.objects_in_flight; });
+                in_flight++;
+        }
+
+        // 对象的一次请求失败了, 能重试的话等一会儿返回true
+        // 退避的时候占着执行器的一个线程, 和写本地文件一样; 导出用的是自己的执行器, 不影响别的
+        static bool backoff(retry_policy &retry, int ret, unsigned attempt, const char *what)
+        {
+                if (!retry.should_retry(ret, attempt))
+                {
+                        return false;
+                }
+                std::chrono::milliseconds delay = retry.backoff(attempt);
+                std::cerr << what << " failed with error " << ret << ", retrying in " << delay.count() << " ms." << std::endl;
+                std::this_thread::sleep_for(delay);
+                return true;
+        }
+
+        // 对象名的SHA-256, 十六进制
+        static std::string name_hash(const std::string &oid)
+        {
+                unsigned char hash[SHA256_DIGEST_LENGTH];
+                SHA256(reinterpret_cast<const unsigned char *>(oid.data()), oid.size(), hash);
+                return hash_to_hex(hash, sizeof(hash));
+        }
+
+        // 两层子目录, 各256个, 按对象名的哈希分
+        static std::string fanout_dir(const std::string &oid)
+        {
+                std::string hash = name_hash(oid);
+                return hash.substr(0, 2) + "/" + hash.substr(2, 2);
+        }
+
+        // 名字太长的对象: 文件名换成哈希, 完整的对象名写进旁边的 <文件名>.name, 同样先写临时文件再改名
+        static int save_full_name(const std::string &dir, std::string &name, const std::string &oid)
+        {
+                name = "%%" + name_hash(oid);
+                std::string path = dir + "/" + name + ".name";
+                std::string tmp = dir + "/." + name + ".name.part";
+                {
+                        std::ofstream out(tmp, std::ios::trunc | std::ios::binary);
+                        out.write(oid.data(), oid.size());
+                        if (!out)
+                        {
+                                unlink(tmp.c_str());
+                                return -EIO;
+                        }
+                }
+                if (rename(tmp.c_str(), path.c_str()) < 0)
+                {
+                        int ret = -errno;
+                        unlink(tmp.c_str());
+                        return ret;
+                }
+                return 0;
+        }
+
+        // 对象名转成本地文件名: '%', '/'和开头的'.'写成%XX, 不同的对象名不会变成同一个文件,
+        // 也不会和目录里的临时文件(.<名字>.part)或者断点目录(.export)重名;
+        // 转义以后每个'%'后面都跟着两位十六进制, 不会出现"%%", 和太长的名字换成的 %%<哈希> 也不会重名
+        static std::string local_name(const std::string &oid)
+        {
+                if (oid.empty())
+                {
+                        return "%";
+                }
+                std::string name;
+                for (size_t i = 0; i < oid.size(); i++)
+                {
+                        char c = oid[i];
+                        if (c == '%' || c == '/' || (c == '.' && i == 0))
+                        {
+                                char hex[4];
+                                snprintf(hex, sizeof(hex), "%%%02X", static_cast<unsigned char>(c));
+                                name += hex;
+                        }
+                        else
+                        {
+                                name += c;
+                        }
+                }
+                return name;
+        }
+
+        // mkdir -p
+        static int make_dirs(const std::string &path)
+        {
+                for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1))
+                {
+                        std::string dir = path.substr(0, pos);
+                        if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+                        {
+                                return -1;
+                        }
+                        if (pos == std::string::npos)
+                        {
+                                return 0;
+                        }
+                }
+        }
+
+        std::string checkpoint_path(unsigned shard) const
+        {
+                return dest_dir + "/.export/shard-" + std::to_string(shard) + "-of-" + std::to_string(opts.shards);
+        }
+
+        std::string load_checkpoint(unsigned shard) const
+        {
+                std::ifstream in(checkpoint_path(shard));
+                std::string cursor;
+                std::getline(in, cursor);
+                return cursor;
+        }
+
+        // 先写临时文件再改名, 中途被杀掉也不会留下写了一半的进度
+        void save_checkpoint(unsigned shard, const librados::ObjectCursor &cursor) const
+        {
+                std::string path = checkpoint_path(shard);
+                {
+                        std::ofstream out(path + ".tmp", std::ios::trunc);
+                        out << cursor.to_str() << std::endl;
+                }
+                if (rename((path + ".tmp").c_str(), path.c_str()) < 0)
+                {
+                        std::cerr << "Couldn't save export checkpoint for shard " << shard << "!" << std::endl;
+                }
+        }
+
+        librados::IoCtx &io_ctx;
+        coro_executor &executor;
+        std::string dest_dir;
+        export_options opts;
+        std::mutex mutex;
+        std::condition_variable cond;
+        size_t in_flight = 0;
+        uint64_t exported = 0;
+        uint64_t skipped = 0;
+        uint64_t failed = 0;
+        uint64_t bytes = 0;
+};
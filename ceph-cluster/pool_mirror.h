@@ -0,0 +1,288 @@
+#pragma once
+#include "file_hash.h"
+#include "rados_coro.h"
+#include "redis_schema.h"
+#include "retry.h"
+#include "upload_engine.h"
+#include <condition_variable>
+#include <hiredis/hiredis.h>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <rados/librados.hpp>
+#include <string>
+#include <vector>
+
+// 池到池镜像的参数
+struct mirror_options
+{
+        size_t objects_in_flight = 64; // 同时在复制的对象数
+        size_t list_batch = 1024;      // 每次列多少个对象
+};
+
+// 把源池的对象增量复制到目标池, 目标池可以在另一个集群
+// 每个对象复制完以后在redis里记下它的指纹(大小, 修改时间, 有的话再加上传时存的哈希):
+//   <ns>:mirror:<目标集群fsid>:<源池>:<目标池>  HASH  对象名 -> 指纹
+// 下次镜像时指纹没变, 目标对象也还在, 就跳过不读; 镜像到不同集群的同名池各记各的
+// 数据按目标池的对齐要求分块写, xattr(lang, hash.*等)跟着最后一块一起写
+// 分好几块写的对象, 第一块带上mirror.partial标记, 最后一块写完才去掉; 中途失败的副本带着标记, 看得出是不完整的
+// (RADOS没有改名, 不能先写临时对象再换过去)
+const char *const mirror_xattr_partial = "mirror.partial";
+
+class pool_mirror
+{
+public:
+        pool_mirror(librados::IoCtx &src, librados::Rados &dst_cluster, librados::IoCtx &dst, coro_executor &executor,
+                    redisContext *redis_conn, const mirror_options &opts = mirror_options())
+            : src(src), dst(dst), executor(executor), redis_conn(redis_conn), opts(opts),
+              chunk_size(write_chunk_size(dst_alignment(dst))),
+              state_key(std::string(redis_namespace) + ":mirror:" + cluster_fsid(dst_cluster) + ":" + src.get_pool_name() + ":" +
+                        dst.get_pool_name())
+        {
+        }
+
+        // 镜像整个池, 返回失败的对象数
+        uint64_t run()
+        {
+                retry_policy retry;
+                librados::bufferlist filter;
+                librados::ObjectCursor cursor = src.object_list_begin();
+                librados::ObjectCursor end = src.object_list_end();
+                while (!src.object_list_is_end(cursor))
+                {
+                        std::vector<librados::ObjectItem> items;
+                        librados::ObjectCursor next;
+                        int ret = retry_sync(retry, "Listing objects", [&] {
+                                items.clear();
+                                return src.object_list(cursor, end, opts.list_batch, filter, &items, &next);
+                        });
+                        if (ret < 0)
+                        {
+                                std::cerr << "Couldn't list objects in the source pool! error " << ret << std::endl;
+                                exit(EXIT_FAILURE);
+                        }
+                        for (const librados::ObjectItem &item : items)
+                        {
+                                acquire_slot();
+                                spawn(executor, mirror_object(item.oid));
+                        }
+                        if (items.empty())
+                        {
+                                break;
+                        }
+                        cursor = next;
+                }
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this] { return in_flight == 0; });
+                std::cout << "Mirrored " << copied << " objects (" << bytes << " bytes), skipped " << skipped
+                          << " unchanged, " << failed << " failed." << std::endl;
+                return failed;
+        }
+
+private:
+        // 镜像是一次性的命令, 目标池的对齐都查不到就没法做了
+        static uint64_t dst_alignment(librados::IoCtx &dst)
+        {
+                uint64_t alignment = 0;
+                if (pool_write_alignment(dst, alignment) < 0)
+                {
+                        exit(EXIT_FAILURE);
+                }
+                return alignment;
+        }
+
+        static std::string cluster_fsid(librados::Rados &cluster)
+        {
+                std::string fsid;
+                int ret = cluster.cluster_fsid(&fsid);
+                if (ret < 0)
+                {
+                        std::cerr << "Couldn't get the destination cluster fsid! error " << ret << std::endl;
+                        exit(EXIT_FAILURE);
+                }
+                return fsid;
+        }
+
+        task<void> mirror_object(std::string oid)
+        {
+                int ret = co_await copy_if_changed(oid);
+                if (ret < 0)
+                {
+                        std::cerr << "Couldn't mirror object '" << oid << "'! error " << ret << std::endl;
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                if (ret < 0)
+                {
+                        failed++;
+                }
+                in_flight--;
+                cond.notify_all();
+        }
+
+        task<int> copy_if_changed(const std::string &oid)
+        {
+                // 大小, 修改时间和xattr一次请求取回来
+                uint64_t size = 0;
+                time_t mtime = 0;
+                std::map<std::string, librados::bufferlist> attrs;
+                int stat_ret = 0, attrs_ret = 0;
+                librados::ObjectReadOperation read_op;
+                read_op.stat(&size, &mtime, &stat_ret);
+                read_op.getxattrs(&attrs, &attrs_ret);
+                int ret = co_await async_operate(executor, src, oid, &read_op, nullptr);
+                if (ret < 0 || stat_ret < 0 || attrs_ret < 0)
+                {
+                        co_return ret < 0 ? ret : (stat_ret < 0 ? stat_ret : attrs_ret);
+                }
+
+                std::string fingerprint = std::to_string(size) + " " + std::to_string(mtime);
+                for (const char *name : {hash_xattr_tree, hash_xattr_sha256, hash_xattr_md5})
+                {
+                        if (attrs.count(name))
+                        {
+                                fingerprint += std::string(" ") + name + "=" + attrs[name].to_str();
+                                break;
+                        }
+                }
+                if (load_fingerprint(oid) == fingerprint)
+                {
+                        // 上次复制以后源对象没变, 再确认一下目标对象没被删
+                        uint64_t dst_size;
+                        time_t dst_mtime;
+                        if (co_await async_stat(executor, dst, oid, &dst_size, &dst_mtime) == 0 && dst_size == size)
+                        {
+                                std::lock_guard<std::mutex> lock(mutex);
+                                skipped++;
+                                co_return 0;
+                        }
+                }
+
+                // 目标对象现有的xattr, 源对象没有的要删掉, 不然旧的哈希, 压缩/加密标记会留在副本上
+                std::map<std::string, librados::bufferlist> dst_attrs;
+                int dst_attrs_ret = 0;
+                librados::ObjectReadOperation dst_op;
+                dst_op.getxattrs(&dst_attrs, &dst_attrs_ret);
+                ret = co_await async_operate(executor, dst, oid, &dst_op, nullptr);
+                if (ret < 0 && ret != -ENOENT)
+                {
+                        co_return ret;
+                }
+
+                // 第一块用write_full, 把目标对象原来的数据整个换掉; 最后一块带上xattr
+                // 不止一块的话第一块打上不完整的标记, 最后一块去掉; 上次失败留下的标记也在最后一块去掉
+                bool marked = dst_attrs.count(mirror_xattr_partial) > 0;
+                uint64_t offset = 0;
+                do
+                {
+                        uint64_t len = std::min(chunk_size, size - offset);
+                        librados::bufferlist bl;
+                        if (len > 0)
+                        {
+                                ret = co_await async_read(executor, src, oid, &bl, len, offset);
+                                if (ret < 0)
+                                {
+                                        co_return ret;
+                                }
+                                if (bl.length() != len)
+                                {
+                                        // 源对象在复制的时候被改了, 下次再来
+                                        co_return -EAGAIN;
+                                }
+                        }
+                        librados::ObjectWriteOperation write_op;
+                        if (offset == 0)
+                        {
+                                write_op.write_full(bl);
+                                if (len < size)
+                                {
+                                        write_op.setxattr(mirror_xattr_partial, librados::bufferlist());
+                                        marked = true;
+                                }
+                        }
+                        else
+                        {
+                                write_op.write(offset, bl);
+                        }
+                        if (offset + len == size)
+                        {
+                                if (marked)
+                                {
+                                        write_op.rmxattr(mirror_xattr_partial);
+                                }
+                                for (const auto &attr : dst_attrs)
+                                {
+                                        if (!attrs.count(attr.first) && attr.first != mirror_xattr_partial)
+                                        {
+                                                write_op.rmxattr(attr.first.c_str());
+                                        }
+                                }
+                                for (const auto &attr : attrs)
+                                {
+                                        write_op.setxattr(attr.first.c_str(), attr.second);
+                                }
+                        }
+                        ret = co_await async_operate(executor, dst, oid, &write_op);
+                        if (ret < 0)
+                        {
+                                co_return ret;
+                        }
+                        offset += len;
+                } while (offset < size);
+
+                save_fingerprint(oid, fingerprint);
+                std::lock_guard<std::mutex> lock(mutex);
+                copied++;
+                bytes += size;
+                co_return 0;
+        }
+
+        // hiredis的连接不能多个线程同时用, 协程在执行器的几个线程上跑, 要加锁
+        std::string load_fingerprint(const std::string &oid)
+        {
+                std::lock_guard<std::mutex> lock(redis_mutex);
+                std::string value;
+                redisReply *reply = (redisReply *)redisCommand(redis_conn, "HGET %s %b", state_key.c_str(), oid.data(), oid.size());
+                if (reply != nullptr && reply->type == REDIS_REPLY_STRING)
+                {
+                        value.assign(reply->str, reply->len);
+                }
+                freeReplyObject(reply);
+                return value;
+        }
+
+        void save_fingerprint(const std::string &oid, const std::string &fingerprint)
+        {
+                std::lock_guard<std::mutex> lock(redis_mutex);
+                redisReply *reply = (redisReply *)redisCommand(redis_conn, "HSET %s %b %s", state_key.c_str(), oid.data(),
+                                                               oid.size(), fingerprint.c_str());
+                if (reply == nullptr)
+                {
+                        // 记不下来只是下次会再复制一遍
+                        std::cerr << "Couldn't save mirror state for '" << oid << "' to Redis!" << std::endl;
+                }
+                freeReplyObject(reply);
+        }
+
+        void acquire_slot()
+        {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this] { return in_flight < opts.objects_in_flight; });
+                in_flight++;
+        }
+
+        librados::IoCtx &src;
+        librados::IoCtx &dst;
+        coro_executor &executor;
+        redisContext *redis_conn;
+        mirror_options opts;
+        uint64_t chunk_size;
+        std::string state_key;
+        std::mutex redis_mutex;
+        std::mutex mutex;
+        std::condition_variable cond;
+        size_t in_flight = 0;
+        uint64_t copied = 0;
+        uint64_t skipped = 0;
+        uint64_t failed = 0;
+        uint64_t bytes = 0;
+};
@@ -0,0 +1,228 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// 传输进度: 传输的热路径上只做一次原子写(relaxed), 不打印, 不刷新, 不加锁
+// 后台线程按固定频率把所有传输的进度采一遍, 算出速率, 交给输出(控制台, 指标文件, 网关的进度帧都可以)
+// 传得再快输出的频率也不变, 进度输出不会拖慢传输
+class progress_tracker
+{
+public:
+        progress_tracker(std::string name, uint64_t total, uint64_t done)
+            : name(std::move(name)), total(total), done(done), initial(done) {}
+
+        // 已经完成的字节数, 只增不减
+        void set(uint64_t n)
+        {
+                done.store(n, std::memory_order_relaxed);
+        }
+
+        void add(uint64_t n)
+        {
+                done.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        const std::string name;
+        const uint64_t total;
+
+private:
+        friend class progress_registry;
+        std::atomic<uint64_t> done;
+        const uint64_t initial; // 续传的时候开始前就完成了的, 不算进传输的字节数
+        // 下面这些只有采样的线程用
+        uint64_t last_done = initial;
+        double rate = 0;
+};
+
+// 一次采样里一个传输的状态
+struct progress_snapshot
+{
+        std::string name;
+        uint64_t done;        // 完成到哪了, 包括续传之前就完成了的
+        uint64_t transferred; // 这次传了多少, 不包括续传之前的
+        uint64_t total;
+        double rate; // 字节每秒, 最近几次采样的平滑值
+};
+
+// 所有正在进行的传输; 开始和结束的时候加锁, 更新进度不加锁
+class progress_registry
+{
+public:
+        static progress_registry &instance()
+        {
+                static progress_registry registry;
+                return registry;
+        }
+
+        // 传输结束以后tracker析构就自动注销了
+        std::shared_ptr<progress_tracker> start(const std::string &name, uint64_t total, uint64_t done = 0)
+        {
+                std::shared_ptr<progress_tracker> tracker(new progress_tracker(name, total, done), [this](progress_tracker *t) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        trackers.remove(t);
+                        finished_bytes += t->done.load(std::memory_order_relaxed) - t->initial;
+                        delete t;
+                });
+                std::lock_guard<std::mutex> lock(mutex);
+                trackers.push_back(tracker.get());
+                return tracker;
+        }
+
+        // 采样一次, elapsed是距上次采样的时间; 速率用指数平滑, 不会一跳一跳的
+        std::vector<progress_snapshot> sample(double elapsed, uint64_t &finished)
+        {
+                std::vector<progress_snapshot> out;
+                std::lock_guard<std::mutex> lock(mutex);
+                for (progress_tracker *t : trackers)
+                {
+                        uint64_t done = t->done.load(std::memory_order_relaxed);
+                        double instant = elapsed > 0 ? (done - t->last_done) / elapsed : 0;
+                        t->rate = t->rate == 0 ? instant : 0.7 * t->rate + 0.3 * instant;
+                        t->last_done = done;
+                        out.push_back(progress_snapshot{t->name, done, done - t->initial, t->total, t->rate});
+                }
+                finished = finished_bytes;
+                return out;
+        }
+
+private:
+        std::mutex mutex;
+        std::list<progress_tracker *> trackers;
+        uint64_t finished_bytes = 0; // 已经结束的传输一共传了多少, 指标里的计数器不能往回掉
+};
+
+using progress_sink = std::function<void(const std::vector<progress_snapshot> &, uint64_t finished)>;
+
+// 控制台: 终端上一行原地刷新所有传输的总进度; 输出到文件或者管道的时候每次一行, 没有传输就不输出
+inline progress_sink console_progress_sink()
+{
+        bool tty = isatty(STDOUT_FILENO);
+        return [tty](const std::vector<progress_snapshot> &transfers, uint64_t) {
+                if (transfers.empty())
+                {
+                        return;
+                }
+                uint64_t done = 0, total = 0;
+                double rate = 0;
+                for (const progress_snapshot &p : transfers)
+                {
+                        done += p.done;
+                        total += p.total;
+                        rate += p.rate;
+                }
+                const char *name = transfers.size() == 1 ? transfers[0].name.c_str() : "all transfers";
+                printf("%s: %.2f%% %.1f/%.1f MB %.1f MB/s%s", name, total > 0 ? done * 100.0 / total : 100.0,
+                       done / 1048576.0, total / 1048576.0, rate / 1048576.0, tty ? "   \r" : "\n");
+                fflush(stdout);
+        };
+}
+
+// Prometheus文本格式的指标文件, 给node_exporter的textfile收集器读; 先写临时文件再改名, 读的一方不会看到写了一半的
+inline progress_sink metrics_progress_sink(const std::string &path)
+{
+        return [path](const std::vector<progress_snapshot> &transfers, uint64_t finished) {
+                uint64_t done = finished;
+                double rate = 0;
+                for (const progress_snapshot &p : transfers)
+                {
+                        done += p.transferred;
+                        rate += p.rate;
+                }
+                std::string tmp = path + ".tmp";
+                {
+                        std::ofstream out(tmp, std::ios::trunc);
+                        out << "# TYPE ceph2_transfers_active gauge\nceph2_transfers_active " << transfers.size() << "\n"
+                            << "# TYPE ceph2_transfer_bytes_total counter\nceph2_transfer_bytes_total " << done << "\n"
+                            << "# TYPE ceph2_transfer_bytes_per_second gauge\nceph2_transfer_bytes_per_second " << rate << "\n";
+                        if (!out)
+                        {
+                                return;
+                        }
+                }
+                rename(tmp.c_str(), path.c_str());
+        };
+}
+
+// 后台线程每隔interval采样一次发给所有输出; 停下来的时候再发最后一次
+class progress_reporter
+{
+public:
+        explicit progress_reporter(std::chrono::milliseconds interval = std::chrono::milliseconds(1000)) : interval(interval) {}
+
+        ~progress_reporter()
+        {
+                stop();
+        }
+
+        void add_sink(progress_sink sink)
+        {
+                sinks.push_back(std::move(sink));
+        }
+
+        void start()
+        {
+                if (sinks.empty())
+                {
+                        return;
+                }
+                stopping = false;
+                worker = std::thread([this] {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        while (!cond.wait_for(lock, interval, [this] { return stopping; }))
+                        {
+                                publish();
+                        }
+                        publish();
+                });
+        }
+
+        void stop()
+        {
+                if (!worker.joinable())
+                {
+                        return;
+                }
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        stopping = true;
+                }
+                cond.notify_all();
+                worker.join();
+        }
+
+private:
+        void publish()
+        {
+                auto now = std::chrono::steady_clock::now();
+                std::chrono::duration<double> elapsed = now - last;
+                last = now;
+                uint64_t finished = 0;
+                std::vector<progress_snapshot> transfers = progress_registry::instance().sample(elapsed.count(), finished);
+                for (const progress_sink &sink : sinks)
+                {
+                        sink(transfers, finished);
+                }
+        }
+
+        const std::chrono::milliseconds interval;
+        std::vector<progress_sink> sinks;
+        std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+        std::thread worker;
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool stopping = false;
+};
@@ -0,0 +1,374 @@
+#pragma once
+// librados异步接口的C++20协程封装, 编译需要 -std=c++20
+// 用法:
+//   task<int> f(coro_executor &ex, librados::IoCtx &io_ctx)
+//   {
+//           librados::bufferlist bl;
+//           int ret = co_await async_read(ex, io_ctx, "obj", &bl, 4096, 0);
+//           ...
+//   }
+// 协程在等待aio的时候不占线程, 完成回调把协程交回执行器的线程继续跑,
+// 所以成千上万个传输可以共用几个线程
+#include <condition_variable>
+#include <coroutine>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <rados/librados.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+// 协程执行器: 固定几个线程, 从队列里取出协程恢复执行
+class coro_executor
+{
+public:
+        explicit coro_executor(unsigned threads = 2)
+        {
+                for (unsigned i = 0; i < threads; i++)
+                {
+                        workers.emplace_back([this] { run(); });
+                }
+        }
+
+        ~coro_executor()
+        {
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        stopping = true;
+                }
+                cond.notify_all();
+                for (std::thread &t : workers)
+                {
+                        t.join();
+                }
+        }
+
+        void post(std::coroutine_handle<> h)
+        {
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        ready.push_back(h);
+                }
+                cond.notify_one();
+        }
+
+        // co_await executor.schedule() 把当前协程切到执行器的线程上
+        auto schedule()
+        {
+                struct awaiter
+                {
+                        coro_executor &executor;
+                        bool await_ready() { return false; }
+                        void await_suspend(std::coroutine_handle<> h) { executor.post(h); }
+                        void await_resume() {}
+                };
+                return awaiter{*this};
+        }
+
+private:
+        void run()
+        {
+                while (true)
+                {
+                        std::coroutine_handle<> h;
+                        {
+                                std::unique_lock<std::mutex> lock(mutex);
+                                cond.wait(lock, [this] { return stopping || !ready.empty(); });
+                                if (ready.empty())
+                                {
+                                        return;
+                                }
+                                h = ready.front();
+                                ready.pop_front();
+                        }
+                        h.resume();
+                }
+        }
+
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::deque<std::coroutine_handle<>> ready;
+        bool stopping = false;
+        std::vector<std::thread> workers;
+};
+
+template <class T>
+class task;
+
+namespace coro_detail
+{
+struct promise_base
+{
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        // 结束的时候直接切回等待它的协程
+        struct final_awaiter
+        {
+                bool await_ready() noexcept { return false; }
+                template <class P>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+                {
+                        std::coroutine_handle<> c = h.promise().continuation;
+                        return c ? c : std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+        };
+        final_awaiter final_suspend() noexcept { return {}; }
+
+        void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <class T>
+struct promise : promise_base
+{
+        std::optional<T> value;
+        task<T> get_return_object();
+        void return_value(T v) { value = std::move(v); }
+};
+
+template <>
+struct promise<void> : promise_base
+{
+        task<void> get_return_object();
+        void return_void() {}
+};
+} // namespace coro_detail
+
+// 惰性启动的协程, 被co_await的时候才开始跑
+template <class T = void>
+class task
+{
+public:
+        using promise_type = coro_detail::promise<T>;
+        using handle_type = std::coroutine_handle<promise_type>;
+
+        explicit task(handle_type h) : h(h) {}
+        task(task &&other) noexcept : h(other.h) { other.h = nullptr; }
+        task(const task &) = delete;
+        ~task()
+        {
+                if (h)
+                {
+                        h.destroy();
+                }
+        }
+
+        bool await_ready() { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> c)
+        {
+                h.promise().continuation = c;
+                return h;
+        }
+        T await_resume()
+        {
+                if (h.promise().error)
+                {
+                        std::rethrow_exception(h.promise().error);
+                }
+                if constexpr (!std::is_void_v<T>)
+                {
+                        return std::move(*h.promise().value);
+                }
+        }
+
+private:
+        handle_type h;
+};
+
+namespace coro_detail
+{
+template <class T>
+task<T> promise<T>::get_return_object()
+{
+        return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object()
+{
+        return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+// 不需要等结果的协程, 跑完自己销毁
+struct detached
+{
+        struct promise_type
+        {
+                detached get_return_object() { return {}; }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() {}
+                void unhandled_exception()
+                {
+                        std::cerr << "Unhandled exception in coroutine!" << std::endl;
+                        exit(EXIT_FAILURE);
+                }
+        };
+};
+
+inline detached run_detached(coro_executor &executor, task<void> t)
+{
+        co_await executor.schedule();
+        co_await t;
+}
+
+template <class T>
+struct wait_state
+{
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool done = false;
+        std::optional<T> value;
+        std::exception_ptr error;
+};
+
+template <>
+struct wait_state<void>
+{
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool done = false;
+        std::exception_ptr error;
+};
+
+template <class T>
+detached run_and_signal(coro_executor &executor, task<T> t, wait_state<T> *state)
+{
+        co_await executor.schedule();
+        try
+        {
+                if constexpr (std::is_void_v<T>)
+                {
+                        co_await t;
+                }
+                else
+                {
+                        state->value = co_await t;
+                }
+        }
+        catch (...)
+        {
+                state->error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->done = true;
+        state->cond.notify_all();
+}
+} // namespace coro_detail
+
+// 在执行器上启动一个协程, 不等它结束
+inline void spawn(coro_executor &executor, task<void> t)
+{
+        coro_detail::run_detached(executor, std::move(t));
+}
+
+// 在执行器上跑一个协程, 当前线程阻塞到它结束(给main这种非协程的代码用)
+template <class T>
+T sync_wait(coro_executor &executor, task<T> t)
+{
+        coro_detail::wait_state<T> state;
+        coro_detail::run_and_signal(executor, std::move(t), &state);
+        std::unique_lock<std::mutex> lock(state.mutex);
+        state.cond.wait(lock, [&] { return state.done; });
+        if (state.error)
+        {
+                std::rethrow_exception(state.error);
+        }
+        if constexpr (!std::is_void_v<T>)
+        {
+                return std::move(*state.value);
+        }
+}
+
+// 等待一个librados aio请求, co_await的结果是请求的返回值
+class aio_awaitable
+{
+public:
+        aio_awaitable(coro_executor &executor, std::function<int(librados::AioCompletion *)> submit)
+            : executor(executor), submit(std::move(submit)) {}
+
+        bool await_ready() { return false; }
+
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+                handle = h;
+                completion = librados::Rados::aio_create_completion(this, &aio_awaitable::on_complete);
+                // 请求一发出去回调随时可能来, 协程恢复以后这个对象就没了, 之后不能再碰成员
+                std::function<int(librados::AioCompletion *)> fn = std::move(submit);
+                librados::AioCompletion *c = completion;
+                int ret = fn(c);
+                if (ret < 0)
+                {
+                        // 没发出去, 不挂起, 直接返回错误
+                        c->release();
+                        result = ret;
+                        return false;
+                }
+                return true;
+        }
+
+        int await_resume() { return result; }
+
+private:
+        static void on_complete(librados::completion_t, void *arg)
+        {
+                aio_awaitable *a = static_cast<aio_awaitable *>(arg);
+                a->result = a->completion->get_return_value();
+                a->completion->release();
+                // 不在librados的回调线程里继续跑协程, 交给执行器
+                a->executor.post(a->handle);
+        }
+
+        coro_executor &executor;
+        std::function<int(librados::AioCompletion *)> submit;
+        std::coroutine_handle<> handle;
+        librados::AioCompletion *completion = nullptr;
+        int result = 0;
+};
+
+inline aio_awaitable async_read(coro_executor &executor, librados::IoCtx &io_ctx, const std::string &oid,
+                                librados::bufferlist *pbl, size_t len, uint64_t off)
+{
+        return aio_awaitable(executor, [&io_ctx, oid, pbl, len, off](librados::AioCompletion *c) {
+                return io_ctx.aio_read(oid, c, pbl, len, off);
+        });
+}
+
+inline aio_awaitable async_write(coro_executor &executor, librados::IoCtx &io_ctx, const std::string &oid,
+                                 const librados::bufferlist &bl, size_t len, uint64_t off)
+{
+        return aio_awaitable(executor, [&io_ctx, oid, &bl, len, off](librados::AioCompletion *c) {
+                return io_ctx.aio_write(oid, c, bl, len, off);
+        });
+}
+
+inline aio_awaitable async_stat(coro_executor &executor, librados::IoCtx &io_ctx, const std::string &oid,
+                                uint64_t *psize, time_t *pmtime)
+{
+        return aio_awaitable(executor, [&io_ctx, oid, psize, pmtime](librados::AioCompletion *c) {
+                return io_ctx.aio_stat(oid, c, psize, pmtime);
+        });
+}
+
+inline aio_awaitable async_operate(coro_executor &executor, librados::IoCtx &io_ctx, const std::string &oid,
+                                   librados::ObjectWriteOperation *op)
+{
+        return aio_awaitable(executor, [&io_ctx, oid, op](librados::AioCompletion *c) {
+                return io_ctx.aio_operate(oid, c, op);
+        });
+}
+
+inline aio_awaitable async_operate(coro_executor &executor, librados::IoCtx &io_ctx, const std::string &oid,
+                                   librados::ObjectReadOperation *op, librados::bufferlist *pbl, int flags = 0)
+{
+        return aio_awaitable(executor, [&io_ctx, oid, op, pbl, flags](librados::AioCompletion *c) {
+                return io_ctx.aio_operate(oid, c, op, flags, pbl);
+        });
+}
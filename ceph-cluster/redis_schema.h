@@ -0,0 +1,91 @@
+#pragma once
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+// redis里元数据的紧凑布局
+// 原来每个上传进度, 每个文件指纹都是一个顶层的字符串键, 几千万个键光键本身的开销就要几个G,
+// 扫描键空间也越来越慢. 现在把它们按哈希分到固定数量的小HASH里, 小HASH用listpack编码, 每条只占几十字节:
+//   <ns>:up:<桶>        HASH  上传进度的键名 -> 已上传字节数
+//   <ns>:fh:<桶>        HASH  文件指纹(32字节二进制, 去掉当桶号的前2字节) -> ""或者"d:<池>\t<对象名>"(数据在哪), 见dedup_claim.h
+//   <ns>:done:<日期>    HASH  传完的上传进度, 整个键带TTL, 过期自动清掉
+// 内容寻址存储(cas_store.h)在 <ns>:cas:<池> 下面另有 fh, ref, name, gc 几组键, 池镜像(pool_mirror.h)的指纹在 <ns>:mirror:... 下面
+// 每个桶平均条数要小于redis的hash-max-listpack-entries(默认128), 否则会退化成普通哈希表
+// 上亿条的话把桶数调大, 或者把redis的hash-max-listpack-entries调大
+const char *const redis_namespace = "ceph2";
+const unsigned redis_upload_buckets = 1 << 16;
+const unsigned redis_done_ttl_days = 7;
+
+// FNV-1a, 只用来分桶
+inline uint32_t redis_bucket_hash(const std::string &s)
+{
+        uint32_t h = 2166136261u;
+        for (unsigned char c : s)
+        {
+                h = (h ^ c) * 16777619u;
+        }
+        return h;
+}
+
+inline std::string redis_upload_key(const std::string &name)
+{
+        return std::string(redis_namespace) + ":up:" + std::to_string(redis_bucket_hash(name) % redis_upload_buckets);
+}
+
+// 按完成的日期分键, 整个键一起过期
+inline std::string redis_done_key(time_t now)
+{
+        char day[16];
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(day, sizeof(day), "%Y%m%d", &tm);
+        return std::string(redis_namespace) + ":done:" + day;
+}
+
+// 十六进制的指纹转成二进制, 长度减半; 不是合法的十六进制返回空串
+inline std::string hex_to_binary(const std::string &hex)
+{
+        if (hex.size() % 2 != 0)
+        {
+                return "";
+        }
+        auto nibble = [](char c) -> int {
+                if (c >= '0' && c <= '9')
+                {
+                        return c - '0';
+                }
+                if (c >= 'a' && c <= 'f')
+                {
+                        return c - 'a' + 10;
+                }
+                if (c >= 'A' && c <= 'F')
+                {
+                        return c - 'A' + 10;
+                }
+                return -1;
+        };
+        std::string bin;
+        for (size_t i = 0; i < hex.size(); i += 2)
+        {
+                int hi = nibble(hex[i]), lo = nibble(hex[i + 1]);
+                if (hi < 0 || lo < 0)
+                {
+                        return "";
+                }
+                bin += static_cast<char>(hi << 4 | lo);
+        }
+        return bin;
+}
+
+// 指纹本身就是均匀分布的, 前2字节直接当桶号(65536个桶), 剩下的当字段名
+// ns可以换成别的命名空间, 比如内容寻址存储每个池单独一套
+inline std::string redis_file_hash_key(const std::string &digest, const std::string &ns = redis_namespace)
+{
+        unsigned bucket = (static_cast<unsigned char>(digest[0]) << 8) | static_cast<unsigned char>(digest[1]);
+        return ns + ":fh:" + std::to_string(bucket);
+}
+
+inline std::string redis_file_hash_field(const std::string &digest)
+{
+        return digest.substr(2);
+}
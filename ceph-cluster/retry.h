@@ -0,0 +1,107 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <thread>
+
+// 重试的参数
+struct retry_options
+{
+        unsigned max_attempts = 8;                  // 单个请求最多试几次(含第一次)
+        uint64_t budget = 256;                      // 整个传输最多重试几次, 用完了就当致命错误
+        std::chrono::milliseconds base_delay{100};  // 第一次重试前等多久, 之后翻倍
+        std::chrono::milliseconds max_delay{10000}; // 等待时间的上限
+};
+
+// 哪些错误值得重试: OSD切换, 网络抖动, 集群忙这类过一会儿自己会好的
+// 参数错误, 对象不存在, 没权限这些重试也没用
+inline bool is_retryable_error(int err)
+{
+        switch (err)
+        {
+        case -ETIMEDOUT:
+        case -EAGAIN:
+        case -EBUSY:
+        case -EINTR:
+        case -ECONNRESET:
+        case -ECONNREFUSED:
+        case -ECONNABORTED:
+        case -ENOTCONN:
+        case -ESHUTDOWN:
+        case -EHOSTUNREACH:
+        case -ENETUNREACH:
+        case -ENETDOWN:
+        case -ENOBUFS:
+        case -ENOMEM:
+                return true;
+        default:
+                return false;
+        }
+}
+
+// 一次传输的重试策略: 判断能不能重试, 算出带随机抖动的指数退避时间, 扣减重试预算
+// 退避用full jitter, 在[0, min(max_delay, base_delay * 2^n))里随机取,
+// 很多请求同时失败的时候不会一起重试再一起撞上去
+class retry_policy
+{
+public:
+        explicit retry_policy(const retry_options &opts = retry_options()) : opts(opts), rng(std::random_device{}()) {}
+
+        // 第attempt次(从1开始)失败, 返回err, 能重试的话扣一次预算返回true
+        bool should_retry(int err, unsigned attempt)
+        {
+                if (!is_retryable_error(err) || attempt >= opts.max_attempts || used >= opts.budget)
+                {
+                        return false;
+                }
+                used++;
+                return true;
+        }
+
+        // 第attempt次失败以后等多久再试
+        std::chrono::milliseconds backoff(unsigned attempt)
+        {
+                int64_t cap = opts.base_delay.count() << std::min(attempt - 1, 20u);
+                cap = std::min<int64_t>(cap, opts.max_delay.count());
+                std::uniform_int_distribution<int64_t> dist(0, std::max<int64_t>(cap, 1));
+                return std::chrono::milliseconds(dist(rng));
+        }
+
+        uint64_t retries() const
+        {
+                return used;
+        }
+
+        void print_stats(const char *name) const
+        {
+                if (used > 0)
+                {
+                        std::cout << name << " retried " << used << " times after transient errors." << std::endl;
+                }
+        }
+
+private:
+        retry_options opts;
+        std::mt19937_64 rng;
+        uint64_t used = 0;
+};
+
+// 同步调用的重试: fn返回负的错误码表示失败, 可以重试的错误退避以后再调, 返回最后一次的结果
+inline int retry_sync(retry_policy &retry, const char *what, const std::function<int()> &fn)
+{
+        for (unsigned attempt = 1;; attempt++)
+        {
+                int ret = fn();
+                if (ret >= 0 || !retry.should_retry(ret, attempt))
+                {
+                        return ret;
+                }
+                std::chrono::milliseconds delay = retry.backoff(attempt);
+                std::cerr << what << " failed with error " << ret << ", retrying in " << delay.count() << " ms." << std::endl;
+                std::this_thread::sleep_for(delay);
+        }
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// websocket网关的二进制分帧协议: 一个websocket连接上同时传很多个文件
+// 每个websocket二进制消息是一帧, 帧头24字节, 都是小端:
+//   类型(1) 标志(1) 保留(2) 流编号(4) 偏移量(8) 长度(4) 保留(4), 后面跟着数据
+// 流编号由客户端分配, 同一个连接上不能重复使用还没结束的编号
+//   OPEN   客户端 -> 网关  打开一个上传流, 数据是 "<池>\t<对象名>\t<文件大小>"
+//   ACCEPT 网关 -> 客户端  流打开了, 长度字段是初始额度(可以先发多少字节), 可能是0, 额度要等调度器放行以后用CREDIT给
+//   DATA   客户端 -> 网关  偏移量处的一段数据, 一个流里的数据必须按顺序发, 不同流的可以交错
+//   FIN    客户端 -> 网关  这个流的数据发完了, 偏移量是总字节数
+//   CREDIT 网关 -> 客户端  再给这个流长度字段那么多的额度
+//   DONE   网关 -> 客户端  文件都写进集群了, 偏移量是对象大小
+//   RESET  双向           流出错或者被取消, 长度字段是错误码(正数errno)
+//   PROGRESS 网关 -> 客户端 进度, 偏移量是已经写进集群的字节数; 每个连接按固定频率发, 只发有变化的流
+// 流控靠额度: 客户端每个流发出去的字节数不能超过网关给的额度总和, 超了网关直接RESET这个流
+// 网关在数据真正写进集群以后才还额度, 所以慢的OSD会一路反压到浏览器, 网关内存不会被撑爆
+// 一个连接的所有流共用一份总额度, 流再多网关的内存占用也有上限
+enum stream_frame_type : uint8_t
+{
+        FRAME_OPEN = 1,
+        FRAME_ACCEPT = 2,
+        FRAME_DATA = 3,
+        FRAME_FIN = 4,
+        FRAME_CREDIT = 5,
+        FRAME_DONE = 6,
+        FRAME_RESET = 7,
+        FRAME_PROGRESS = 8,
+};
+
+const size_t stream_frame_header_size = 24;
+
+struct stream_frame
+{
+        stream_frame_type type;
+        uint32_t stream_id;
+        uint64_t offset;
+        uint32_t length;
+        const char *payload;
+        size_t payload_len;
+};
+
+// 解析一个websocket消息, 不够一个帧头返回false; payload指向msg里面, 不拷贝
+inline bool decode_stream_frame(const char *msg, size_t len, stream_frame &f)
+{
+        if (len < stream_frame_header_size)
+        {
+                return false;
+        }
+        auto get = [msg](size_t pos, int bytes) {
+                uint64_t v = 0;
+                for (int i = 0; i < bytes; i++)
+                {
+                        v |= static_cast<uint64_t>(static_cast<unsigned char>(msg[pos + i])) << (8 * i);
+                }
+                return v;
+        };
+        f.type = static_cast<stream_frame_type>(msg[0]);
+        f.stream_id = get(4, 4);
+        f.offset = get(8, 8);
+        f.length = get(16, 4);
+        f.payload = msg + stream_frame_header_size;
+        f.payload_len = len - stream_frame_header_size;
+        return f.type >= FRAME_OPEN && f.type <= FRAME_PROGRESS;
+}
+
+// 编一个网关发出去的帧, 网关发的帧都不带数据
+inline std::string encode_stream_frame(stream_frame_type type, uint32_t stream_id, uint64_t offset, uint32_t length)
+{
+        std::string msg(stream_frame_header_size, '\0');
+        auto put = [&msg](size_t pos, uint64_t v, int bytes) {
+                for (int i = 0; i < bytes; i++)
+                {
+                        msg[pos + i] = static_cast<char>(v >> (8 * i));
+                }
+        };
+        msg[0] = static_cast<char>(type);
+        put(4, stream_id, 4);
+        put(8, offset, 8);
+        put(16, length, 4);
+        return msg;
+}
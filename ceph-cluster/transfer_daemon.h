@@ -0,0 +1,400 @@
+#pragma once
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <hiredis/hiredis.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <rados/librados.hpp>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// 守护进程默认监听的UNIX socket, 可以用CEPH2_SOCKET改
+const char *const default_daemon_socket = "/tmp/ceph2.sock";
+
+// 一个传输任务, 协议是一行一个任务, 字段之间用tab隔开(路径里可以有空格):
+//   upload   <池> <本地文件> <对象名>
+//   ingest   <池> <本地文件> <对象名>    同样内容的文件已经存过就不传
+//   download <池> <对象名> <本地文件>
+//   put      <池> <本地文件> <文件名>    存进内容寻址存储(cas_store.h)
+//   get      <池> <文件名> <本地文件>
+//   unlink   <池> <文件名> -
+// 每个任务回一行: "OK" 或者 "ERR <错误码>", 按任务发来的顺序回
+struct transfer_job
+{
+        std::string op;
+        std::string pool;
+        std::string src;
+        std::string dst;
+
+        static bool parse(const std::string &line, transfer_job &job)
+        {
+                std::vector<std::string> fields;
+                size_t start = 0;
+                while (true)
+                {
+                        size_t tab = line.find('\t', start);
+                        fields.push_back(line.substr(start, tab == std::string::npos ? std::string::npos : tab - start));
+                        if (tab == std::string::npos)
+                        {
+                                break;
+                        }
+                        start = tab + 1;
+                }
+                if (fields.size() != 4)
+                {
+                        return false;
+                }
+                job = {fields[0], fields[1], fields[2], fields[3]};
+                return true;
+        }
+
+        std::string to_line() const
+        {
+                return op + "\t" + pool + "\t" + src + "\t" + dst + "\n";
+        }
+};
+
+// 按行读socket, 读到一整行返回true
+inline bool read_socket_line(int fd, std::string &buffer, std::string &line)
+{
+        while (true)
+        {
+                size_t newline = buffer.find('\n');
+                if (newline != std::string::npos)
+                {
+                        line = buffer.substr(0, newline);
+                        buffer.erase(0, newline + 1);
+                        return true;
+                }
+                char chunk[4096];
+                ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+                if (n < 0 && errno == EINTR)
+                {
+                        continue;
+                }
+                if (n <= 0)
+                {
+                        return false;
+                }
+                buffer.append(chunk, n);
+        }
+}
+
+// 对方已经断开的时候不要收到SIGPIPE把整个进程带走
+inline bool write_socket(int fd, const std::string &data)
+{
+        size_t sent = 0;
+        while (sent < data.size())
+        {
+                ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR)
+                {
+                        continue;
+                }
+                if (n <= 0)
+                {
+                        return false;
+                }
+                sent += n;
+        }
+        return true;
+}
+
+inline sockaddr_un daemon_socket_address(const std::string &path)
+{
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        return addr;
+}
+
+// 常驻的传输守护进程: 集群连接, 每个池的IoCtx和redis连接都一直留着,
+// 每个任务不用再花几百毫秒init2/读配置/connect/ioctx_create/redisConnect
+// 每个连接一个线程读任务, 排进共用的队列; 几个工作线程各自有一个redis连接(hiredis的连接不能多线程共用),
+// 从队列里取任务做, 一个连接上的任务也是并行做的, 结果按任务的顺序回; 一个任务失败只回ERR, 不影响别的任务
+// 只接受和守护进程同一个用户(或者root)的连接, socket文件也只有这个用户能读写
+class transfer_daemon
+{
+public:
+        // 执行一个任务, 成功返回0, 失败返回负的错误码
+        using handler_t = std::function<int(const transfer_job &, librados::IoCtx &, redisContext *)>;
+
+        transfer_daemon(librados::Rados &cluster, const std::string &socket_path, handler_t handler, unsigned workers = 4)
+            : cluster(cluster), socket_path(socket_path), handler(std::move(handler)), worker_count(workers)
+        {
+        }
+
+        ~transfer_daemon()
+        {
+                for (auto &entry : io_ctxs)
+                {
+                        entry.second->close();
+                }
+        }
+
+        // 一直接受连接, 不返回
+        void run()
+        {
+                int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+                sockaddr_un addr = daemon_socket_address(socket_path);
+                // 上次留下的socket文件要先删掉才能bind
+                unlink(socket_path.c_str());
+                if (listen_fd < 0 || bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 || chmod(socket_path.c_str(), 0600) < 0 ||
+                    listen(listen_fd, 64) < 0)
+                {
+                        std::cerr << "Couldn't listen on '" << socket_path << "'! error " << errno << std::endl;
+                        exit(EXIT_FAILURE);
+                }
+                std::cout << "Listening for transfer jobs on '" << socket_path << "'." << std::endl;
+
+                std::vector<std::thread> workers;
+                for (unsigned i = 0; i < worker_count; i++)
+                {
+                        workers.emplace_back([this] { work(); });
+                }
+                while (true)
+                {
+                        int fd = accept(listen_fd, nullptr, nullptr);
+                        if (fd < 0)
+                        {
+                                if (errno != EINTR)
+                                {
+                                        std::cerr << "Couldn't accept a connection! error " << errno << std::endl;
+                                }
+                                continue;
+                        }
+                        if (!peer_allowed(fd))
+                        {
+                                close(fd);
+                                continue;
+                        }
+                        std::shared_ptr<connection> conn(new connection(fd));
+                        std::thread([this, conn] { read_jobs(conn); }).detach();
+                }
+        }
+
+private:
+        // 一个客户端连接; 最后一个任务回完以后析构, 关掉socket
+        struct connection
+        {
+                explicit connection(int fd) : fd(fd) {}
+
+                ~connection()
+                {
+                        close(fd);
+                }
+
+                int fd;
+                std::mutex mutex;
+                std::condition_variable cond;
+                uint64_t next_reply = 0;         // 下一个该回的任务序号
+                std::map<uint64_t, int> results; // 做完了还没轮到回的任务
+                size_t outstanding = 0;          // 收到了还没回的任务数
+                std::atomic<bool> broken{false}; // 回结果失败, 对方已经断开, 剩下的任务不用做了
+        };
+
+        struct queued_job
+        {
+                std::shared_ptr<connection> conn;
+                uint64_t seq;
+                std::string line;
+        };
+
+        // 对方的uid要和守护进程一样, 别的用户不能借守护进程的身份读写集群
+        bool peer_allowed(int fd)
+        {
+                ucred cred;
+                socklen_t len = sizeof(cred);
+                if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+                {
+                        std::cerr << "Couldn't get the peer credentials! error " << errno << std::endl;
+                        return false;
+                }
+                if (cred.uid != geteuid() && cred.uid != 0)
+                {
+                        std::cerr << "Rejected a connection from uid " << cred.uid << " pid " << cred.pid << "." << std::endl;
+                        return false;
+                }
+                return true;
+        }
+
+        // 按行读任务排进队列; 一个连接最多压worker_count * 2个没回的任务, 批量的客户端不会把队列占满
+        void read_jobs(std::shared_ptr<connection> conn)
+        {
+                std::string buffer, line;
+                uint64_t seq = 0;
+                while (read_socket_line(conn->fd, buffer, line))
+                {
+                        {
+                                std::unique_lock<std::mutex> lock(conn->mutex);
+                                conn->cond.wait(lock, [&] { return conn->outstanding < worker_count * 2 || conn->broken; });
+                                if (conn->broken)
+                                {
+                                        return;
+                                }
+                                conn->outstanding++;
+                        }
+                        {
+                                std::lock_guard<std::mutex> lock(mutex);
+                                jobs.push_back(queued_job{conn, seq++, line});
+                        }
+                        cond.notify_one();
+                }
+        }
+
+        // redis连不上的时候这个工作线程的任务都失败, 下一个任务再连, 守护进程不退出
+        void work()
+        {
+                redisContext *redis_conn = nullptr;
+                while (true)
+                {
+                        queued_job job;
+                        {
+                                std::unique_lock<std::mutex> lock(mutex);
+                                cond.wait(lock, [this] { return !jobs.empty(); });
+                                job = std::move(jobs.front());
+                                jobs.pop_front();
+                        }
+                        int ret = -ECONNRESET;
+                        if (!job.conn->broken && redis_conn == nullptr)
+                        {
+                                redis_conn = redisConnect("127.0.0.1", 6379);
+                                if (redis_conn == nullptr || redis_conn->err)
+                                {
+                                        std::cerr << "Redis connection error in transfer worker!" << std::endl;
+                                        redisFree(redis_conn);
+                                        redis_conn = nullptr;
+                                        ret = -ECONNREFUSED;
+                                }
+                        }
+                        if (!job.conn->broken && redis_conn != nullptr)
+                        {
+                                ret = execute(job.line, redis_conn);
+                        }
+                        reply(*job.conn, job.seq, ret);
+                }
+        }
+
+        int execute(const std::string &line, redisContext *redis_conn)
+        {
+                transfer_job job;
+                if (!transfer_job::parse(line, job))
+                {
+                        return -EINVAL;
+                }
+                int ret;
+                librados::IoCtx *io_ctx = io_ctx_for(job.pool, ret);
+                if (io_ctx == nullptr)
+                {
+                        return ret;
+                }
+                return handler(job, *io_ctx, redis_conn);
+        }
+
+        // 记下结果, 把从next_reply开始连续做完的都按顺序回掉
+        void reply(connection &conn, uint64_t seq, int ret)
+        {
+                std::lock_guard<std::mutex> lock(conn.mutex);
+                conn.results[seq] = ret;
+                auto it = conn.results.begin();
+                while (it != conn.results.end() && it->first == conn.next_reply)
+                {
+                        std::string line = it->second < 0 ? "ERR " + std::to_string(it->second) + "\n" : std::string("OK\n");
+                        if (!conn.broken && !write_socket(conn.fd, line))
+                        {
+                                conn.broken = true;
+                        }
+                        it = conn.results.erase(it);
+                        conn.next_reply++;
+                        conn.outstanding--;
+                }
+                conn.cond.notify_all();
+        }
+
+        // 每个池的IoCtx只创建一次; IoCtx的读写接口可以多个线程同时调用
+        librados::IoCtx *io_ctx_for(const std::string &pool, int &ret)
+        {
+                std::lock_guard<std::mutex> lock(io_ctx_mutex);
+                auto it = io_ctxs.find(pool);
+                if (it != io_ctxs.end())
+                {
+                        return it->second.get();
+                }
+                std::unique_ptr<librados::IoCtx> io_ctx(new librados::IoCtx);
+                ret = cluster.ioctx_create(pool.c_str(), *io_ctx);
+                if (ret < 0)
+                {
+                        std::cerr << "Couldn't set up ioctx for pool '" << pool << "'! error " << ret << std::endl;
+                        return nullptr;
+                }
+                return (io_ctxs[pool] = std::move(io_ctx)).get();
+        }
+
+        librados::Rados &cluster;
+        std::string socket_path;
+        handler_t handler;
+        unsigned worker_count;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::deque<queued_job> jobs;
+        std::mutex io_ctx_mutex;
+        std::map<std::string, std::unique_ptr<librados::IoCtx>> io_ctxs;
+};
+
+// 瘦客户端: 把任务发给守护进程, 一个连接发完所有任务再逐个收结果, 返回失败的任务数
+inline int submit_transfer_jobs(const std::string &socket_path, const std::vector<transfer_job> &jobs)
+{
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr = daemon_socket_address(socket_path);
+        if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+                std::cerr << "Couldn't connect to the transfer daemon at '" << socket_path << "'! error " << errno << std::endl;
+                exit(EXIT_FAILURE);
+        }
+        // 另起一个线程发, 免得任务很多的时候两边都堵在写上
+        std::thread sender([&] {
+                for (const transfer_job &job : jobs)
+                {
+                        if (!write_socket(fd, job.to_line()))
+                        {
+                                break;
+                        }
+                }
+                shutdown(fd, SHUT_WR);
+        });
+        int failed = 0;
+        std::string buffer, line;
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+                const transfer_job &job = jobs[i];
+                if (!read_socket_line(fd, buffer, line))
+                {
+                        // 没收到结果的都算失败
+                        std::cerr << "Transfer daemon closed the connection!" << std::endl;
+                        failed += jobs.size() - i;
+                        break;
+                }
+                if (line != "OK")
+                {
+                        std::cerr << job.op << " '" << job.src << "' failed: " << line << std::endl;
+                        failed++;
+                }
+        }
+        sender.join();
+        close(fd);
+        return failed;
+}
@@ -0,0 +1,542 @@
+#pragma once
+#include "aio_window.h"
+#include "buffer_pool.h"
+#include "retry.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <rados/librados.hpp>
+#include <set>
+#include <string>
+
+// 不要求对齐的池每次写4MB
+const uint64_t default_write_chunk_size = 4 * 1024 * 1024;
+
+// 查询池的写对齐要求(纠删码池要求按条带宽度对齐), 不要求对齐alignment是0; 查不到返回负的错误码
+inline int pool_write_alignment(librados::IoCtx &io_ctx, uint64_t &alignment)
+{
+        alignment = 0;
+        bool requires_alignment = false;
+        int ret = io_ctx.pool_requires_alignment2(&requires_alignment);
+        if (ret >= 0 && requires_alignment)
+        {
+                ret = io_ctx.pool_required_alignment2(&alignment);
+        }
+        if (ret < 0)
+        {
+                std::cerr << "Couldn't query pool alignment! error " << ret << std::endl;
+        }
+        return ret < 0 ? ret : 0;
+}
+
+// 每次写入的块大小: 凑成对齐大小的整数倍, 这样每次都是整条带写, OSD不用先读再改
+inline uint64_t write_chunk_size(uint64_t alignment)
+{
+        if (alignment == 0)
+        {
+                return default_write_chunk_size;
+        }
+        return (default_write_chunk_size + alignment - 1) / alignment * alignment;
+}
+
+// 上传引擎: 把任意长度的数据攒成整条带的块, 用aio并发写到对象里
+// 除了最后flush的尾巴, 每次写的偏移量和长度都是对齐的
+// 某一块写失败了, 暂时性的错误退避以后只重发这一块, 别的块照常在写
+// 要求对齐的池(不开覆盖写的纠删码池)只能在对象末尾追加, 写的偏移量不等于对象长度就返回EOPNOTSUPP:
+// 一块失败以后它后面已经发出去的块也都会失败, 等它们都回来, 查一下对象的实际长度,
+// 已经落盘的块算写完了(可能是超时了其实写成功了), 剩下的从对象末尾开始按顺序重发
+// 重试用完了或者不能重试的错误不退出进程, 记到error()里, 之后写的数据都丢掉, 等在途的都回来就idle, 由调用方决定怎么收场
+class stripe_writer
+{
+public:
+        stripe_writer(librados::IoCtx &io_ctx, const std::string &object_name, uint64_t start_offset,
+                      uint64_t alignment, size_t max_in_flight = 8, const retry_options &retry_opts = retry_options())
+            : io_ctx(io_ctx), object_name(object_name), chunk_size(write_chunk_size(alignment)),
+              pool(chunk_size, max_in_flight + 1), retry(retry_opts), window(max_in_flight), next_offset(start_offset),
+              committed_offset(start_offset), append_only(alignment != 0)
+        {
+                if (alignment != 0 && start_offset % alignment != 0)
+                {
+                        std::cerr << "Resume offset " << start_offset << " is not aligned to " << alignment << std::endl;
+                        error_code = -EINVAL;
+                }
+        }
+
+        ~stripe_writer()
+        {
+                if (stat_completion != nullptr)
+                {
+                        stat_completion->wait_for_complete();
+                        stat_completion->release();
+                }
+        }
+
+        // 每当已确认写入的连续前缀变长时调用, 参数是新的前缀长度
+        std::function<void(uint64_t)> on_commit;
+
+        // 设了这个回调的话, 攒满的块先不发, 留在缓冲区里回调(偏移量, 长度), 调用方决定什么时候用admit()发出去
+        // 网关用它让每个写在真正发给RADOS的时候才经过调度器; 设了以后要用flush_async()加poll(), 不能用flush(),
+        // 等放行的块占着缓冲区, 调用方给的数据不能超过max_in_flight块还没admit
+        std::function<void(uint64_t, uint64_t)> on_ready;
+
+        // 追加数据, 攒够一个块就发出去
+        // 数据拷进池里的缓冲区, 写完以后缓冲区还回池里给下一块用
+        void write(const char *data, size_t len)
+        {
+                while (len > 0 && error_code == 0)
+                {
+                        if (pending == nullptr)
+                        {
+                                // 缓冲区都在途的时候等一个写完还回来; 什么都不在途还取不到, 就是内存分配不出来了
+                                while ((pending = pool.acquire()) == nullptr)
+                                {
+                                        if (window.in_flight() == 0 && retries.empty() && failed.empty())
+                                        {
+                                                fail(-ENOMEM);
+                                                return;
+                                        }
+                                        reap_one();
+                                }
+                                pending_len = 0;
+                        }
+                        size_t n = std::min<uint64_t>(len, chunk_size - pending_len);
+                        memcpy(pending + pending_len, data, n);
+                        pending_len += n;
+                        data += n;
+                        len -= n;
+                        if (pending_len == chunk_size)
+                        {
+                                submit_pending();
+                        }
+                }
+        }
+
+        // 把不满一个块的尾巴写出去, 并等待所有请求完成
+        void flush()
+        {
+                if (pending != nullptr && pending_len > 0)
+                {
+                        submit_pending();
+                }
+                while (window.in_flight() > 0 || !retries.empty() || !failed.empty())
+                {
+                        reap_one();
+                }
+                drop_pending();
+        }
+
+        // 不阻塞: 收掉已经完成的写(可能触发on_commit), 重发到期的重试
+        // 事件循环里驱动上传引擎用, 不会为了等aio卡住别的连接
+        void poll()
+        {
+                resubmit_due();
+                uint64_t offset;
+                int ret;
+                while (window.in_flight() > 0 && window.wait_one_for(std::chrono::steady_clock::duration::zero(), offset, ret))
+                {
+                        complete(offset, ret);
+                }
+                if (!failed.empty() && window.in_flight() == 0 && stat_completion == nullptr)
+                {
+                        start_resync();
+                }
+                if (stat_completion != nullptr && stat_completion->is_complete())
+                {
+                        finish_resync();
+                }
+                resubmit_due();
+        }
+
+        // flush的不阻塞版本: 只把尾巴发出去, 之后反复poll直到idle()
+        void flush_async()
+        {
+                if (pending != nullptr && pending_len > 0)
+                {
+                        submit_pending();
+                }
+                drop_pending();
+        }
+
+        // 发出on_ready回调里的一块; 这块已经不在等了(比如上传失败的时候丢掉了)返回false
+        bool admit(uint64_t offset)
+        {
+                if (held.erase(offset) == 0)
+                {
+                        return false;
+                }
+                while (window.full() && error_code == 0)
+                {
+                        reap_one();
+                }
+                if (error_code != 0)
+                {
+                        discard(offset);
+                        return false;
+                }
+                dispatch(offset);
+                return true;
+        }
+
+        // 没有在攒, 等放行, 在途或者等重试的数据了
+        bool idle()
+        {
+                return (pending == nullptr || pending_len == 0 || error_code != 0) && held.empty() && window.in_flight() == 0 &&
+                       retries.empty() && failed.empty() && stat_completion == nullptr;
+        }
+
+        // 放弃上传: 等放行的, 等重试的和正在攒的都丢掉, 在途的回来以后也丢掉, 之后poll到idle()再析构就不用等
+        void cancel()
+        {
+                fail(-ECANCELED);
+        }
+
+        // 写失败了(重试用完了或者不能重试)返回负的错误码, 否则返回0; 失败以后对象里只有committed()之前的数据是完整的
+        int error() const
+        {
+                return error_code;
+        }
+
+        // 已确认写入的连续前缀(续传从这里开始)
+        uint64_t committed() const
+        {
+                return committed_offset;
+        }
+
+        // 已经发给集群的数据的末尾, 减去committed()就是还在集群路上的字节数
+        uint64_t submitted() const
+        {
+                return next_offset;
+        }
+
+        aligned_buffer_pool &buffers()
+        {
+                return pool;
+        }
+
+        const retry_policy &retry_stats() const
+        {
+                return retry;
+        }
+
+private:
+        void submit_pending()
+        {
+                // 窗口满了先等一个完成; 等放行的块还没占窗口, 不用等
+                while (!on_ready && window.full() && error_code == 0)
+                {
+                        reap_one();
+                }
+                if (error_code != 0)
+                {
+                        drop_pending();
+                        return;
+                }
+                uint64_t offset = next_offset;
+                size_t len = pending_len;
+                in_flight[offset] = {aligned_buffer_pool::wrap(pending, len), pending};
+                pending = nullptr;
+                pending_len = 0;
+                next_offset += len;
+                if (on_ready)
+                {
+                        // 回调里可能直接就admit了, 放在最后调
+                        held.insert(offset);
+                        on_ready(offset, len);
+                        return;
+                }
+                dispatch(offset);
+        }
+
+        // 发出一块已经在in_flight里的数据
+        void dispatch(uint64_t offset)
+        {
+                if (append_only && (!failed.empty() || !retries.empty()))
+                {
+                        // 追加池前面有块在等重发, 这一块不能插队, 排在它们后面一起发
+                        if (failed.empty())
+                        {
+                                retries.emplace(retries.rbegin()->first, offset);
+                        }
+                        else
+                        {
+                                failed.insert(offset);
+                        }
+                        return;
+                }
+                int ret = submit(offset);
+                if (ret < 0)
+                {
+                        std::cerr << "Couldn't start write object! error " << ret << std::endl;
+                        complete(offset, ret);
+                }
+        }
+
+        int submit(uint64_t offset)
+        {
+                librados::bufferlist &bl = in_flight[offset].bl;
+                return window.submit(offset, [&](librados::AioCompletion *c) {
+                        return io_ctx.aio_write(object_name, c, bl, bl.length(), offset);
+                });
+        }
+
+        // 这一块写失败了, 能重试就排到退避时间以后重发, 数据还在它的缓冲区里
+        void schedule_retry(uint64_t offset, int ret)
+        {
+                write_op &op = in_flight[offset];
+                if (!retry.should_retry(ret, op.attempts))
+                {
+                        std::cerr << "Couldn't write object! error " << ret << std::endl;
+                        fail(ret);
+                        discard(offset);
+                        return;
+                }
+                std::chrono::milliseconds delay = retry.backoff(op.attempts);
+                std::cerr << "Write at offset " << offset << " failed with error " << ret << ", retrying in "
+                          << delay.count() << " ms." << std::endl;
+                op.attempts++;
+                retries.emplace(std::chrono::steady_clock::now() + delay, offset);
+        }
+
+        // 退避时间到了的块重新发出去
+        void resubmit_due()
+        {
+                auto now = std::chrono::steady_clock::now();
+                while (!retries.empty() && retries.begin()->first <= now && !window.full())
+                {
+                        uint64_t offset = retries.begin()->second;
+                        retries.erase(retries.begin());
+                        int ret = submit(offset);
+                        if (ret < 0)
+                        {
+                                complete(offset, ret);
+                        }
+                }
+        }
+
+        // 追加池的重新对齐: 失败的块都回来了以后先查对象现在多长
+        // stat也是异步的, poll()里不会为了等它卡住调用方的事件循环
+        void start_resync()
+        {
+                stat_completion = librados::Rados::aio_create_completion();
+                int ret = io_ctx.aio_stat(object_name, stat_completion, &stat_size, nullptr);
+                if (ret < 0)
+                {
+                        stat_completion->release();
+                        stat_completion = nullptr;
+                        std::cerr << "Couldn't stat object! error " << ret << std::endl;
+                        fail(ret);
+                }
+        }
+
+        // stat回来了: 已经落盘的块算写完, 剩下的从对象末尾重发
+        void finish_resync()
+        {
+                int ret = stat_completion->get_return_value();
+                stat_completion->release();
+                stat_completion = nullptr;
+                uint64_t object_size = ret < 0 ? 0 : stat_size;
+                if (ret < 0 && ret != -ENOENT)
+                {
+                        std::cerr << "Couldn't stat object! error " << ret << std::endl;
+                        fail(ret);
+                        return;
+                }
+                // 已经落盘的块算写完了
+                while (!failed.empty() && *failed.begin() + in_flight[*failed.begin()].bl.length() <= object_size)
+                {
+                        uint64_t offset = *failed.begin();
+                        failed.erase(failed.begin());
+                        succeed(offset);
+                }
+                if (failed.empty())
+                {
+                        return;
+                }
+                uint64_t first = *failed.begin();
+                write_op &op = in_flight[first];
+                if (first != object_size)
+                {
+                        std::cerr << "Object '" << object_name << "' is " << object_size << " bytes, expected " << first
+                                  << ", it was modified by someone else!" << std::endl;
+                        fail(-ESTALE);
+                        return;
+                }
+                // 没发出去过的块(error是0)不用判断, 跟着前面的一起发
+                if (op.error != 0 && !retry.should_retry(op.error, op.attempts))
+                {
+                        std::cerr << "Couldn't write object! error " << op.error << std::endl;
+                        fail(op.error);
+                        return;
+                }
+                std::chrono::milliseconds delay = retry.backoff(op.attempts);
+                std::cerr << "Write at offset " << first << " failed with error " << op.error << ", resending from there in "
+                          << delay.count() << " ms." << std::endl;
+                // 同一个时刻的按插入顺序重发, 也就是按偏移量从小到大
+                auto due = std::chrono::steady_clock::now() + delay;
+                for (uint64_t offset : failed)
+                {
+                        in_flight[offset].attempts++;
+                        in_flight[offset].error = 0;
+                        retries.emplace(due, offset);
+                }
+                failed.clear();
+        }
+
+        void reap_one()
+        {
+                if (!failed.empty() && window.in_flight() == 0)
+                {
+                        if (stat_completion == nullptr)
+                        {
+                                start_resync();
+                        }
+                        if (stat_completion != nullptr)
+                        {
+                                stat_completion->wait_for_complete();
+                                finish_resync();
+                        }
+                        return;
+                }
+                resubmit_due();
+                uint64_t offset;
+                int ret;
+                if (window.in_flight() == 0 && retries.empty())
+                {
+                        // 失败以后排着的都丢掉了, 没有可等的
+                        return;
+                }
+                if (retries.empty())
+                {
+                        window.wait_one(offset, ret);
+                }
+                else
+                {
+                        // 有块在等重试的时候最多等到它该重发的时刻
+                        auto delay = retries.begin()->first - std::chrono::steady_clock::now();
+                        if (!window.wait_one_for(std::max(delay, std::chrono::steady_clock::duration::zero()), offset, ret))
+                        {
+                                resubmit_due();
+                                return;
+                        }
+                }
+                complete(offset, ret);
+        }
+
+        // 处理一个完成的写: 失败的排队重试, 成功的推进已确认的前缀
+        void complete(uint64_t offset, int ret)
+        {
+                if (ret < 0 && error_code != 0)
+                {
+                        // 已经放弃了, 晚回来的失败不再重试
+                        discard(offset);
+                        return;
+                }
+                if (ret < 0 && append_only)
+                {
+                        in_flight[offset].error = ret;
+                        failed.insert(offset);
+                        return;
+                }
+                if (ret < 0)
+                {
+                        schedule_retry(offset, ret);
+                        return;
+                }
+                succeed(offset);
+        }
+
+        // 一块写完了, 推进已确认的前缀
+        void succeed(uint64_t offset)
+        {
+                completed[offset] = in_flight[offset].bl.length();
+                pool.release(in_flight[offset].buf);
+                in_flight.erase(offset);
+                // 只有前面的块都写完了, 前缀才能往前推
+                bool advanced = false;
+                auto it = completed.begin();
+                while (it != completed.end() && it->first == committed_offset)
+                {
+                        committed_offset += it->second;
+                        it = completed.erase(it);
+                        advanced = true;
+                }
+                if (advanced && on_commit)
+                {
+                        on_commit(committed_offset);
+                }
+        }
+
+        // 放弃上传: 记下错误, 排着重发的块和正在攒的块都丢掉, 在途的回来以后再丢
+        void fail(int ret)
+        {
+                if (error_code == 0)
+                {
+                        error_code = ret;
+                }
+                for (auto &entry : retries)
+                {
+                        discard(entry.second);
+                }
+                retries.clear();
+                for (uint64_t offset : failed)
+                {
+                        discard(offset);
+                }
+                failed.clear();
+                for (uint64_t offset : held)
+                {
+                        discard(offset);
+                }
+                held.clear();
+                drop_pending();
+        }
+
+        void discard(uint64_t offset)
+        {
+                pool.release(in_flight[offset].buf);
+                in_flight.erase(offset);
+        }
+
+        void drop_pending()
+        {
+                if (error_code != 0 && pending != nullptr)
+                {
+                        pool.release(pending);
+                        pending = nullptr;
+                        pending_len = 0;
+                }
+        }
+
+        librados::IoCtx &io_ctx;
+        std::string object_name;
+        struct write_op
+        {
+                librados::bufferlist bl;
+                char *buf;
+                unsigned attempts = 1;
+                int error = 0; // 追加池里失败等着重新对齐的块的错误码
+        };
+
+        uint64_t chunk_size;
+        aligned_buffer_pool pool;
+        char *pending = nullptr; // 正在攒的块
+        size_t pending_len = 0;
+        std::map<uint64_t, write_op> in_flight;
+        std::map<uint64_t, uint64_t> completed;
+        retry_policy retry;
+        std::multimap<std::chrono::steady_clock::time_point, uint64_t> retries; // 重发时间 -> 块的偏移量
+        aio_window window;
+        uint64_t next_offset;
+        uint64_t committed_offset;
+        const bool append_only;
+        std::set<uint64_t> failed; // 追加池里失败了, 等在途的都回来以后重新对齐的块
+        std::set<uint64_t> held;   // 攒满了等on_ready的调用方admit的块
+        librados::AioCompletion *stat_completion = nullptr; // 重新对齐前查对象长度的stat, 没在查是nullptr
+        uint64_t stat_size = 0;
+        int error_code = 0;
+};
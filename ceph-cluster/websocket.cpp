@@ -0,0 +1,1368 @@
+#include "compression.h"
+#include "crypto.h"
+#include "fair_scheduler.h"
+#include "file_hash.h"
+#include "progress.h"
+#include "stream_protocol.h"
+#include "upload_engine.h"
+#include <atomic>
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/websocket.hpp>
+#include <cctype>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <optional>
+#include <pthread.h>
+#include <rados/librados.hpp>
+#include <sched.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// websocket网关: 浏览器通过一个websocket连接同时上传很多个文件, 协议见stream_protocol.h
+// 每个上传流直接喂给自己的上传引擎(stripe_writer), 连接按核分片, 每个分片一个线程一个io_context异步处理,
+// 上传引擎的完成靠定时poll收, 不会为了等某个OSD卡住别的流
+// 同一个端口上 GET /<池>/<对象名> 直接下载对象, 支持Range, 可以断点续传和拖动播放
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+using tcp = net::ip::tcp;
+
+struct gateway_options
+{
+        size_t max_streams = 1024;                 // 一个连接上同时打开的流
+        uint64_t chunks_per_stream = 4;           // 一个流最多有几块数据在网关里(在攒, 排队或者在写)
+        uint64_t connection_budget = 256 << 20;   // 一个连接所有流的额度加起来不超过这个
+        uint64_t session_inflight_limit = 64 << 20; // 一个连接在集群路上的字节数超过这个就暂停读socket
+        uint64_t memory_limit = 1ull << 30;       // 所有连接收到了还没写进集群的数据加起来的上限
+        size_t max_message = 8 << 20;             // 一个websocket消息的上限
+        std::chrono::milliseconds poll_interval{2}; // 多久收一次上传引擎的完成
+        std::chrono::milliseconds progress_interval{250}; // 多久给客户端发一次进度
+        uint64_t read_chunk = 4 << 20;            // 下载时一个读请求的大小
+        size_t read_ahead = 8;                    // 下载时在socket前面提前发出去的读请求数
+        std::chrono::seconds http_timeout{30};    // HTTP读请求头和发数据的超时
+        size_t max_in_flight = 64;                // 一个分片同时放给集群的请求数(上传的块和下载的分段读)
+        size_t interactive_reserved = 16;         // 其中留给交互优先级的
+};
+
+// 所有分片共用的内存预算, 防止OSD恢复的时候集群写得慢, 网关把数据越攒越多
+// reserved是给出去还没写进集群的额度, 给额度之前先从这里预留, 所有会话加起来不超过上限;
+// buffered是实际收到了还没写进集群的字节数, 超了上限的会话暂停读socket
+class memory_budget
+{
+public:
+        explicit memory_budget(uint64_t limit) : limit(limit) {}
+
+        // 最多预留want字节, 返回实际预留到的
+        uint64_t reserve(uint64_t want)
+        {
+                uint64_t used = reserved.load();
+                while (true)
+                {
+                        uint64_t n = std::min(want, used < limit ? limit - used : 0);
+                        if (n == 0 || reserved.compare_exchange_weak(used, used + n))
+                        {
+                                return n;
+                        }
+                }
+        }
+
+        void unreserve(uint64_t n)
+        {
+                reserved -= n;
+        }
+
+        void add_buffered(int64_t n)
+        {
+                buffered += n;
+        }
+
+        bool over() const
+        {
+                return buffered.load() >= static_cast<int64_t>(limit);
+        }
+
+private:
+        const uint64_t limit;
+        std::atomic<uint64_t> reserved{0};
+        std::atomic<int64_t> buffered{0};
+};
+
+// 每个池的IoCtx只创建一次, 每个分片一份, 只在分片自己的线程里用, 不用加锁
+class pool_cache
+{
+public:
+        explicit pool_cache(librados::Rados &cluster) : cluster(cluster) {}
+
+        ~pool_cache()
+        {
+                for (auto &entry : io_ctxs)
+                {
+                        entry.second->close();
+                }
+        }
+
+        librados::IoCtx *get(const std::string &pool, int &ret)
+        {
+                auto it = io_ctxs.find(pool);
+                if (it != io_ctxs.end())
+                {
+                        return it->second.get();
+                }
+                std::unique_ptr<librados::IoCtx> io_ctx(new librados::IoCtx);
+                ret = cluster.ioctx_create(pool.c_str(), *io_ctx);
+                if (ret < 0)
+                {
+                        std::cerr << "Couldn't set up ioctx for pool '" << pool << "'! error " << ret << std::endl;
+                        return nullptr;
+                }
+                return (io_ctxs[pool] = std::move(io_ctx)).get();
+        }
+
+        // 池的写对齐, 第一次用的时候查一次记下来, 不用每个OPEN都查
+        int write_alignment(const std::string &pool, librados::IoCtx &io_ctx, uint64_t &alignment)
+        {
+                auto it = alignments.find(pool);
+                if (it != alignments.end())
+                {
+                        alignment = it->second;
+                        return 0;
+                }
+                int ret = pool_write_alignment(io_ctx, alignment);
+                if (ret == 0)
+                {
+                        alignments[pool] = alignment;
+                }
+                return ret;
+        }
+
+private:
+        librados::Rados &cluster;
+        std::map<std::string, std::unique_ptr<librados::IoCtx>> io_ctxs;
+        std::map<std::string, uint64_t> alignments;
+};
+
+// 去掉了的流的上传引擎: 析构要等在途的写都回来, 集群慢的时候会卡住分片的线程
+// 交给这里, 分片定时收一下完成, 写都回来了再析构
+class writer_drain
+{
+public:
+        void add(std::unique_ptr<stripe_writer> writer)
+        {
+                writer->cancel();
+                writer->on_ready = nullptr;
+                if (!writer->idle())
+                {
+                        writers.push_back(std::move(writer));
+                }
+        }
+
+        void reap()
+        {
+                for (auto it = writers.begin(); it != writers.end();)
+                {
+                        (*it)->poll();
+                        it = (*it)->idle() ? writers.erase(it) : std::next(it);
+                }
+        }
+
+private:
+        std::list<std::unique_ptr<stripe_writer>> writers;
+};
+
+// 发一个librados aio请求, 完成以后在executor的线程里调用handler(返回值)
+// librados的回调线程只负责转交, 不碰会话的任何状态
+template <class Executor>
+int submit_aio(const Executor &executor, const std::function<int(librados::AioCompletion *)> &submit,
+               std::function<void(int)> handler)
+{
+        struct aio_op
+        {
+                Executor executor;
+                std::function<void(int)> handler;
+                librados::AioCompletion *completion;
+        };
+        aio_op *op = new aio_op{executor, std::move(handler), nullptr};
+        op->completion = librados::Rados::aio_create_completion(op, [](librados::completion_t, void *arg) {
+                aio_op *op = static_cast<aio_op *>(arg);
+                int ret = op->completion->get_return_value();
+                op->completion->release();
+                net::post(op->executor, [handler = std::move(op->handler), ret] { handler(ret); });
+                delete op;
+        });
+        int ret = submit(op->completion);
+        if (ret < 0)
+        {
+                op->completion->release();
+                delete op;
+        }
+        return ret;
+}
+
+// 一个websocket连接, 上面有很多个上传流
+class gateway_session : public std::enable_shared_from_this<gateway_session>
+{
+public:
+        gateway_session(tcp::socket socket, pool_cache &pools, writer_drain &drain, fair_scheduler &scheduler, memory_budget &memory,
+                        const gateway_options &opts, const std::string &tenant)
+            : ws(std::move(socket)), timer(ws.get_executor()), pools(pools), drain(drain), scheduler(scheduler), memory(memory), opts(opts),
+              flow(scheduler.open_flow(tenant))
+        {
+        }
+
+        ~gateway_session()
+        {
+                drop_all();
+                scheduler.close_flow(flow);
+        }
+
+        // 升级请求已经由http_session读出来了, 这里只回握手
+        void start(http::request<http::empty_body> req)
+        {
+                ws.binary(true);
+                ws.read_message_max(opts.max_message);
+                ws.set_option(beast::websocket::stream_base::timeout::suggested(beast::role_type::server));
+                upgrade = std::move(req);
+                auto self = shared_from_this();
+                ws.async_accept(upgrade, [self](beast::error_code ec) {
+                        if (ec)
+                        {
+                                std::cerr << "WebSocket handshake failed: " << ec.message() << std::endl;
+                                return;
+                        }
+                        self->do_read();
+                        self->schedule_poll();
+                });
+        }
+
+private:
+        struct upload_stream
+        {
+                librados::IoCtx *io_ctx;
+                std::string object_name;
+                uint64_t size;
+                uint64_t received = 0;  // 收到的字节数
+                uint64_t granted = 0;   // 给过的额度总和, 客户端最多发到这里
+                uint64_t committed = 0; // 已经写进集群的字节数
+                uint64_t window;        // 这个流最多能欠的额度
+                uint64_t chunk;         // 上传引擎的块大小, 额度按整块给
+                bool append_only = false; // 要求对齐的池, 只能在对象末尾追加, 不能截断
+                uint64_t serial;          // 流编号会重用, 异步请求回来的时候靠这个认出还是不是原来那个流
+                bool opening = false;     // 追加池开始前清空旧对象的请求还没回来, 还没发ACCEPT
+                bool finishing = false;   // 收尾的请求发出去了, 等它回来发DONE
+                bool fin = false;
+                std::deque<uint64_t> tickets; // 调度器放行了发给集群还没写完的块, 存的是块的末尾
+                std::shared_ptr<progress_tracker> progress;
+                uint64_t reported = 0;        // 上次PROGRESS帧里的字节数
+                std::unique_ptr<stripe_writer> writer;
+                std::unique_ptr<range_hasher> hasher;
+        };
+
+        void do_read()
+        {
+                reading = true;
+                auto self = shared_from_this();
+                ws.async_read(buffer, [self](beast::error_code ec, size_t) {
+                        if (ec)
+                        {
+                                // 连接断了, 没传完的流都丢掉, 已经写了的部分留在对象里
+                                self->closed = true;
+                                self->timer.cancel();
+                                self->drop_all();
+                                return;
+                        }
+                        const char *data = static_cast<const char *>(self->buffer.data().data());
+                        self->handle(data, self->buffer.size());
+                        self->buffer.consume(self->buffer.size());
+                        // 集群跟不上就先不读, 数据留在内核的socket缓冲区里, TCP窗口关上以后发送方自然就停了
+                        if (self->should_pause())
+                        {
+                                self->reading = false;
+                                return;
+                        }
+                        self->do_read();
+                });
+        }
+
+        // 在集群路上的字节数超了这个连接的上限, 或者全局内存超了而自己还有写在途, 就暂停读
+        // 只在有写在途的时候暂停, 这些写完成以后一定会恢复, 不会卡死
+        bool should_pause()
+        {
+                uint64_t inflight = 0;
+                for (auto &entry : streams)
+                {
+                        inflight += entry.second.writer->submitted() - entry.second.writer->committed();
+                }
+                return inflight >= opts.session_inflight_limit || (inflight > 0 && memory.over());
+        }
+
+        void handle(const char *msg, size_t len)
+        {
+                stream_frame f;
+                if (!decode_stream_frame(msg, len, f))
+                {
+                        std::cerr << "Ignoring a malformed frame." << std::endl;
+                        return;
+                }
+                switch (f.type)
+                {
+                case FRAME_OPEN:
+                        open(f);
+                        break;
+                case FRAME_DATA:
+                        data(f);
+                        break;
+                case FRAME_FIN:
+                        fin(f);
+                        break;
+                case FRAME_RESET:
+                {
+                        // 客户端取消了, 在途的写由上传引擎的析构等完
+                        auto it = streams.find(f.stream_id);
+                        if (it != streams.end())
+                        {
+                                drop(it);
+                                grant_all();
+                        }
+                        break;
+                }
+                default:
+                        reset(f.stream_id, EPROTO);
+                        break;
+                }
+        }
+
+        void open(const stream_frame &f)
+        {
+                std::string spec(f.payload, f.payload_len);
+                size_t tab1 = spec.find('\t'), tab2 = tab1 == std::string::npos ? tab1 : spec.find('\t', tab1 + 1);
+                // 大小最多19位, 20位的可能超出uint64_t, stoull会抛异常
+                if (tab2 == std::string::npos || tab2 + 1 == spec.size() || spec.size() - tab2 - 1 > 19 ||
+                    spec.find_first_not_of("0123456789", tab2 + 1) != std::string::npos || streams.count(f.stream_id) > 0)
+                {
+                        send(encode_stream_frame(FRAME_RESET, f.stream_id, 0, EINVAL));
+                        return;
+                }
+                if (streams.size() >= opts.max_streams)
+                {
+                        send(encode_stream_frame(FRAME_RESET, f.stream_id, 0, EMFILE));
+                        return;
+                }
+                int ret = 0;
+                uint64_t alignment = 0;
+                std::string pool = spec.substr(0, tab1);
+                librados::IoCtx *io_ctx = pools.get(pool, ret);
+                if (io_ctx == nullptr || (ret = pools.write_alignment(pool, *io_ctx, alignment)) < 0)
+                {
+                        send(encode_stream_frame(FRAME_RESET, f.stream_id, 0, -ret));
+                        return;
+                }
+                uint32_t id = f.stream_id;
+                upload_stream &s = streams[id];
+                s.io_ctx = io_ctx;
+                s.object_name = spec.substr(tab1 + 1, tab2 - tab1 - 1);
+                s.size = std::stoull(spec.substr(tab2 + 1));
+                s.append_only = alignment != 0;
+                s.serial = next_serial++;
+                s.chunk = write_chunk_size(alignment);
+                s.window = s.chunk * opts.chunks_per_stream;
+                s.writer.reset(new stripe_writer(*io_ctx, s.object_name, 0, alignment));
+                s.writer->on_ready = [this, id](uint64_t offset, uint64_t len) { schedule_write(id, offset, len); };
+                s.hasher.reset(new range_hasher(range_hasher::TREE, s.size));
+                s.progress = progress_registry::instance().start(s.object_name, s.size);
+                if (!s.append_only)
+                {
+                        accept(id, s);
+                        return;
+                }
+                // 追加池不能覆盖旧对象, 从0开始写之前先清空, 清空了再ACCEPT; 异步发, 不卡住这个分片上别的连接
+                s.opening = true;
+                auto self = shared_from_this();
+                uint64_t serial = s.serial;
+                ret = submit_aio(ws.get_executor(), [&s](librados::AioCompletion *c) {
+                        librados::bufferlist empty;
+                        return s.io_ctx->aio_write_full(s.object_name, c, empty);
+                }, [self, id, serial](int ret) {
+                        auto it = self->find_stream(id, serial);
+                        if (it == self->streams.end())
+                        {
+                                return;
+                        }
+                        if (ret < 0)
+                        {
+                                self->reset(id, -ret);
+                                return;
+                        }
+                        it->second.opening = false;
+                        self->accept(id, it->second);
+                });
+                if (ret < 0)
+                {
+                        reset(id, -ret);
+                }
+        }
+
+        void accept(uint32_t id, upload_stream &s)
+        {
+                send(encode_stream_frame(FRAME_ACCEPT, id, 0, 0));
+                grant(id, s);
+        }
+
+        // 异步请求回来的时候找它的流, 流已经没了或者编号给了新的流返回end()
+        std::map<uint32_t, upload_stream>::iterator find_stream(uint32_t id, uint64_t serial)
+        {
+                auto it = streams.find(id);
+                return it != streams.end() && it->second.serial == serial ? it : streams.end();
+        }
+
+        void data(const stream_frame &f)
+        {
+                auto it = streams.find(f.stream_id);
+                if (it == streams.end())
+                {
+                        return;
+                }
+                upload_stream &s = it->second;
+                if (s.fin || f.offset != s.received || s.received + f.payload_len > s.granted)
+                {
+                        // 乱序或者超了额度
+                        reset(f.stream_id, EPROTO);
+                        return;
+                }
+                s.hasher->update(s.received, f.payload, f.payload_len);
+                s.writer->write(f.payload, f.payload_len);
+                s.received += f.payload_len;
+                memory.add_buffered(f.payload_len);
+        }
+
+        void fin(const stream_frame &f)
+        {
+                auto it = streams.find(f.stream_id);
+                if (it == streams.end())
+                {
+                        return;
+                }
+                upload_stream &s = it->second;
+                if (f.offset != s.received || s.received != s.size)
+                {
+                        reset(f.stream_id, EPROTO);
+                        return;
+                }
+                s.fin = true;
+                s.writer->flush_async();
+        }
+
+        // 给一个流发额度: 补到它的窗口, 但是整个连接和全局欠的额度都不超过预算
+        // 额度总是补到整块的边界(或者文件末尾), 给出去的数据收齐了就是整块, 一定会被写出去, 不会有半块数据占着额度卡住
+        // 额度只是网关里的缓冲区, 不算调度器的在途请求; 数据收齐一块要发给集群的时候才去调度器排队(schedule_write)
+        void grant(uint32_t id, upload_stream &s)
+        {
+                if (s.opening)
+                {
+                        return;
+                }
+                uint64_t outstanding = s.granted - s.committed;
+                uint64_t n = std::min({s.window > outstanding ? s.window - outstanding : 0,
+                                       opts.connection_budget > budget_used ? opts.connection_budget - budget_used : 0,
+                                       s.size - s.granted});
+                uint64_t target = s.granted + n;
+                if (target < s.size)
+                {
+                        target -= target % s.chunk;
+                }
+                n = target > s.granted ? memory.reserve(target - s.granted) : 0;
+                if (s.granted + n < s.size && (s.granted + n) % s.chunk != 0)
+                {
+                        // 全局只预留到了一部分, 不够整块就还回去
+                        memory.unreserve(n);
+                        n = 0;
+                }
+                if (n == 0)
+                {
+                        return;
+                }
+                budget_used += n;
+                s.granted += n;
+                send(encode_stream_frame(FRAME_CREDIT, id, 0, n));
+        }
+
+        // 上传引擎攒满了一块, 交给调度器排队, 放行的时候才发给集群, 写完了(release_tickets)才让出在途的位置
+        // 流已经没了或者上传引擎已经放弃了这块, 放行的位置马上还回去
+        void schedule_write(uint32_t id, uint64_t offset, uint64_t len)
+        {
+                scheduler.submit(flow, id, len, [this, id, offset, len] {
+                        auto it = streams.find(id);
+                        if (it == streams.end() || !it->second.writer->admit(offset))
+                        {
+                                scheduler.release();
+                                return;
+                        }
+                        it->second.tickets.push_back(offset + len);
+                });
+        }
+
+        // 写完了的块告诉调度器
+        void release_tickets(upload_stream &s, uint64_t committed)
+        {
+                while (!s.tickets.empty() && s.tickets.front() <= committed)
+                {
+                        s.tickets.pop_front();
+                        scheduler.release();
+                }
+        }
+
+        // 写完的流腾出了额度, 按流编号依次补给还缺额度的流
+        void grant_all()
+        {
+                for (auto &entry : streams)
+                {
+                        if (!entry.second.fin)
+                        {
+                                grant(entry.first, entry.second);
+                        }
+                }
+        }
+
+        // 去掉一个流, 它占着的额度, 内存和调度器里的位置都还回去
+        std::map<uint32_t, upload_stream>::iterator drop(std::map<uint32_t, upload_stream>::iterator it)
+        {
+                upload_stream &s = it->second;
+                scheduler.cancel(flow, it->first);
+                budget_used -= s.granted - s.committed;
+                memory.unreserve(s.granted - s.committed);
+                memory.add_buffered(-static_cast<int64_t>(s.received - s.committed));
+                release_tickets(s, UINT64_MAX);
+                // 在途的写交给分片去等, 这里不等
+                drain.add(std::move(s.writer));
+                return streams.erase(it);
+        }
+
+        void drop_all()
+        {
+                for (auto it = streams.begin(); it != streams.end();)
+                {
+                        it = drop(it);
+                }
+        }
+
+        void reset(uint32_t id, int err)
+        {
+                auto it = streams.find(id);
+                if (it != streams.end())
+                {
+                        drop(it);
+                }
+                send(encode_stream_frame(FRAME_RESET, id, 0, err));
+                grant_all();
+        }
+
+        // 收上传引擎的完成, 写进集群了的数据还成额度, 写完的流收尾
+        void poll()
+        {
+                bool freed = false;
+                for (auto it = streams.begin(); it != streams.end();)
+                {
+                        upload_stream &s = it->second;
+                        if (s.opening || s.finishing)
+                        {
+                                ++it;
+                                continue;
+                        }
+                        s.writer->poll();
+                        uint64_t committed = s.writer->committed();
+                        if (committed > s.committed)
+                        {
+                                budget_used -= committed - s.committed;
+                                memory.unreserve(committed - s.committed);
+                                memory.add_buffered(-static_cast<int64_t>(committed - s.committed));
+                                s.committed = committed;
+                                s.progress->set(committed);
+                                release_tickets(s, committed);
+                                freed = true;
+                        }
+                        if (s.writer->error() < 0 && s.writer->idle())
+                        {
+                                // 这个流写不下去了(重试用完了或者不能重试的错误), 只重置它, 别的流照常
+                                send(encode_stream_frame(FRAME_RESET, it->first, 0, -s.writer->error()));
+                                it = drop(it);
+                                freed = true;
+                                continue;
+                        }
+                        if (s.fin && s.writer->idle())
+                        {
+                                // 收尾的请求发不出去的话会当场去掉这个流, 先往后走一步
+                                uint32_t id = it->first;
+                                ++it;
+                                finish(id, s);
+                                continue;
+                        }
+                        ++it;
+                }
+                if (freed)
+                {
+                        grant_all();
+                }
+                else
+                {
+                        // 全局内存满的时候要不到额度的流, 别的会话释放了内存不会通知这里, 每次poll再要一次
+                        for (auto &entry : streams)
+                        {
+                                upload_stream &s = entry.second;
+                                if (!s.fin && s.granted < s.size && s.granted - s.committed < s.window)
+                                {
+                                        grant(entry.first, s);
+                                }
+                        }
+                }
+                send_progress();
+                // 写完了一些, 暂停的读接着读
+                if (!reading && !closed && !should_pause())
+                {
+                        do_read();
+                }
+        }
+
+        // 进度按固定频率发, 不是每写完一块就发一次
+        void send_progress()
+        {
+                auto now = std::chrono::steady_clock::now();
+                if (now - last_progress < opts.progress_interval)
+                {
+                        return;
+                }
+                last_progress = now;
+                for (auto &entry : streams)
+                {
+                        upload_stream &s = entry.second;
+                        if (s.committed != s.reported)
+                        {
+                                s.reported = s.committed;
+                                send(encode_stream_frame(FRAME_PROGRESS, entry.first, s.committed, 0));
+                        }
+                }
+        }
+
+        // 数据都写完了: 截掉旧对象更长的尾巴, 存哈希, 去掉旧的压缩/加密标记
+        // 先异步读出对象现在的xattr, 再把截断, 存哈希和去掉标记放在一个写操作里异步发, 都回来了再发DONE
+        // 只去掉真有的标记: 复合操作里rmxattr一个没有的xattr会让整个操作失败
+        void finish(uint32_t id, upload_stream &s)
+        {
+                s.finishing = true;
+                auto self = shared_from_this();
+                uint64_t serial = s.serial;
+                auto xattrs = std::make_shared<std::map<std::string, librados::bufferlist>>();
+                int ret = submit_aio(ws.get_executor(), [&s, xattrs](librados::AioCompletion *c) {
+                        return s.io_ctx->aio_getxattrs(s.object_name, c, *xattrs);
+                }, [self, id, serial, xattrs](int ret) {
+                        auto it = self->find_stream(id, serial);
+                        if (it != self->streams.end())
+                        {
+                                // 大小是0的新对象还不存在
+                                self->finish_write(it, ret == -ENOENT ? 0 : ret, *xattrs);
+                        }
+                });
+                if (ret < 0)
+                {
+                        finished(streams.find(id), ret);
+                }
+        }
+
+        void finish_write(std::map<uint32_t, upload_stream>::iterator it, int ret, const std::map<std::string, librados::bufferlist> &xattrs)
+        {
+                if (ret < 0)
+                {
+                        finished(it, ret);
+                        return;
+                }
+                upload_stream &s = it->second;
+                librados::ObjectWriteOperation op;
+                librados::bufferlist empty;
+                // 追加池开始前清空过, 对象正好是这么长
+                if (s.size == 0)
+                {
+                        op.write_full(empty);
+                }
+                else if (!s.append_only)
+                {
+                        op.truncate(s.size);
+                }
+                std::string tree_hash;
+                if (s.hasher->finish(tree_hash))
+                {
+                        librados::bufferlist bl;
+                        bl.append(tree_hash);
+                        op.setxattr(hash_xattr_tree, bl);
+                }
+                for (const char *name : {compress_xattr_codec, crypt_xattr_alg, crypt_xattr_key})
+                {
+                        if (xattrs.count(name) > 0)
+                        {
+                                op.rmxattr(name);
+                        }
+                }
+                auto self = shared_from_this();
+                uint32_t id = it->first;
+                uint64_t serial = s.serial;
+                ret = submit_aio(ws.get_executor(), [&s, &op](librados::AioCompletion *c) {
+                        return s.io_ctx->aio_operate(s.object_name, c, &op);
+                }, [self, id, serial](int ret) {
+                        auto it = self->find_stream(id, serial);
+                        if (it != self->streams.end())
+                        {
+                                self->finished(it, ret);
+                        }
+                });
+                if (ret < 0)
+                {
+                        finished(it, ret);
+                }
+        }
+
+        // 收尾的请求回来了, 告诉客户端结果, 流腾出来的额度给别的流
+        void finished(std::map<uint32_t, upload_stream>::iterator it, int ret)
+        {
+                if (ret < 0)
+                {
+                        std::cerr << "Couldn't finish object '" << it->second.object_name << "'! error " << ret << std::endl;
+                }
+                send(ret < 0 ? encode_stream_frame(FRAME_RESET, it->first, 0, -ret)
+                             : encode_stream_frame(FRAME_DONE, it->first, it->second.size, 0));
+                drop(it);
+                grant_all();
+        }
+
+        void schedule_poll()
+        {
+                auto self = shared_from_this();
+                timer.expires_after(opts.poll_interval);
+                timer.async_wait([self](beast::error_code ec) {
+                        if (ec)
+                        {
+                                return;
+                        }
+                        self->poll();
+                        self->schedule_poll();
+                });
+        }
+
+        // 同一时间只能有一个async_write, 其余的排队
+        void send(std::string msg)
+        {
+                outbox.push_back(std::move(msg));
+                if (outbox.size() == 1)
+                {
+                        do_write();
+                }
+        }
+
+        void do_write()
+        {
+                auto self = shared_from_this();
+                ws.async_write(net::buffer(outbox.front()), [self](beast::error_code ec, size_t) {
+                        if (ec)
+                        {
+                                return;
+                        }
+                        self->outbox.pop_front();
+                        if (!self->outbox.empty())
+                        {
+                                self->do_write();
+                        }
+                });
+        }
+
+        beast::websocket::stream<tcp::socket> ws;
+        http::request<http::empty_body> upgrade;
+        net::steady_timer timer;
+        beast::flat_buffer buffer;
+        std::deque<std::string> outbox;
+        pool_cache &pools;
+        writer_drain &drain;
+        fair_scheduler &scheduler;
+        memory_budget &memory;
+        const gateway_options &opts;
+        const uint64_t flow; // 这个连接在调度器里的流
+        std::map<uint32_t, upload_stream> streams;
+        uint64_t next_serial = 0;
+        uint64_t budget_used = 0; // 所有流欠着的额度
+        bool reading = false;     // 有没有一个async_read在等, 暂停的时候是false
+        std::chrono::steady_clock::time_point last_progress;
+        bool closed = false;
+};
+
+// 解析Range头, 只支持一个范围: bytes=a-b, bytes=a-, bytes=-n
+// 返回1是有效的范围, 0是没有Range或者认不出来(按整个对象回200), -1是范围超出了对象(回416)
+int parse_range(beast::string_view value, uint64_t size, uint64_t &first, uint64_t &last)
+{
+        const beast::string_view unit = "bytes=";
+        if (!value.starts_with(unit) || value.find(',') != beast::string_view::npos)
+        {
+                return 0;
+        }
+        std::string spec(value.substr(unit.size()));
+        size_t dash = spec.find('-');
+        std::string a = spec.substr(0, dash), b = dash == std::string::npos ? "" : spec.substr(dash + 1);
+        auto digits = [](const std::string &v) {
+                return !v.empty() && v.size() <= 19 && std::all_of(v.begin(), v.end(), [](unsigned char c) { return isdigit(c); });
+        };
+        if (dash == std::string::npos || (a.empty() && b.empty()) || (!a.empty() && !digits(a)) || (!b.empty() && !digits(b)))
+        {
+                return 0;
+        }
+        if (a.empty())
+        {
+                // 最后n个字节
+                uint64_t n = std::stoull(b);
+                if (n == 0 || size == 0)
+                {
+                        return -1;
+                }
+                first = size - std::min(n, size);
+                last = size - 1;
+                return 1;
+        }
+        first = std::stoull(a);
+        last = b.empty() ? size - 1 : std::min<uint64_t>(std::stoull(b), size - 1);
+        if (!b.empty() && std::stoull(b) < first)
+        {
+                return 0;
+        }
+        return first < size ? 1 : -1;
+}
+
+// "%2F"这种转回原来的字符, 对象名里可以有斜杠和空格
+std::string percent_decode(beast::string_view in)
+{
+        std::string out;
+        for (size_t i = 0; i < in.size(); i++)
+        {
+                if (in[i] == '%' && i + 2 < in.size() && isxdigit(static_cast<unsigned char>(in[i + 1])) &&
+                    isxdigit(static_cast<unsigned char>(in[i + 2])))
+                {
+                        out.push_back(static_cast<char>(std::stoi(std::string(in.substr(i + 1, 2)), nullptr, 16)));
+                        i += 2;
+                }
+                else
+                {
+                        out.push_back(in[i]);
+                }
+        }
+        return out;
+}
+
+// 一个HTTP连接: 先读请求头, websocket升级请求交给gateway_session, GET/HEAD在这里直接下载对象
+// 下载时提前排read_ahead个分段读, 由调度器放行, 读回来的bufferlist按顺序直接交给socket:
+// 每个bufferlist的分段就是librados收数据时的缓冲区, 做成scatter/gather数组给async_write, 不拼成一块, 也不拷贝
+class http_session : public std::enable_shared_from_this<http_session>
+{
+public:
+        http_session(tcp::socket socket, pool_cache &pools, writer_drain &drain, fair_scheduler &scheduler, memory_budget &memory,
+                     const gateway_options &opts)
+            : stream(std::move(socket)), pools(pools), drain(drain), scheduler(scheduler), memory(memory), opts(opts)
+        {
+        }
+
+        ~http_session()
+        {
+                close_flow();
+                for (auto &slot : slots)
+                {
+                        memory.unreserve(slot.reserved);
+                }
+        }
+
+        void start()
+        {
+                do_read_request();
+        }
+
+private:
+        // 一个分段读, 按偏移量顺序排在slots里
+        struct read_slot
+        {
+                uint64_t offset;
+                uint64_t length;
+                uint64_t reserved; // 从全局内存预算里预留的字节数
+                librados::bufferlist bl;
+                bool done = false;
+                int ret = 0;
+        };
+
+        void do_read_request()
+        {
+                parser.emplace();
+                stream.expires_after(opts.http_timeout);
+                auto self = shared_from_this();
+                http::async_read(stream, buffer, *parser, [self](beast::error_code ec, size_t) {
+                        if (ec)
+                        {
+                                self->close();
+                                return;
+                        }
+                        self->handle(self->parser->release());
+                });
+        }
+
+        void handle(http::request<http::empty_body> req)
+        {
+                // 租户就是客户端地址, 请求里自己报的不算数, 不然谁都能冒充别的租户或者给自己提优先级; 优先级在租户配置里定
+                beast::error_code ec;
+                std::string tenant = stream.socket().remote_endpoint(ec).address().to_string();
+                if (beast::websocket::is_upgrade(req))
+                {
+                        stream.expires_never();
+                        std::make_shared<gateway_session>(stream.release_socket(), pools, drain, scheduler, memory, opts, tenant)->start(std::move(req));
+                        return;
+                }
+                close_flow();
+                flow = scheduler.open_flow(tenant);
+                has_flow = true;
+                keep_alive = req.keep_alive();
+                head_only = req.method() == http::verb::head;
+                if (req.method() != http::verb::get && !head_only)
+                {
+                        reply_error(http::status::method_not_allowed, req.version());
+                        return;
+                }
+                // 路径是 /<池>/<对象名>, 对象名里可以再有斜杠
+                beast::string_view target = req.target();
+                target = target.substr(0, target.find('?'));
+                size_t slash = target.find('/', 1);
+                if (target.size() < 2 || target[0] != '/' || slash == beast::string_view::npos || slash + 1 == target.size())
+                {
+                        reply_error(http::status::not_found, req.version());
+                        return;
+                }
+                int ret = 0;
+                io_ctx = pools.get(percent_decode(target.substr(1, slash - 1)), ret);
+                if (io_ctx == nullptr)
+                {
+                        reply_error(http::status::not_found, req.version());
+                        return;
+                }
+                object_name = percent_decode(target.substr(slash + 1));
+                request = std::move(req);
+                stat_object();
+        }
+
+        // 一次请求拿到大小和xattr
+        void stat_object()
+        {
+                op.reset(new librados::ObjectReadOperation);
+                attrs.clear();
+                op->stat(&size, nullptr, nullptr);
+                op->getxattrs(&attrs, nullptr);
+                auto self = shared_from_this();
+                int ret = submit_aio(stream.get_executor(), [this](librados::AioCompletion *c) {
+                        return io_ctx->aio_operate(object_name, c, op.get(), nullptr);
+                }, [self](int ret) { self->on_stat(ret); });
+                if (ret < 0)
+                {
+                        on_stat(ret);
+                }
+        }
+
+        void on_stat(int ret)
+        {
+                op.reset();
+                unsigned version = request.version();
+                if (ret == -ENOENT)
+                {
+                        reply_error(http::status::not_found, version);
+                        return;
+                }
+                if (ret < 0)
+                {
+                        std::cerr << "Couldn't stat object '" << object_name << "'! error " << ret << std::endl;
+                        reply_error(http::status::service_unavailable, version);
+                        return;
+                }
+                // 压缩或者加密过的对象存的是帧, 按原文件的偏移量取不出来, 要用ceph2 download在客户端解
+                if (attrs.count(compress_xattr_codec) != 0 || attrs.count(crypt_xattr_alg) != 0)
+                {
+                        reply_error(http::status::not_implemented, version);
+                        return;
+                }
+                std::string etag;
+                if (attrs.count(hash_xattr_tree) != 0)
+                {
+                        etag = "\"" + attrs[hash_xattr_tree].to_str() + "\"";
+                }
+
+                first = 0;
+                last = size - 1;
+                int range = 0;
+                auto range_field = request.find(http::field::range);
+                auto if_range = request.find(http::field::if_range);
+                // If-Range对不上说明文件变了, 回整个文件
+                if (range_field != request.end() && (if_range == request.end() || (!etag.empty() && if_range->value() == etag)))
+                {
+                        range = parse_range(range_field->value(), size, first, last);
+                }
+
+                response.emplace(range == 1 ? http::status::partial_content : http::status::ok, version);
+                response->set(http::field::accept_ranges, "bytes");
+                response->set(http::field::content_type, "application/octet-stream");
+                if (!etag.empty())
+                {
+                        response->set(http::field::etag, etag);
+                }
+                response->keep_alive(keep_alive);
+                if (range == -1)
+                {
+                        response->result(http::status::range_not_satisfiable);
+                        response->set(http::field::content_range, "bytes */" + std::to_string(size));
+                        first = 1;
+                        last = 0;
+                }
+                else if (range == 1)
+                {
+                        response->set(http::field::content_range, "bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(size));
+                }
+                else if (size == 0)
+                {
+                        first = 1;
+                        last = 0;
+                }
+                response->content_length(last + 1 - first);
+                if (head_only)
+                {
+                        last = first - 1;
+                }
+                next_read = first;
+                write_header();
+        }
+
+        void reply_error(http::status status, unsigned version)
+        {
+                response.emplace(status, version);
+                response->keep_alive(keep_alive);
+                response->content_length(0);
+                first = 1;
+                last = 0;
+                write_header();
+        }
+
+        // 响应头先发出去, 数据跟在后面
+        void write_header()
+        {
+                serializer.emplace(*response);
+                stream.expires_after(opts.http_timeout);
+                auto self = shared_from_this();
+                http::async_write_header(stream, *serializer, [self](beast::error_code ec, size_t) {
+                        if (ec)
+                        {
+                                self->close();
+                                return;
+                        }
+                        self->fill();
+                        self->send_next();
+                });
+        }
+
+        // 在socket前面保持read_ahead个读请求; 每个要先从全局内存预算里预留,
+        // 预留不到的时候至少留一个在读, 保证下载能往前走
+        void fill()
+        {
+                while (next_read <= last && slots.size() < opts.read_ahead)
+                {
+                        uint64_t len = std::min(opts.read_chunk, last + 1 - next_read);
+                        uint64_t reserved = memory.reserve(len);
+                        if (reserved < len && !slots.empty())
+                        {
+                                memory.unreserve(reserved);
+                                break;
+                        }
+                        slots.push_back(read_slot{next_read, len, reserved});
+                        read_slot *slot = &slots.back();
+                        next_read += len;
+                        auto self = shared_from_this();
+                        scheduler.submit(flow, 0, len, [self, slot] { self->start_read(slot); });
+                }
+        }
+
+        // 调度器放行了一个分段读
+        void start_read(read_slot *slot)
+        {
+                auto self = shared_from_this();
+                int ret = submit_aio(stream.get_executor(), [this, slot](librados::AioCompletion *c) {
+                        return io_ctx->aio_read(object_name, c, &slot->bl, slot->length, slot->offset);
+                }, [self, slot](int ret) {
+                        self->scheduler.release();
+                        slot->done = true;
+                        slot->ret = ret;
+                        self->send_next();
+                });
+                if (ret < 0)
+                {
+                        scheduler.release();
+                        slot->done = true;
+                        slot->ret = ret;
+                        // 可能是在调度器里被调过来的, 出错处理放到后面
+                        net::post(stream.get_executor(), [self] { self->send_next(); });
+                }
+        }
+
+        // 最前面那个读回来了就发出去, 同一时间只有一个async_write
+        void send_next()
+        {
+                if (writing || failed)
+                {
+                        return;
+                }
+                if (slots.empty())
+                {
+                        if (next_read > last)
+                        {
+                                finish_response();
+                        }
+                        return;
+                }
+                read_slot &slot = slots.front();
+                if (!slot.done)
+                {
+                        return;
+                }
+                if (slot.ret < 0 || slot.bl.length() != slot.length)
+                {
+                        // 响应头已经发出去了, 只能断开连接, 客户端看到长度不够可以用Range续传
+                        std::cerr << "Couldn't read object '" << object_name << "' at " << slot.offset << "! error " << slot.ret << std::endl;
+                        failed = true;
+                        close();
+                        return;
+                }
+                iov.clear();
+                for (const auto &ptr : slot.bl.buffers())
+                {
+                        iov.emplace_back(ptr.c_str(), ptr.length());
+                }
+                writing = true;
+                stream.expires_after(opts.http_timeout);
+                auto self = shared_from_this();
+                net::async_write(stream, iov, [self](beast::error_code ec, size_t) {
+                        self->writing = false;
+                        if (ec)
+                        {
+                                self->failed = true;
+                                self->close();
+                                return;
+                        }
+                        self->memory.unreserve(self->slots.front().reserved);
+                        self->slots.pop_front();
+                        self->fill();
+                        self->send_next();
+                });
+        }
+
+        void finish_response()
+        {
+                serializer.reset();
+                response.reset();
+                if (!keep_alive)
+                {
+                        close();
+                        return;
+                }
+                do_read_request();
+        }
+
+        void close()
+        {
+                close_flow();
+                beast::error_code ec;
+                stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+        }
+
+        // 还在排队的分段读不要了, 它们拿着的会话引用也一起放掉
+        void close_flow()
+        {
+                if (has_flow)
+                {
+                        has_flow = false;
+                        scheduler.close_flow(flow);
+                }
+        }
+
+        beast::tcp_stream stream;
+        beast::flat_buffer buffer;
+        std::optional<http::request_parser<http::empty_body>> parser;
+        http::request<http::empty_body> request;
+        std::optional<http::response<http::empty_body>> response;
+        std::optional<http::response_serializer<http::empty_body>> serializer;
+        pool_cache &pools;
+        writer_drain &drain;
+        fair_scheduler &scheduler;
+        memory_budget &memory;
+        const gateway_options &opts;
+        uint64_t flow = 0; // 当前请求在调度器里的流
+        bool has_flow = false;
+        bool keep_alive = false;
+        bool head_only = false;
+
+        librados::IoCtx *io_ctx = nullptr;
+        std::string object_name;
+        std::unique_ptr<librados::ObjectReadOperation> op;
+        std::map<std::string, librados::bufferlist> attrs;
+        uint64_t size = 0;
+        uint64_t first = 0, last = 0; // 要发的范围, 两头都包含; first > last表示没有数据
+        uint64_t next_read = 0;
+        std::deque<read_slot> slots;  // deque在两头增删不会让别的元素挪位置, 读请求可以直接写进slot.bl
+        std::vector<net::const_buffer> iov;
+        bool writing = false;
+        bool failed = false;
+};
+
+// 一个分片: 一个线程跑一个io_context, 有自己的集群连接和IoCtx
+// 连接分到哪个分片就一直在那个线程里处理, 会话之间不共享任何东西, 不用加锁, 也不会在核之间抢锁和缓存行
+struct gateway_shard
+{
+        net::io_context ioc{1};
+        librados::Rados cluster;
+        std::unique_ptr<pool_cache> pools;
+        std::unique_ptr<writer_drain> drain; // 在pools后面, 先析构, 用着的IoCtx还在
+        std::unique_ptr<fair_scheduler> scheduler;
+        std::unique_ptr<net::steady_timer> tick;
+        std::thread thread;
+};
+
+// 租户的令牌不够时请求在调度器里等着, 定时再跑一下调度器, 补回来的令牌就能用上; 顺便收一下去掉了的流的写
+void schedule_tick(gateway_shard &shard, std::chrono::milliseconds interval)
+{
+        shard.tick->expires_after(interval);
+        shard.tick->async_wait([&shard, interval](beast::error_code ec) {
+                if (ec)
+                {
+                        return;
+                }
+                shard.scheduler->run();
+                shard.drain->reap();
+                schedule_tick(shard, interval);
+        });
+}
+
+int connect_cluster(librados::Rados &cluster)
+{
+        char cluster_name[] = "ceph";
+        char user_name[] = "client.admin";
+        int ret = cluster.init2(user_name, cluster_name, 0);
+        if (ret < 0 || (ret = cluster.conf_read_file("/etc/ceph/ceph.conf")) < 0 || (ret = cluster.connect()) < 0)
+        {
+                return ret;
+        }
+        return 0;
+}
+
+// 把当前线程绑到一个核上, 分片的数据一直在这个核的缓存里
+void pin_to_cpu(unsigned cpu)
+{
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (ret != 0)
+        {
+                std::cerr << "Couldn't pin thread to CPU " << cpu << "! error " << ret << std::endl;
+        }
+}
+
+// 接受连接的socket直接建在下一个分片的io_context上, 轮流分给各个分片
+void do_accept(tcp::acceptor &acceptor, std::vector<std::unique_ptr<gateway_shard>> &shards, size_t next,
+               memory_budget &memory, const gateway_options &opts)
+{
+        gateway_shard &shard = *shards[next];
+        acceptor.async_accept(shard.ioc, [&acceptor, &shards, &shard, next, &memory, &opts](beast::error_code ec, tcp::socket socket) {
+                if (ec)
+                {
+                        std::cerr << "Couldn't accept a connection: " << ec.message() << std::endl;
+                }
+                else
+                {
+                        // 会话在它自己分片的线程里创建和运行
+                        net::post(shard.ioc, [&shard, &memory, &opts, socket = std::move(socket)]() mutable {
+                                std::make_shared<http_session>(std::move(socket), *shard.pools, *shard.drain, *shard.scheduler, memory, opts)->start();
+                        });
+                }
+                do_accept(acceptor, shards, (next + 1) % shards.size(), memory, opts);
+        });
+}
+
+// 用法: websocket [端口] [分片数]
+// 分片数默认每个核一个; 设置了CEPH2_GATEWAY_PIN就把第i个分片绑到第i个核上
+// CEPH2_GATEWAY_MEMORY_MB是所有连接缓冲数据的总上限, 默认1024
+// CEPH2_GATEWAY_TENANTS是租户限速的配置文件(格式见fair_scheduler.h), 不设置就不限速, 只做公平排队和优先级
+// CEPH2_PROGRESS_METRICS是Prometheus指标文件的路径, 每秒更新一次所有上传流的进度和速率
+int main(int argc, const char **argv)
+{
+        unsigned short port = argc > 1 ? static_cast<unsigned short>(atoi(argv[1])) : 8080;
+        unsigned shard_count = argc > 2 ? std::max(1, atoi(argv[2])) : std::max(1u, std::thread::hardware_concurrency());
+        bool pin = getenv("CEPH2_GATEWAY_PIN") != nullptr;
+
+        gateway_options opts;
+        if (getenv("CEPH2_GATEWAY_MEMORY_MB") != nullptr)
+        {
+                opts.memory_limit = std::stoull(getenv("CEPH2_GATEWAY_MEMORY_MB")) << 20;
+        }
+        memory_budget memory(opts.memory_limit);
+        std::unique_ptr<tenant_registry> tenants(load_tenant_registry(getenv("CEPH2_GATEWAY_TENANTS")));
+
+        // 每个分片一个集群连接: librados一个连接里的请求都要经过同一把objecter锁, 分开以后各核互不干扰
+        std::vector<std::unique_ptr<gateway_shard>> shards;
+        for (unsigned i = 0; i < shard_count; i++)
+        {
+                std::unique_ptr<gateway_shard> shard(new gateway_shard);
+                int ret = connect_cluster(shard->cluster);
+                if (ret < 0)
+                {
+                        std::cerr << "Couldn't connect to cluster! error " << ret << std::endl;
+                        return EXIT_FAILURE;
+                }
+                shard->pools.reset(new pool_cache(shard->cluster));
+                shard->drain.reset(new writer_drain);
+                shard->scheduler.reset(new fair_scheduler(*tenants, opts.max_in_flight, opts.interactive_reserved));
+                shard->tick.reset(new net::steady_timer(shard->ioc));
+                schedule_tick(*shard, opts.poll_interval);
+                shards.push_back(std::move(shard));
+        }
+
+        // 监听socket放在第0个分片上, 接受连接只占它一点点时间
+        tcp::acceptor acceptor(shards[0]->ioc, {tcp::v4(), port});
+        std::cout << "Gateway listening on port " << port << " with " << shard_count << " shards." << std::endl;
+        do_accept(acceptor, shards, 0, memory, opts);
+        progress_reporter progress;
+        if (getenv("CEPH2_PROGRESS_METRICS") != nullptr)
+        {
+                progress.add_sink(metrics_progress_sink(getenv("CEPH2_PROGRESS_METRICS")));
+        }
+        progress.start();
+        for (unsigned i = 0; i < shard_count; i++)
+        {
+                gateway_shard &shard = *shards[i];
+                shard.thread = std::thread([&shard, i, pin] {
+                        if (pin)
+                        {
+                                pin_to_cpu(i % std::max(1u, std::thread::hardware_concurrency()));
+                        }
+                        // 没有连接的时候也不要退出
+                        auto guard = net::make_work_guard(shard.ioc);
+                        shard.ioc.run();
+                });
+        }
+        for (auto &shard : shards)
+        {
+                shard->thread.join();
+        }
+        for (auto &shard : shards)
+        {
+                shard->drain.reset();
+                shard->pools.reset();
+                shard->cluster.shutdown();
+        }
+        return 0;
+}